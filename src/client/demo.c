@@ -28,7 +28,7 @@ int main(int argc, char *argv[])
 
 	struct gossip gsp = {0};
 	struct gossip_node *gnode = make_gossip_node(pubkey);
-	JSON_ADD_INT(gnode->data, "weight", rand() % 1000);
+	JSON_ADD_INT(gossip_node_get_data(gnode), "weight", rand() % 1000);
 	gnode->version++;
 	gnode->update_time = time(NULL);
 
@@ -39,7 +39,12 @@ int main(int argc, char *argv[])
 		gossip_node_set_full(gnode, ipaddr, port);
 
 	assert(gossip_init(&gsp, gnode, port) == 0);
-	if (argc == 3) gossip_add_seeds(&gsp, argv[2]);
+	gossip_serve_bootstrap(&gsp, port);
+	if (argc == 3) {
+		gossip_add_seeds(&gsp, argv[2]);
+		if (gsp.nr_seeds && gossip_bootstrap(&gsp, gsp.seeds[0]) < 0)
+			printf("bootstrap from %s failed\n", gsp.seeds[0]);
+	}
 	while (!exit_flag) gossip_loop_once(&gsp);
 	gossip_close(&gsp);
 
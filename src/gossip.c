@@ -1,6 +1,8 @@
 #include "gossip.h"
 #include <errno.h>
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,6 +15,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
+#include "gossip_trace.h"
+#include "lz.h"
 #include "utils.h"
 
 #define NR_HASH 919
@@ -29,10 +33,43 @@ static unsigned int calc_tag(const void *buf, size_t len)
 	return retval;
 }
 
+/*
+ * clock
+ */
+
+static gossip_clock_fn gossip_clock;
+
+void gossip_set_clock(gossip_clock_fn clock)
+{
+	gossip_clock = clock;
+}
+
+int64_t gossip_now(void)
+{
+	return gossip_clock ? gossip_clock() : time(NULL);
+}
+
+// a random number, that of another process started alike included
+static uint32_t random_u32(void)
+{
+	uint32_t r;
+	FILE *fp = fopen("/dev/urandom", "rb");
+	if (fp) {
+		size_t n = fread(&r, sizeof(r), 1, fp);
+		fclose(fp);
+		if (n == 1)
+			return r;
+	}
+	return (uint32_t)gossip_now() ^ (uint32_t)getpid() << 16;
+}
+
 /*
  * gossip_node
  */
 
+DEFINE_SER_FUNCS(gossip_node, struct gossip_node, GOSSIP_NODE_SER_FIELDS)
+DEFINE_SER_FUNCS(gossip_node_wire, struct gossip_node, GOSSIP_NODE_WIRE_FIELDS)
+
 struct gossip_node *make_gossip_node(const char *pubkey)
 {
 	struct gossip_node *gnode = malloc(sizeof(*gnode));
@@ -46,9 +83,13 @@ struct gossip_node *make_gossip_node(const char *pubkey)
 	gnode->pubkey = strdup(pubkey);
 	gnode->pubid = do_sha1(pubkey, strlen(pubkey) + 1);
 	gnode->version = 0;
-	gnode->alive_time = time(NULL);
-	gnode->update_time = time(NULL);
+	gnode->alive_time = gossip_now();
+	gnode->alive_seen = gnode->alive_time;
+	gnode->update_time = gossip_now();
+	gossip_coord_init(&gnode->coord);
+	gnode->bcast_link = GOSSIP_BCAST_NONE;
 	gnode->data = json_object_new_object();
+	gnode->wire_version = -1;
 
 	INIT_HLIST_NODE(&gnode->hash_node);
 	INIT_LIST_HEAD(&gnode->node);
@@ -62,34 +103,159 @@ void free_gossip_node(struct gossip_node *gnode)
 	free(gnode->public_ipaddr);
 	free(gnode->pubkey);
 	free(gnode->pubid);
+	free(gnode->zone);
+	free(gnode->wire);
 
 	json_object_put(gnode->data);
 	free(gnode);
 }
 
+/*
+ * The data of a node learned from the network is kept as the text it was
+ * received as, inside gnode->wire, and only parsed when asked for.
+ */
+json_object *gossip_node_get_data(struct gossip_node *gnode)
+{
+	if (gnode->data)
+		return gnode->data;
+
+	if (gnode->wire) {
+		// the data object is the last member of the wire form
+		const char *start = gnode->wire + gnode->wire_data;
+		size_t len = gnode->wire_len - gnode->wire_data - 1;
+		JSON_PARSE(data, start, len);
+		gnode->data = data;
+	}
+
+	if (!gnode->data)
+		gnode->data = json_object_new_object();
+
+	return gnode->data;
+}
+
+static void gossip_node_invalidate(struct gossip_node *gnode)
+{
+	gossip_node_get_data(gnode);
+	gnode->wire_version = -1;
+}
+
+/*
+ * Wire form of a node: the full entry less alive_time, which changes without
+ * the version being bumped and is written in front of it by put_gnode_full().
+ * The zone is only there for a node in one.
+ */
+static void gossip_node_wire_head(const struct gossip_node *gnode,
+                                  struct ser_buf *sb)
+{
+	gossip_node_wire_dump(gnode, sb);
+	if (gnode->zone) {
+		sb->len--;
+		ser_buf_puts(sb, ",\"zone\":");
+		ser_buf_put_string(sb, gnode->zone);
+		ser_buf_putc(sb, '}');
+	}
+}
+
+// on failure, no wire form is left, not even that of an older version
+static int gossip_node_set_wire(struct gossip_node *gnode,
+                                const char *data, size_t data_len)
+{
+	char tmp[512];
+	struct ser_buf sb;
+
+	ser_buf_init(&sb, tmp, sizeof(tmp));
+	gossip_node_wire_head(gnode, &sb);
+
+	// "...,"data":" + data + "}"
+	size_t len = sb.len - 1 + 8 + data_len + 1;
+	char *wire = realloc(gnode->wire, len + 1);
+	if (!wire) {
+		free(gnode->wire);
+		gnode->wire = NULL;
+		gnode->wire_len = 0;
+		gnode->wire_version = -1;
+		return -1;
+	}
+
+	if (sb.len < sizeof(tmp)) {
+		memcpy(wire, tmp, sb.len - 1);
+	} else {
+		ser_buf_init(&sb, wire, len + 1);
+		gossip_node_wire_head(gnode, &sb);
+	}
+
+	gnode->wire_data = sb.len - 1 + 8;
+	memcpy(wire + sb.len - 1, ",\"data\":", 8);
+	memcpy(wire + gnode->wire_data, data, data_len);
+	wire[len - 1] = '}';
+	wire[len] = '\0';
+
+	gnode->wire = wire;
+	gnode->wire_len = len;
+	gnode->wire_version = gnode->version;
+	return 0;
+}
+
+static const char *gossip_node_get_wire(struct gossip_node *gnode, size_t *len)
+{
+	if (!gnode->wire || gnode->wire_version != gnode->version) {
+		const char *data = json_object_to_json_string_ext(
+			gossip_node_get_data(gnode), JSON_C_TO_STRING_PLAIN);
+		if (gossip_node_set_wire(gnode, data, strlen(data)))
+			return NULL;
+	}
+
+	*len = gnode->wire_len;
+	return gnode->wire;
+}
+
+// address literals only, a peer cannot make us wait on a name lookup
+static void gossip_node_resolve(struct gossip_node *gnode)
+{
+	if (gnode->full_node)
+		gsp_addr_resolve(&gnode->addr, gnode->public_ipaddr,
+		                 gnode->public_port, true);
+	else
+		gsp_addr_clear(&gnode->addr);
+}
+
 void gossip_node_set_full(struct gossip_node *gnode,
                           const char *ipaddr, int port)
 {
+	gossip_node_invalidate(gnode);
 	gnode->full_node = 1;
 	free(gnode->public_ipaddr);
 	gnode->public_ipaddr = strdup(ipaddr);
 	gnode->public_port = port;
+	gossip_node_resolve(gnode);
 }
 
 void gossip_node_unset_full(struct gossip_node *gnode)
 {
+	gossip_node_invalidate(gnode);
 	gnode->full_node = 0;
 	free(gnode->public_ipaddr);
 	gnode->public_ipaddr = strdup("");
 	gnode->public_port = 0;
+	gossip_node_resolve(gnode);
+}
+
+void gossip_node_set_zone(struct gossip_node *gnode, const char *zone)
+{
+	gossip_node_invalidate(gnode);
+	free(gnode->zone);
+	gnode->zone = zone && *zone ? strdup(zone) : NULL;
 }
 
 json_object *gossip_node_to_json(const struct gossip_node *gnode)
 {
-	json_object *root = serialize(gnode, gossip_node_meta);
+	json_object *root = gossip_node_serialize(gnode);
+	if (gnode->zone)
+		JSON_ADD_STRING(root, "zone", gnode->zone);
 
 	json_object *data = NULL;
-	json_object_deep_copy(gnode->data, &data, NULL);
+	json_object_deep_copy(gossip_node_get_data((struct gossip_node *)gnode),
+	                      &data, NULL);
 	json_object_object_add(root, "data", data);
 
 	return root;
@@ -100,13 +266,21 @@ struct gossip_node *gossip_node_from_json(json_object *root)
 	struct gossip_node *gnode = malloc(sizeof(*gnode));
 	memset(gnode, 0, sizeof(*gnode));
 
-	if (deserialize(gnode, gossip_node_meta, root)) {
+	if (gossip_node_deserialize(gnode, root)) {
 		free(gnode);
 		return NULL;
 	}
 
+	const char *zone = JSON_GET_STRING(root, "zone");
+	gnode->zone = zone && *zone ? strdup(zone) : NULL;
+
 	json_object *data = json_object_object_get(root, "data");
 	json_object_deep_copy(data, &gnode->data, NULL);
+	gnode->wire_version = -1;
+	gnode->alive_seen = gossip_now();
+	gossip_coord_init(&gnode->coord);
+	gnode->bcast_link = GOSSIP_BCAST_NONE;
+	gossip_node_resolve(gnode);
 
 	INIT_HLIST_NODE(&gnode->hash_node);
 	INIT_LIST_HEAD(&gnode->node);
@@ -115,438 +289,2265 @@ struct gossip_node *gossip_node_from_json(json_object *root)
 	return gnode;
 }
 
-int gossip_node_update_from_json(struct gossip_node *gnode, json_object *root)
+/*
+ * Decode a full entry straight from the tokens of a received packet: the
+ * fields are copied out of the receive buffer, the data object is not parsed
+ * but kept as text in the wire form.
+ */
+static int gossip_node_update_from_tok(struct gossip_node *gnode,
+                                       const char *buf,
+                                       const struct json_tok *toks, int item)
 {
+	struct gossip_node tmp = {0};
+	if (gossip_node_scan(&tmp, buf, toks, item))
+		return -1;
+
+	int64_t version = gnode->version;
+
 	free(gnode->public_ipaddr);
 	free(gnode->pubkey);
 	free(gnode->pubid);
 	json_object_put(gnode->data);
 	gnode->data = NULL;
 
-	if (deserialize(gnode, gossip_node_meta, root))
+	gnode->full_node = tmp.full_node;
+	gnode->public_ipaddr = tmp.public_ipaddr;
+	gnode->public_port = tmp.public_port;
+	gnode->pubkey = tmp.pubkey;
+	gnode->pubid = tmp.pubid;
+	gnode->version = tmp.version;
+	if (tmp.alive_time > gnode->alive_time) {
+		gnode->alive_time = tmp.alive_time;
+		gnode->alive_seen = gossip_now();
+	}
+	gnode->update_time = tmp.update_time;
+	gossip_node_resolve(gnode);
+
+	free(gnode->zone);
+	gnode->zone = NULL;
+	int zone = json_tok_get(buf, toks, item, "zone");
+	if (zone >= 0 && toks[zone].type == JSON_TOK_STRING &&
+	    json_tok_len(&toks[zone]))
+		gnode->zone = json_tok_strdup(buf, &toks[zone]);
+
+	int data = json_tok_get(buf, toks, item, "data");
+	int ret;
+	if (data >= 0 && toks[data].type == JSON_TOK_OBJECT)
+		ret = gossip_node_set_wire(gnode, buf + toks[data].start,
+		                           json_tok_len(&toks[data]));
+	else
+		ret = gossip_node_set_wire(gnode, "{}", 2);
+
+	// without its data, the version is taken again in a later round
+	if (ret)
+		gnode->version = version;
+
+	return ret;
+}
+
+static struct gossip_node *
+gossip_node_from_tok(const char *buf, const struct json_tok *toks, int item)
+{
+	struct gossip_node *gnode = calloc(1, sizeof(*gnode));
+	if (!gnode) return NULL;
+	gossip_coord_init(&gnode->coord);
+	gnode->bcast_link = GOSSIP_BCAST_NONE;
+
+	if (gossip_node_update_from_tok(gnode, buf, toks, item)) {
+		free_gossip_node(gnode);
+		return NULL;
+	}
+
+	INIT_HLIST_NODE(&gnode->hash_node);
+	INIT_LIST_HEAD(&gnode->node);
+	INIT_LIST_HEAD(&gnode->active_node);
+
+	return gnode;
+}
+
+static int64_t monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * packet
+ *
+ * Packets are written straight into a per-thread send buffer, right after the
+ * compression dictionary so that they can be compressed in place. A packet
+ * that outgrows gsp->segment_len is cut into segments, each a packet of its
+ * own with the same header, compressed on its own when the peer takes it and
+ * padded with spaces up to segment_len, so that a train of them can leave in
+ * one segmentation offload write. A segment only exceeds segment_len when a
+ * single item does, and then goes on its own. An item that does not fit in
+ * the train is dropped, it will be exchanged in a later round.
+ */
+
+static const char gossip_lz_dict[] =
+	"{\"phase\":0,\"caps\":1,\"full_node\":0,\"gnodes\":["
+	"{\"pubid\":\"\",\"version\":0,\"update_time\":0},"
+	"{\"alive_time\":0,\"full_node\":1,\"public_ipaddr\":\"\","
+	"\"public_port\":0,\"pubkey\":\"\",\"pubid\":\"\",\"version\":0,"
+	"\"update_time\":0,\"data\":{}},"
+	"{\"pubid\":\"\",\"version\":0,\"alive_time\":0}]}";
+
+#define GOSSIP_LZ_DICT_LEN (sizeof(gossip_lz_dict) - 1)
+#define GOSSIP_PACKET_LEN_MAX GSP_UDP_RECV_BUF_LEN_MAX
+
+/*
+ * The buffers of a thread are one block, freed by the destructor of
+ * buffers_key when the thread exits, as the workers of an engine do.
+ */
+static __thread char *send_buf;  // dictionary, then the segment written
+static __thread char *lz_buf;    // dictionary, then a packet inflated
+static __thread char *train_buf; // segments ready to be sent
+
+static pthread_key_t buffers_key;
+static pthread_once_t buffers_once = PTHREAD_ONCE_INIT;
+static int buffers_key_err;
+
+static void make_buffers_key(void)
+{
+	buffers_key_err = pthread_key_create(&buffers_key, free);
+}
+
+static int prepare_buffers(void)
+{
+	if (send_buf)
+		return 0;
+
+	if (pthread_once(&buffers_once, make_buffers_key) || buffers_key_err)
 		return -1;
 
-	json_object *data = json_object_object_get(root, "data");
-	json_object_deep_copy(data, &gnode->data, NULL);
+	size_t len = GOSSIP_LZ_DICT_LEN + GOSSIP_PACKET_LEN_MAX;
+	char *bufs = malloc(2 * len + GOSSIP_PACKET_LEN_MAX);
+	if (!bufs)
+		return -1;
+	if (pthread_setspecific(buffers_key, bufs)) {
+		free(bufs);
+		return -1;
+	}
+
+	send_buf = bufs;
+	lz_buf = bufs + len;
+	train_buf = bufs + 2 * len;
+	memcpy(send_buf, gossip_lz_dict, GOSSIP_LZ_DICT_LEN);
+	memcpy(lz_buf, gossip_lz_dict, GOSSIP_LZ_DICT_LEN);
+	return 0;
+}
+
+struct packet {
+	struct gossip *gsp;
+	struct ser_buf sb;
+	int phase;
+	int caps;
+	int nr_items;      // of the segment being written
+	int nr_sent_items; // of the whole train
+	size_t item_start;
+	size_t head_len;   // the segment up to its first item
+	size_t seg_size;
+
+	int nr_segs;
+	size_t train_len;
+	size_t seg_lens[GOSSIP_MAX_SEGMENTS];
+
+	int64_t budget; // bytes the rate limit lets the train have
+};
+
+/*
+ * caps are those of the peer, deciding on compression, and to its address,
+ * or NULL for a packet that is not sent as a datagram and not budgeted here
+ */
+static int packet_begin(struct gossip *gsp, struct packet *pkt,
+                        int phase, int caps, const struct sockaddr *to)
+{
+	if (prepare_buffers())
+		return -1;
+
+	ser_buf_init(&pkt->sb, send_buf + GOSSIP_LZ_DICT_LEN,
+	             GOSSIP_PACKET_LEN_MAX);
+	pkt->gsp = gsp;
+	pkt->phase = phase;
+	pkt->caps = caps;
+	pkt->nr_items = 0;
+	pkt->nr_sent_items = 0;
+	pkt->head_len = 0;
+	pkt->nr_segs = 0;
+	pkt->train_len = 0;
+	pkt->budget = INT64_MAX;
+	if (to)
+		pkt->budget = gossip_rate_budget(&gsp->rate, to,
+		                                 monotonic_usec());
+
+	pkt->seg_size = GOSSIP_PACKET_LEN_MAX;
+	if (gsp->segment_len >= GOSSIP_SEGMENT_LEN_MIN &&
+	    gsp->segment_len < GOSSIP_PACKET_LEN_MAX)
+		pkt->seg_size = gsp->segment_len;
+
+	ser_buf_puts(&pkt->sb, "{\"phase\":");
+	ser_buf_put_int64(&pkt->sb, phase);
+	if (gsp->compress) {
+		ser_buf_puts(&pkt->sb, ",\"caps\":");
+		ser_buf_put_int64(&pkt->sb, GOSSIP_CAP_LZ);
+	}
+
+	return 0;
+}
+
+static void packet_begin_items(struct packet *pkt)
+{
+	ser_buf_puts(&pkt->sb, ",\"gnodes\":[");
+	pkt->head_len = pkt->sb.len;
+}
+
+// close the segment at end of the send buffer and append it to the train
+static int packet_flush(struct packet *pkt, size_t end, bool last)
+{
+	char *raw = pkt->sb.buf;
+	size_t len = end + 2;
+	size_t room = GOSSIP_PACKET_LEN_MAX - pkt->train_len;
+
+	if (pkt->nr_segs == GOSSIP_MAX_SEGMENTS || len > room ||
+	    (!last && pkt->seg_size > room))
+		return -1;
+
+	// "]}" goes over what follows the segment, the next item
+	char saved[2];
+	memcpy(saved, raw + end, 2);
+	memcpy(raw + end, "]}", 2);
+
+	char *out = train_buf + pkt->train_len;
+	size_t out_len = len;
+
+	int nr = 0;
+	if (pkt->gsp->compress && (pkt->caps & GOSSIP_CAP_LZ) &&
+	    len >= GOSSIP_LZ_MIN_LEN)
+		nr = lz_compress(send_buf, GOSSIP_LZ_DICT_LEN, len,
+		                 out + GOSSIP_LZ_HDR_LEN,
+		                 len - GOSSIP_LZ_HDR_LEN);
+
+	if (nr > 0) {
+		unsigned char *hdr = (unsigned char *)out;
+		hdr[0] = GOSSIP_LZ_MAGIC;
+		hdr[1] = len & 0xff;
+		hdr[2] = (len >> 8) & 0xff;
+		hdr[3] = (len >> 16) & 0xff;
+		hdr[4] = (len >> 24) & 0xff;
+		out_len = nr + GOSSIP_LZ_HDR_LEN;
+	} else {
+		memcpy(out, raw, len);
+	}
+
+	memcpy(raw + end, saved, 2);
+
+	if (!last && out_len < pkt->seg_size) {
+		memset(out + out_len, ' ', pkt->seg_size - out_len);
+		out_len = pkt->seg_size;
+	}
+
+	pkt->seg_lens[pkt->nr_segs++] = out_len;
+	pkt->train_len += out_len;
+	return 0;
+}
+
+static void packet_item_begin(struct packet *pkt)
+{
+	pkt->item_start = pkt->sb.len;
+	if (pkt->nr_items)
+		ser_buf_putc(&pkt->sb, ',');
+}
+
+static int packet_item_end(struct packet *pkt)
+{
+	struct ser_buf *sb = &pkt->sb;
+
+	// an item alone in its segment may exceed seg_size, not the buffer
+	if (sb->len + 2 > GOSSIP_PACKET_LEN_MAX)
+		goto drop;
+
+	if (sb->len + 2 > pkt->seg_size && pkt->nr_items) {
+		// move the item into a new segment after the same head
+		size_t item_len = sb->len - pkt->item_start - 1;
+
+		if (packet_flush(pkt, pkt->item_start, false))
+			goto drop;
+
+		memmove(sb->buf + pkt->head_len,
+		        sb->buf + pkt->item_start + 1, item_len);
+		sb->len = pkt->head_len + item_len;
+		sb->buf[sb->len] = '\0';
+		pkt->item_start = pkt->head_len; // where a drop now cuts it
+		pkt->nr_items = 0;
+	}
+
+	// room for the segment to close the train
+	if (pkt->train_len + sb->len + 2 > GOSSIP_PACKET_LEN_MAX)
+		goto drop;
+
+	// the current segment counts before compression
+	if ((int64_t)(pkt->train_len + sb->len + 2) > pkt->budget) {
+		pkt->gsp->stats.throttled++;
+		goto drop;
+	}
+
+	pkt->nr_items++;
+	pkt->nr_sent_items++;
+	return 0;
+
+drop:
+	sb->len = pkt->item_start;
+	sb->buf[sb->len] = '\0';
+	return -1;
+}
+
+static int packet_end(struct packet *pkt)
+{
+	// left empty by an item dropped after a flush
+	if (!pkt->nr_items && pkt->nr_segs)
+		return 0;
+
+	return packet_flush(pkt, pkt->sb.len, true);
+}
+
+static int put_gnode_min(struct packet *pkt, const struct gossip_node *gnode)
+{
+	packet_item_begin(pkt);
+	ser_buf_puts(&pkt->sb, "{\"pubid\":");
+	ser_buf_put_string(&pkt->sb, gnode->pubid);
+	ser_buf_puts(&pkt->sb, ",\"version\":");
+	ser_buf_put_int64(&pkt->sb, gnode->version);
+	ser_buf_puts(&pkt->sb, ",\"alive_time\":");
+	ser_buf_put_int64(&pkt->sb, gnode->alive_time);
+	if (gnode->zone) {
+		ser_buf_puts(&pkt->sb, ",\"zone\":");
+		ser_buf_put_string(&pkt->sb, gnode->zone);
+	}
+	ser_buf_putc(&pkt->sb, '}');
+	return packet_item_end(pkt);
+}
+
+// a pubid view received in a packet, copied back as is
+static int put_gnode_pubid(struct packet *pkt, const char *pubid, size_t len)
+{
+	packet_item_begin(pkt);
+	ser_buf_puts(&pkt->sb, "{\"pubid\":\"");
+	ser_buf_write(&pkt->sb, pubid, len);
+	ser_buf_puts(&pkt->sb, "\"}");
+	return packet_item_end(pkt);
+}
+
+static int put_gnode_full(struct packet *pkt, struct gossip_node *gnode)
+{
+	size_t len;
+	const char *wire = gossip_node_get_wire(gnode, &len);
+	if (!wire) return -1;
+
+	packet_item_begin(pkt);
+	ser_buf_puts(&pkt->sb, "{\"alive_time\":");
+	ser_buf_put_int64(&pkt->sb, gnode->alive_time);
+	ser_buf_putc(&pkt->sb, ',');
+	ser_buf_write(&pkt->sb, wire + 1, len - 1);
+	return packet_item_end(pkt);
+}
+
+/*
+ * Coordinates in the head of SYNC and ACK1: the point and height in
+ * microseconds, the error in thousandths, all integers to keep them short.
+ */
+static void put_coord(struct packet *pkt, const struct gossip_coord *coord)
+{
+	ser_buf_puts(&pkt->sb, ",\"coord\":[");
+	for (int i = 0; i < GOSSIP_COORD_DIMS; i++) {
+		ser_buf_put_int64(&pkt->sb, llround(coord->vec[i] * 1000));
+		ser_buf_putc(&pkt->sb, ',');
+	}
+	ser_buf_put_int64(&pkt->sb, llround(coord->height * 1000));
+	ser_buf_putc(&pkt->sb, ',');
+	ser_buf_put_int64(&pkt->sb, llround(coord->error * 1000));
+	ser_buf_putc(&pkt->sb, ']');
+}
 
+static int get_coord(const char *buf, const struct json_tok *toks,
+                     struct gossip_coord *coord)
+{
+	int arr = json_tok_get(buf, toks, 0, "coord");
+	if (arr < 0 || toks[arr].type != JSON_TOK_ARRAY ||
+	    toks[arr].size != GOSSIP_COORD_DIMS + 2)
+		return -1;
+
+	double val[GOSSIP_COORD_DIMS + 2];
+	int n = 0;
+	json_tok_array_for_each(item, toks, arr) {
+		if (!json_tok_is_int(buf, &toks[item]))
+			return -1;
+		val[n++] = json_tok_int64(buf, &toks[item]) / 1000.0;
+	}
+
+	if (val[GOSSIP_COORD_DIMS] < 0 || val[GOSSIP_COORD_DIMS + 1] < 0)
+		return -1;
+
+	memcpy(coord->vec, val, sizeof(coord->vec));
+	coord->height = val[GOSSIP_COORD_DIMS];
+	coord->error = val[GOSSIP_COORD_DIMS + 1];
+	if (coord->error > GOSSIP_COORD_ERROR_MAX)
+		coord->error = GOSSIP_COORD_ERROR_MAX;
 	return 0;
 }
 
+static ssize_t inflate_packet(const void *buf, size_t len)
+{
+	const unsigned char *hdr = buf;
+
+	if (len < GOSSIP_LZ_HDR_LEN || prepare_buffers())
+		return -1;
+
+	size_t raw_len = hdr[1] | hdr[2] << 8 | hdr[3] << 16 |
+		(size_t)hdr[4] << 24;
+	if (raw_len > GOSSIP_PACKET_LEN_MAX)
+		return -1;
+
+	int nr = lz_decompress((const char *)buf + GOSSIP_LZ_HDR_LEN,
+	                       len - GOSSIP_LZ_HDR_LEN, lz_buf,
+	                       GOSSIP_LZ_DICT_LEN, GOSSIP_LZ_DICT_LEN + raw_len);
+	if (nr < 0 || (size_t)nr != raw_len)
+		return -1;
+
+	return nr;
+}
+
+static void packet_account(struct gossip *gsp, int phase, size_t len)
+{
+	gsp->stats.tx_packets[phase]++;
+	gsp->stats.tx_bytes[phase] += len;
+	gossip_hist_add(&gsp->stats.packet_bytes, len);
+}
+
+static void send_packet(struct gossip *gsp, struct packet *pkt,
+                        const struct sockaddr *addr, socklen_t addr_len)
+{
+	GOSSIP_TRACE_BEGIN(trace_start);
+	packet_end(pkt);
+
+	// a run of full segments, and a short one closing it, is one write
+	size_t off = 0;
+	for (int i = 0; i < pkt->nr_segs;) {
+		size_t seg = pkt->seg_lens[i];
+		size_t len = seg;
+		int n = 1;
+
+		while (seg == pkt->seg_size && i + n < pkt->nr_segs &&
+		       pkt->seg_lens[i + n] <= seg) {
+			len += pkt->seg_lens[i + n];
+			if (pkt->seg_lens[i + n++] < seg)
+				break;
+		}
+
+		if (gsp_transport_write_segments(gsp->tp, train_buf + off, len,
+		                                 seg, addr, addr_len) < 0) {
+			gsp->stats.tx_errors++;
+		} else {
+			gossip_rate_charge(&gsp->rate, addr, len);
+			for (int j = 0; j < n; j++)
+				packet_account(gsp, pkt->phase,
+				               pkt->seg_lens[i + j]);
+		}
+
+		off += len;
+		i += n;
+	}
+
+	GOSSIP_TRACE_END(trace_start, GOSSIP_TRACE_SEND, pkt->phase,
+	                 pkt->nr_sent_items, pkt->train_len);
+}
+
+/*
+ * gossip
+ */
+
+static struct gossip_node *
+find_gossip_node(struct gossip *gsp, const char *pubid, size_t len)
+{
+	unsigned int tag = calc_tag(pubid, len);
+	struct hlist_head *head = &gsp->gnode_heads[tag_hash_fn(tag)];
+
+	struct gossip_node *pos;
+	hlist_for_each_entry(pos, head, hash_node) {
+		if (strncmp(pos->pubid, pubid, len) == 0 &&
+		    pos->pubid[len] == '\0')
+			return pos;
+	}
+
+	return NULL;
+}
+
+struct gossip_node *gossip_find_node(struct gossip *gsp, const char *pubid)
+{
+	return find_gossip_node(gsp, pubid, strlen(pubid));
+}
+
+/*
+ * zones
+ */
+
+// a zone name other than ours, while we are in one
+static bool zone_is_foreign(struct gossip *gsp, const char *name, size_t len)
+{
+	const char *ours = gsp->self->zone;
+
+	return ours && name && len &&
+		(strncmp(ours, name, len) || ours[len] != '\0');
+}
+
+static struct gossip_zone *get_zone(struct gossip *gsp, const char *name,
+                                    size_t len, bool create)
+{
+	for (int i = 0; i < gsp->nr_zones; i++) {
+		struct gossip_zone *zone = &gsp->zones[i];
+		if (strncmp(zone->name, name, len) == 0 &&
+		    zone->name[len] == '\0')
+			return zone;
+	}
+
+	if (!create || gsp->nr_zones == GOSSIP_MAX_ZONES)
+		return NULL;
+
+	struct gossip_zone *zones = realloc(gsp->zones,
+		(gsp->nr_zones + 1) * sizeof(*zones));
+	if (!zones)
+		return NULL;
+	gsp->zones = zones;
+
+	struct gossip_zone *zone = &zones[gsp->nr_zones];
+	memset(zone, 0, sizeof(*zone));
+	zone->name = strndup(name, len);
+	if (!zone->name)
+		return NULL;
+
+	gsp->nr_zones++;
+	return zone;
+}
+
+const struct gossip_zone *gossip_find_zone(struct gossip *gsp,
+                                           const char *name)
+{
+	return get_zone(gsp, name, strlen(name), false);
+}
+
+// the other zone gnode is in, NULL for ours or none
+static struct gossip_zone *foreign_zone(struct gossip *gsp,
+                                        const struct gossip_node *gnode)
+{
+	const char *name = gnode->zone;
+	if (!name || !zone_is_foreign(gsp, name, strlen(name)))
+		return NULL;
+	return get_zone(gsp, name, strlen(name), false);
+}
+
+// one more while a node of the zone is silent, to take in its replacement
+static int zone_max_reps(struct gossip *gsp, const struct gossip_zone *zone)
+{
+	if (zone->stale_time &&
+	    gossip_now() - zone->stale_time <= GOSSIP_ALIVE_TIMEOUT)
+		return gsp->zone_reps + 1;
+	return gsp->zone_reps;
+}
+
+// whether a node of zone name, from a packet, may be added
+static bool zone_admit(struct gossip *gsp, const char *buf,
+                       const struct json_tok *toks, int item)
+{
+	int tok = json_tok_get(buf, toks, item, "zone");
+	if (tok < 0 || toks[tok].type != JSON_TOK_STRING)
+		return true;
+
+	const char *name = buf + toks[tok].start;
+	size_t len = json_tok_len(&toks[tok]);
+	if (!zone_is_foreign(gsp, name, len))
+		return true;
+
+	struct gossip_zone *zone = get_zone(gsp, name, len, true);
+	return zone && zone->nr_reps < zone_max_reps(gsp, zone);
+}
+
+static void zone_account(struct gossip *gsp, struct gossip_node *gnode,
+                         int delta)
+{
+	const char *name = gnode->zone;
+	if (!name || !zone_is_foreign(gsp, name, strlen(name)))
+		return;
+
+	struct gossip_zone *zone = get_zone(gsp, name, strlen(name), true);
+	if (zone)
+		zone->nr_reps += delta;
+}
+
+// count the nodes of our zone, once a round
+static void update_own_zone(struct gossip *gsp)
+{
+	if (!gsp->self->zone)
+		return;
+
+	struct gossip_zone *zone = &gsp->zones[0];
+	zone->nr_nodes = 0;
+	zone->digest = 0;
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->gnodes, node) {
+		if (!pos->zone || strcmp(pos->zone, zone->name))
+			continue;
+
+		// order free: a sum of the hashes of each pubid and version
+		uint64_t h = calc_tag(pos->pubid, strlen(pos->pubid));
+		h = (h << 32 | h) ^ (uint64_t)pos->version;
+		zone->digest += h * 0x9e3779b97f4a7c15ULL;
+		zone->nr_nodes++;
+	}
+
+	zone->seen_time = gossip_now();
+}
+
+// the aggregate of our zone, in the head of SYNC and ACK1
+static void put_zone(struct gossip *gsp, struct packet *pkt)
+{
+	if (!gsp->self->zone)
+		return;
+
+	const struct gossip_zone *zone = &gsp->zones[0];
+	ser_buf_puts(&pkt->sb, ",\"zone\":");
+	ser_buf_put_string(&pkt->sb, zone->name);
+	ser_buf_puts(&pkt->sb, ",\"zone_nodes\":");
+	ser_buf_put_int64(&pkt->sb, zone->nr_nodes);
+	ser_buf_puts(&pkt->sb, ",\"zone_digest\":");
+	ser_buf_put_int64(&pkt->sb, (int64_t)zone->digest);
+}
+
+// the aggregate a member of another zone reports
+static void note_zone(struct gossip *gsp, const char *buf,
+                      const struct json_tok *toks)
+{
+	int tok = json_tok_get(buf, toks, 0, "zone");
+	if (tok < 0 || toks[tok].type != JSON_TOK_STRING)
+		return;
+
+	const char *name = buf + toks[tok].start;
+	size_t len = json_tok_len(&toks[tok]);
+	if (!zone_is_foreign(gsp, name, len))
+		return;
+
+	struct gossip_zone *zone = get_zone(gsp, name, len, true);
+	if (!zone)
+		return;
+
+	zone->nr_nodes = json_tok_get_int64(buf, toks, 0, "zone_nodes");
+	zone->digest = json_tok_get_int64(buf, toks, 0, "zone_digest");
+	zone->seen_time = gossip_now();
+}
+
+/*
+ * partial view
+ */
+
+static bool gossip_node_is_active(const struct gossip_node *gnode)
+{
+	return !list_empty(&gnode->active_node);
+}
+
+// a full node goes into the active view while it has room
+static void try_activate(struct gossip *gsp, struct gossip_node *gnode)
+{
+	if (!gnode->full_node || gossip_node_is_active(gnode) ||
+	    gnode == gsp->self)
+		return;
+	if (gsp->passive_view && gsp->nr_active_gnodes >= gsp->active_view)
+		return;
+
+	list_add(&gnode->active_node, &gsp->active_gnodes);
+	gsp->nr_active_gnodes++;
+}
+
+static void del_gossip_node(struct gossip *gsp, struct gossip_node *gnode);
+
+// a random passive node, a full one if full is set
+static struct gossip_node *get_random_passive_node(struct gossip *gsp,
+                                                   bool full)
+{
+	struct gossip_node *pick = NULL;
+	int nr_seen = 0;
+
+	// reservoir sampling, the passive view is small
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->gnodes, node) {
+		if (pos == gsp->self || gossip_node_is_active(pos) ||
+		    (full && !pos->full_node))
+			continue;
+		// as links must stay both ways, a broadcast link is kept
+		if (!full && pos->bcast_link != GOSSIP_BCAST_NONE)
+			continue;
+		if (rand() % ++nr_seen == 0)
+			pick = pos;
+	}
+
+	return pick;
+}
+
+/*
+ * Whether a new node may come in, making room for it if need be. A full view
+ * takes in a few nodes a round only, or entries would churn faster than
+ * rounds get them up to date; force skips that limit.
+ */
+static bool view_admit(struct gossip *gsp, bool force)
+{
+	if (!gsp->passive_view ||
+	    gsp->nr_gnodes <= gsp->active_view + gsp->passive_view)
+		return true;
+
+	if (!force && gsp->shuffle_left <= 0)
+		return false;
+
+	struct gossip_node *victim = get_random_passive_node(gsp, false);
+	if (!victim)
+		return false;
+
+	gsp->shuffle_left--;
+	del_gossip_node(gsp, victim);
+	return true;
+}
+
+// refill the active view from the passive one
+static void fill_active_view(struct gossip *gsp)
+{
+	while (gsp->passive_view &&
+	       gsp->nr_active_gnodes < gsp->active_view) {
+		struct gossip_node *gnode = get_random_passive_node(gsp, true);
+		if (!gnode)
+			break;
+		try_activate(gsp, gnode);
+	}
+}
+
+void gossip_set_partial_view(struct gossip *gsp, int active_view,
+                             int passive_view)
+{
+	gsp->active_view = active_view > 0 ? active_view : GOSSIP_ACTIVE_VIEW;
+	gsp->passive_view = passive_view > 0 ? passive_view :
+	                    GOSSIP_PASSIVE_VIEW;
+
+	// the surplus of the active view goes passive
+	struct gossip_node *pos, *n;
+	list_for_each_entry_safe(pos, n, &gsp->active_gnodes, active_node) {
+		if (gsp->nr_active_gnodes <= gsp->active_view)
+			break;
+		list_del_init(&pos->active_node);
+		gsp->nr_active_gnodes--;
+	}
+
+	while (gsp->nr_gnodes > gsp->active_view + gsp->passive_view) {
+		struct gossip_node *victim =
+			get_random_passive_node(gsp, false);
+		if (!victim)
+			break;
+		del_gossip_node(gsp, victim);
+	}
+}
+
+static void add_gossip_node(struct gossip *gsp, struct gossip_node *gnode)
+{
+	unsigned int tag = calc_tag(gnode->pubid, strlen(gnode->pubid));
+	struct hlist_head *head = &gsp->gnode_heads[tag_hash_fn(tag)];
+	hlist_add_head(&gnode->hash_node, head);
+
+	list_add(&gnode->node, &gsp->gnodes);
+	gsp->nr_gnodes++;
+
+	try_activate(gsp, gnode);
+	zone_account(gsp, gnode, 1);
+}
+
+static void del_gossip_node(struct gossip *gsp, struct gossip_node *gnode)
+{
+	zone_account(gsp, gnode, -1);
+
+	hlist_del(&gnode->hash_node);
+	list_del(&gnode->node);
+	gsp->nr_gnodes--;
+
+	if (!list_empty(&gnode->active_node)) {
+		list_del(&gnode->active_node);
+		gsp->nr_active_gnodes--;
+	}
+
+	free_gossip_node(gnode);
+}
+
+// a heartbeat of gnode, only ever moving it forward
+static void note_alive(struct gossip_node *gnode, int64_t alive_time)
+{
+	if (alive_time > gnode->alive_time) {
+		gnode->alive_time = alive_time;
+		gnode->alive_seen = gossip_now();
+	}
+}
+
+// how late an update of gnode reached us
+static void note_update(struct gossip *gsp, struct gossip_node *gnode)
+{
+	int64_t lag = gossip_now() - gnode->update_time;
+	gsp->stats.updates++;
+	gsp->sync_changes++;
+	gossip_hist_add(&gsp->stats.convergence_lag, lag > 0 ? lag : 0);
+}
+
+static int update_gossip_node(struct gossip *gsp, struct gossip_node *gnode,
+                              const char *buf, const struct json_tok *toks,
+                              int item)
+{
+	zone_account(gsp, gnode, -1);
+	int ret = gossip_node_update_from_tok(gnode, buf, toks, item);
+	zone_account(gsp, gnode, 1);
+	if (ret)
+		return -1;
+
+	note_update(gsp, gnode);
+
+	if (gnode->full_node && list_empty(&gnode->active_node)) {
+		try_activate(gsp, gnode);
+	} else if (!gnode->full_node && !list_empty(&gnode->active_node)) {
+		list_del_init(&gnode->active_node);
+		gsp->nr_active_gnodes--;
+	}
+
+	return 0;
+}
+
+static struct gossip_node *
+get_random_active_gossip_node(struct gossip *gsp)
+{
+	int index = 0;
+	int ran = rand() % gsp->nr_active_gnodes;
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->active_gnodes, active_node) {
+		if (index++ == ran)
+			return pos;
+	}
+
+	assert(false);
+	return NULL;
+}
+
+// the nearest of GOSSIP_NEAR_SAMPLES random active nodes
+static struct gossip_node *
+get_near_active_gossip_node(struct gossip *gsp)
+{
+	const struct gossip_coord *self = &gsp->self->coord;
+	struct gossip_node *near = NULL;
+	double near_dist = 0;
+	int nr_picked = 0;
+	int nr_left = gsp->nr_active_gnodes;
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->active_gnodes, active_node) {
+		// selection sampling, as make_packet_sync()
+		if (rand() % nr_left-- >= GOSSIP_NEAR_SAMPLES - nr_picked)
+			continue;
+
+		nr_picked++;
+		double dist = gossip_coord_dist(self, &pos->coord);
+		if (!near || dist < near_dist) {
+			near = pos;
+			near_dist = dist;
+		}
+	}
+
+	assert(near);
+	return near;
+}
+
+/*
+ * A node of another zone halfway to silent, which rounds seldom reach, or
+ * a silent one, to make room for its replacement and then let it go.
+ */
+static struct gossip_node *get_fading_active_gossip_node(struct gossip *gsp)
+{
+	int64_t now = gossip_now();
+	struct gossip_zone *zone;
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->active_gnodes, active_node) {
+		int64_t age = now - pos->alive_seen;
+		if (age <= GOSSIP_ALIVE_TIMEOUT / 2 ||
+		    !(zone = foreign_zone(gsp, pos)))
+			continue;
+		if (age <= GOSSIP_ALIVE_TIMEOUT ||
+		    zone->nr_reps >= zone_max_reps(gsp, zone))
+			return pos;
+	}
+
+	return NULL;
+}
+
+static struct gossip_node *pick_sync_node(struct gossip *gsp)
+{
+	struct gossip_node *gnode;
+
+	if (gsp->nr_zones > 1 && (gnode = get_fading_active_gossip_node(gsp)))
+		return gnode;
+
+	if (gsp->nr_active_gnodes <= 1 ||
+	    rand() < gsp->random_peers * ((double)RAND_MAX + 1))
+		return get_random_active_gossip_node(gsp);
+	return get_near_active_gossip_node(gsp);
+}
+
+/*
+ * Now and then an active peer gives way to a passive one, or active views
+ * would stay with the nodes that came first, the seeds and their neighbours.
+ */
+static void turn_active_view(struct gossip *gsp)
+{
+	if (!gsp->passive_view || !gsp->nr_active_gnodes ||
+	    gsp->nr_active_gnodes < gsp->active_view ||
+	    rand() % gsp->active_view)
+		return;
+
+	struct gossip_node *gnode = get_random_active_gossip_node(gsp);
+	list_del_init(&gnode->active_node);
+	gsp->nr_active_gnodes--;
+	fill_active_view(gsp);
+}
+
+static bool gossip_node_is_seed(struct gossip *gsp, struct gossip_node *gnode)
+{
+	if (!gsp_addr_valid(&gnode->addr))
+		return false;
+
+	for (int i = 0; i < gsp->nr_seeds; i++) {
+		if (gsp_addr_valid(&gsp->seed_addrs[i]) &&
+		    gsp_addr_equal(gsp_addr_sa(&gsp->seed_addrs[i]),
+		                   gsp_addr_sa(&gnode->addr)))
+			return true;
+	}
+
+	return false;
+}
+
+static int make_packet_sync(struct gossip *gsp, struct packet *pkt,
+                            struct gossip_node *target,
+                            const struct sockaddr *to)
+{
+	if (packet_begin(gsp, pkt, GOSSIP_PHASE_SYNC, 0, to))
+		return -1;
+	ser_buf_puts(&pkt->sb, ",\"full_node\":");
+	ser_buf_put_int64(&pkt->sb, gsp->self->full_node);
+	ser_buf_puts(&pkt->sb, ",\"ts\":");
+	ser_buf_put_int64(&pkt->sb, monotonic_usec());
+	put_coord(pkt, &gsp->self->coord);
+	put_zone(gsp, pkt);
+	packet_begin_items(pkt);
+
+	put_gnode_min(pkt, gsp->self);
+	if (target)
+		put_gnode_min(pkt, target);
+
+	// the others we keep of its zone, for it to ack newer heartbeats of
+	const char *zone = target && foreign_zone(gsp, target) ?
+		target->zone : NULL;
+
+	int sync_count = 0;
+	int nr_left = target ? gsp->nr_gnodes - 2 : gsp->nr_gnodes - 1;
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->gnodes, node) {
+		if (pos == gsp->self || pos == target)
+			continue;
+
+		if (zone && pos->zone && !strcmp(pos->zone, zone)) {
+			nr_left--;
+			put_gnode_min(pkt, pos);
+			continue;
+		}
+
+		// selection sampling: every candidate shrinks the pool
+		if (rand() % nr_left-- >= (gsp->sync_count - sync_count))
+			continue;
+
+		sync_count++;
+		put_gnode_min(pkt, pos);
+	}
+
+	assert(nr_left == 0);
+
+	return 0;
+}
+
+/*
+ * A full entry for a partial view to take in, with how long ago its heartbeat
+ * last moved: a node silent for long is not passed on, and one passed on does
+ * not look alive for longer than it is.
+ */
+static void put_gnode_shuffle(struct packet *pkt, struct gossip_node *gnode)
+{
+	int64_t age = gossip_now() - gnode->alive_seen;
+	size_t len;
+	const char *wire;
+
+	if (!gnode->version || age > GOSSIP_ALIVE_TIMEOUT ||
+	    !(wire = gossip_node_get_wire(gnode, &len)))
+		return;
+
+	packet_item_begin(pkt);
+	ser_buf_puts(&pkt->sb, "{\"alive_age\":");
+	ser_buf_put_int64(&pkt->sb, age > 0 ? age : 0);
+	ser_buf_puts(&pkt->sb, ",\"alive_time\":");
+	ser_buf_put_int64(&pkt->sb, gnode->alive_time);
+	ser_buf_putc(&pkt->sb, ',');
+	ser_buf_write(&pkt->sb, wire + 1, len - 1);
+	packet_item_end(pkt);
+}
+
+static void append_packet_sync(struct gossip *gsp, struct packet *pkt)
+{
+	int sync_count = 0;
+	int nr_left = gsp->nr_gnodes - 1;
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->gnodes, node) {
+		if (pos == gsp->self)
+			continue;
+
+		if (rand() % nr_left-- >= (gsp->sync_count/2 - sync_count))
+			continue;
+
+		sync_count++;
+		// a partial view takes in full entries only, as a shuffle
+		if (gsp->passive_view) {
+			put_gnode_shuffle(pkt, pos);
+			continue;
+		}
+
+		packet_item_begin(pkt);
+		ser_buf_puts(&pkt->sb, "{\"pubid\":");
+		ser_buf_put_string(&pkt->sb, pos->pubid);
+		ser_buf_puts(&pkt->sb, ",\"version\":0,\"update_time\":0");
+		if (pos->zone) {
+			ser_buf_puts(&pkt->sb, ",\"zone\":");
+			ser_buf_put_string(&pkt->sb, pos->zone);
+		}
+		ser_buf_putc(&pkt->sb, '}');
+		packet_item_end(pkt);
+	}
+
+	assert(nr_left == 0);
+}
+
+/*
+ * An ACK1 is filled in order of priority, for the rate limit to cut it short
+ * at the least useful end: ourselves first, then the entries the peer is
+ * furthest behind on, then what we ask for and the alive times, then the
+ * pubids of append_packet_sync().
+ */
+
+struct stale_gnode {
+	struct gossip_node *gnode;
+	int64_t behind; // versions the peer lags
+};
+
+// freed, as the packet buffers are, by a key destructor on thread exit
+static __thread struct stale_gnode *stale_gnodes;
+static __thread int nr_stale_max;
+
+static pthread_key_t stale_key;
+static pthread_once_t stale_once = PTHREAD_ONCE_INIT;
+static int stale_key_err;
+
+static void make_stale_key(void)
+{
+	stale_key_err = pthread_key_create(&stale_key, free);
+}
+
+static int cmp_stale_gnode(const void *a, const void *b)
+{
+	const struct stale_gnode *x = a, *y = b;
+	return (y->behind > x->behind) - (y->behind < x->behind);
+}
+
+static int prepare_stale_gnodes(int nr)
+{
+	if (nr <= nr_stale_max)
+		return 0;
+
+	if (pthread_once(&stale_once, make_stale_key) || stale_key_err)
+		return -1;
+
+	void *tmp = realloc(stale_gnodes, nr * sizeof(*stale_gnodes));
+	if (!tmp) return -1;
+	stale_gnodes = tmp;
+	nr_stale_max = nr;
+	return pthread_setspecific(stale_key, stale_gnodes) ? -1 : 0;
+}
+
+// an entry known by its pubid only, until its full form comes
+static struct gossip_node *add_placeholder(struct gossip *gsp,
+                                           const char *buf,
+                                           const struct json_tok *toks,
+                                           int item, const char *pubid,
+                                           size_t pubid_len)
+{
+	struct gossip_node *gnode = make_gossip_node("unknown");
+	if (!gnode)
+		return NULL;
+
+	free(gnode->pubid);
+	gnode->pubid = strndup(pubid, pubid_len);
+	gnode->alive_time = 0; // no heartbeat of it yet
+	int zone = json_tok_get(buf, toks, item, "zone");
+	if (zone >= 0 && toks[zone].type == JSON_TOK_STRING &&
+	    json_tok_len(&toks[zone]))
+		gnode->zone = json_tok_strdup(buf, &toks[zone]);
+
+	gsp->sync_changes++;
+	add_gossip_node(gsp, gnode);
+	return gnode;
+}
+
+static void handle_packet_sync(struct gossip *gsp, struct packet *ack1,
+                               const char *buf, const struct json_tok *toks)
+{
+	int sync_gnodes = json_tok_get(buf, toks, 0, "gnodes");
+	if (sync_gnodes < 0 || toks[sync_gnodes].type != JSON_TOK_ARRAY ||
+	    prepare_stale_gnodes(toks[sync_gnodes].size + 1)) {
+		append_packet_sync(gsp, ack1);
+		return;
+	}
+
+	// full entries, ranked
+	int has_self = 0;
+	int nr_stale = 0;
+
+	json_tok_array_for_each(item, toks, sync_gnodes) {
+		int pubid_tok = json_tok_get(buf, toks, item, "pubid");
+		if (pubid_tok < 0 || toks[pubid_tok].type != JSON_TOK_STRING)
+			continue;
+
+		struct gossip_node *gnode = find_gossip_node(gsp,
+			buf + toks[pubid_tok].start,
+			json_tok_len(&toks[pubid_tok]));
+		if (!gnode)
+			continue;
+		if (gnode == gsp->self)
+			has_self = 1;
+
+		int64_t version = json_tok_get_int64(buf, toks, item, "version");
+		if (version < gnode->version) {
+			struct stale_gnode *stale = &stale_gnodes[nr_stale++];
+			stale->gnode = gnode;
+			stale->behind = gnode == gsp->self ?
+				INT64_MAX : gnode->version - version;
+		}
+	}
+
+	gsp->sync_changes += nr_stale;
+	if (!has_self) {
+		stale_gnodes[nr_stale].gnode = gsp->self;
+		stale_gnodes[nr_stale++].behind = INT64_MAX;
+	}
+
+	qsort(stale_gnodes, nr_stale, sizeof(*stale_gnodes), cmp_stale_gnode);
+	for (int i = 0; i < nr_stale; i++)
+		put_gnode_full(ack1, stale_gnodes[i].gnode);
+
+	// requests and alive times
+	json_tok_array_for_each(item, toks, sync_gnodes) {
+		int pubid_tok = json_tok_get(buf, toks, item, "pubid");
+		if (pubid_tok < 0 || toks[pubid_tok].type != JSON_TOK_STRING)
+			continue;
+
+		const char *pubid = buf + toks[pubid_tok].start;
+		size_t pubid_len = json_tok_len(&toks[pubid_tok]);
+		int64_t version = json_tok_get_int64(buf, toks, item, "version");
+		int64_t alive_time =
+			json_tok_get_int64(buf, toks, item, "alive_time");
+
+		struct gossip_node *gnode =
+			find_gossip_node(gsp, pubid, pubid_len);
+
+		if (!gnode && !zone_admit(gsp, buf, toks, item))
+			continue;
+
+		// a partial view always takes in who syncs with it, as
+		// HyParView does a joining node
+		if (!gnode && gsp->passive_view && item == sync_gnodes + 1 &&
+		    view_admit(gsp, true))
+			gnode = add_placeholder(gsp, buf, toks, item,
+			                        pubid, pubid_len);
+
+		if (!gnode || version > gnode->version) {
+			// sync
+			put_gnode_pubid(ack1, pubid, pubid_len);
+			gsp->sync_changes++;
+		} else if (version == gnode->version) {
+			// ack a newer heartbeat, equal ones need nothing
+			if (alive_time < gnode->alive_time)
+				put_gnode_min(ack1, gnode);
+			else
+				note_alive(gnode, alive_time);
+		}
+	}
+
+	append_packet_sync(gsp, ack1);
+}
+
+static void handle_packet_ack1(struct gossip *gsp, struct packet *ack2,
+                               const char *buf, const struct json_tok *toks)
+{
+	int ack1_gnodes = json_tok_get(buf, toks, 0, "gnodes");
+	if (ack1_gnodes < 0 || toks[ack1_gnodes].type != JSON_TOK_ARRAY)
+		return;
+
+	json_tok_array_for_each(item, toks, ack1_gnodes) {
+		int pubid_tok = json_tok_get(buf, toks, item, "pubid");
+		if (pubid_tok < 0 || toks[pubid_tok].type != JSON_TOK_STRING)
+			continue;
+
+		const char *pubid = buf + toks[pubid_tok].start;
+		size_t pubid_len = json_tok_len(&toks[pubid_tok]);
+		int64_t version = json_tok_get_int64(buf, toks, item, "version");
+		int64_t alive_time =
+			json_tok_get_int64(buf, toks, item, "alive_time");
+
+		struct gossip_node *gnode =
+			find_gossip_node(gsp, pubid, pubid_len);
+
+		if (!gnode) {
+			bool full = json_tok_get(buf, toks, item, "pubkey") >= 0;
+
+			// a partial view would seldom get to fill a placeholder
+			if ((!full && gsp->passive_view) ||
+			    !zone_admit(gsp, buf, toks, item))
+				continue;
+
+			// parsed first, so a bad entry evicts no passive node
+			if (full &&
+			    !(gnode = gossip_node_from_tok(buf, toks, item)))
+				continue;
+			if (!view_admit(gsp, false)) {
+				if (gnode)
+					free_gossip_node(gnode);
+				continue;
+			}
+
+			if (full) {
+				int64_t age = json_tok_get_int64(buf, toks,
+				                                 item, "alive_age");
+				if (age > 0)
+					gnode->alive_seen -= age;
+				note_update(gsp, gnode);
+				add_gossip_node(gsp, gnode);
+			} else {
+				add_placeholder(gsp, buf, toks, item,
+				                pubid, pubid_len);
+			}
+		} else if (version > gnode->version) {
+			update_gossip_node(gsp, gnode, buf, toks, item);
+		} else if (version == gnode->version) {
+			note_alive(gnode, alive_time);
+		} else {
+			put_gnode_full(ack2, gnode);
+		}
+	}
+}
+
+// apply a full entry, returning its node when it was new or newer
+static struct gossip_node *apply_gnode_full(struct gossip *gsp,
+                                            const char *buf,
+                                            const struct json_tok *toks,
+                                            int item)
+{
+	int pubid_tok = json_tok_get(buf, toks, item, "pubid");
+	if (pubid_tok < 0 || toks[pubid_tok].type != JSON_TOK_STRING)
+		return NULL;
+
+	const char *pubid = buf + toks[pubid_tok].start;
+	size_t pubid_len = json_tok_len(&toks[pubid_tok]);
+	int64_t version = json_tok_get_int64(buf, toks, item, "version");
+	struct gossip_node *gnode = find_gossip_node(gsp, pubid, pubid_len);
+
+	if (!gnode) {
+		// parsed first, so a bad entry evicts no passive node
+		if (!zone_admit(gsp, buf, toks, item))
+			return NULL;
+		gnode = gossip_node_from_tok(buf, toks, item);
+		if (!gnode) return NULL;
+		if (!view_admit(gsp, false)) {
+			free_gossip_node(gnode);
+			return NULL;
+		}
+		note_update(gsp, gnode);
+		add_gossip_node(gsp, gnode);
+		return gnode;
+	} else if (version > gnode->version) {
+		if (update_gossip_node(gsp, gnode, buf, toks, item))
+			return NULL;
+		return gnode;
+	}
+
+	return NULL;
+}
+
+static void handle_packet_ack2(struct gossip *gsp, const char *buf,
+                               const struct json_tok *toks)
+{
+	int ack2_gnodes = json_tok_get(buf, toks, 0, "gnodes");
+	if (ack2_gnodes < 0 || toks[ack2_gnodes].type != JSON_TOK_ARRAY)
+		return;
+
+	json_tok_array_for_each(item, toks, ack2_gnodes)
+		apply_gnode_full(gsp, buf, toks, item);
+}
+
+/*
+ * push
+ *
+ * Rumor mongering on top of the rounds: a PUSH carries full entries and the
+ * number of times they may still be passed on. A node forwards only what
+ * was news to it, so a rumor dies out where it is known already, and the
+ * anti-entropy rounds carry it to whoever the fanout missed.
+ */
+
+static int make_packet_push(struct gossip *gsp, struct packet *pkt,
+                            struct gossip_node *gnode, int ttl,
+                            const struct sockaddr *to)
+{
+	if (packet_begin(gsp, pkt, GOSSIP_PHASE_PUSH, 0, to))
+		return -1;
+	ser_buf_puts(&pkt->sb, ",\"ttl\":");
+	ser_buf_put_int64(&pkt->sb, ttl);
+	packet_begin_items(pkt);
+
+	return put_gnode_full(pkt, gnode);
+}
+
+static bool push_target(const struct gossip_node *pos,
+                        const struct gossip_node *gnode,
+                        const struct sockaddr *from)
+{
+	return pos != gnode && gsp_addr_valid(&pos->addr) &&
+		!(from && gsp_addr_equal(gsp_addr_sa(&pos->addr), from));
+}
+
+// to push_fanout active peers but from and gnode itself, returns how many
+static int push_gnode(struct gossip *gsp, struct gossip_node *gnode, int ttl,
+                      const struct sockaddr *from)
+{
+	int nr_pushed = 0;
+	int nr_left = 0;
+
+	int fanout = gsp->push_fanout;
+	if (fanout <= 0)
+		fanout = 32 - __builtin_clz(gsp->nr_active_gnodes + 1) + 2;
+
+	// sample among the peers left once the excluded are out
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->active_gnodes, active_node) {
+		if (push_target(pos, gnode, from))
+			nr_left++;
+	}
+
+	list_for_each_entry(pos, &gsp->active_gnodes, active_node) {
+		if (!push_target(pos, gnode, from))
+			continue;
+		if (rand() % nr_left-- >= fanout - nr_pushed)
+			continue;
+
+		const struct sockaddr *to = gsp_addr_sa(&pos->addr);
+		struct packet pkt;
+		if (make_packet_push(gsp, &pkt, gnode, ttl, to))
+			continue;
+		send_packet(gsp, &pkt, to, pos->addr.len);
+		nr_pushed++;
+	}
+
+	return nr_pushed;
+}
+
+static void handle_packet_push(struct gossip *gsp, const char *buf,
+                               const struct json_tok *toks,
+                               const struct sockaddr *from)
+{
+	int push_gnodes = json_tok_get(buf, toks, 0, "gnodes");
+	if (push_gnodes < 0 || toks[push_gnodes].type != JSON_TOK_ARRAY)
+		return;
+
+	int ttl = json_tok_get_int64(buf, toks, 0, "ttl");
+	if (ttl > gsp->push_ttl)
+		ttl = gsp->push_ttl;
+
+	json_tok_array_for_each(item, toks, push_gnodes) {
+		struct gossip_node *gnode = apply_gnode_full(gsp, buf, toks, item);
+		if (gnode && ttl > 0)
+			push_gnode(gsp, gnode, ttl - 1, from);
+	}
+}
+
+/*
+ * broadcast
+ *
+ * Plumtree over the active peers: the bcast_link of a node says whether our
+ * messages go to it in full or as IHAVEs. The first copy of a message and a
+ * GRAFT make the link they come by eager, a PRUNE makes it lazy. An id is
+ * the tag of the pubid of the origin above its sequence number.
+ */
+
+static int put_bcast_msg(struct packet *pkt, const struct gossip_seen_msg *msg)
+{
+	packet_item_begin(pkt);
+	ser_buf_puts(&pkt->sb, "{\"id\":");
+	ser_buf_put_int64(&pkt->sb, (int64_t)msg->id);
+	ser_buf_puts(&pkt->sb, ",\"origin\":");
+	ser_buf_put_string(&pkt->sb, msg->origin);
+	ser_buf_puts(&pkt->sb, ",\"msg\":");
+	ser_buf_put_string(&pkt->sb, msg->text);
+	ser_buf_putc(&pkt->sb, '}');
+	return packet_item_end(pkt);
+}
+
+static int put_bcast_id(struct packet *pkt, uint64_t id)
+{
+	packet_item_begin(pkt);
+	ser_buf_puts(&pkt->sb, "{\"id\":");
+	ser_buf_put_int64(&pkt->sb, (int64_t)id);
+	ser_buf_putc(&pkt->sb, '}');
+	return packet_item_end(pkt);
+}
+
+// msg in full for a BCAST, its id for an IHAVE or a GRAFT, none for a PRUNE
+static void send_bcast(struct gossip *gsp, int phase,
+                       const struct gossip_seen_msg *msg,
+                       const struct sockaddr *to, socklen_t to_len)
+{
+	struct packet pkt;
+
+	if (packet_begin(gsp, &pkt, phase, 0, to))
+		return;
+	ser_buf_puts(&pkt.sb, ",\"from\":");
+	ser_buf_put_string(&pkt.sb, gsp->self->pubid);
+	packet_begin_items(&pkt);
+
+	if (msg && (phase == GOSSIP_PHASE_BCAST ? put_bcast_msg(&pkt, msg) :
+	                                          put_bcast_id(&pkt, msg->id)))
+		return;
+
+	send_packet(gsp, &pkt, to, to_len);
+}
+
+// a GRAFT of our entry, for the peer to link us back
+static void send_bcast_link(struct gossip *gsp, struct gossip_node *peer)
+{
+	const struct sockaddr *to = gsp_addr_sa(&peer->addr);
+	struct packet pkt;
+
+	if (packet_begin(gsp, &pkt, GOSSIP_PHASE_GRAFT, 0, to))
+		return;
+	ser_buf_puts(&pkt.sb, ",\"from\":");
+	ser_buf_put_string(&pkt.sb, gsp->self->pubid);
+	packet_begin_items(&pkt);
+
+	if (put_gnode_full(&pkt, gsp->self) == 0)
+		send_packet(gsp, &pkt, to, peer->addr.len);
+}
+
+/*
+ * Link random active peers in, eager, while fewer than bcast_peers nodes are
+ * linked; the GRAFT carrying our entry has them link us back. A link to a
+ * node that is neither active nor heard of lately goes.
+ */
+static void bcast_link_peers(struct gossip *gsp)
+{
+	int64_t now = gossip_now();
+	int nr_linked = 0;
+	int nr_left = gsp->nr_active_gnodes;
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->gnodes, node) {
+		if (pos->bcast_link == GOSSIP_BCAST_NONE)
+			continue;
+
+		if (gossip_node_is_active(pos)) {
+			nr_left--;
+		} else if (now - pos->alive_seen > GOSSIP_ALIVE_TIMEOUT) {
+			pos->bcast_link = GOSSIP_BCAST_NONE;
+			continue;
+		}
+		nr_linked++;
+	}
+
+	int nr_wanted = gsp->bcast_peers - nr_linked;
+
+	// selection sampling among the peers not linked yet
+	list_for_each_entry(pos, &gsp->active_gnodes, active_node) {
+		if (nr_wanted <= 0)
+			break;
+		if (pos->bcast_link != GOSSIP_BCAST_NONE)
+			continue;
+		if (rand() % nr_left-- >= nr_wanted)
+			continue;
+
+		pos->bcast_link = GOSSIP_BCAST_EAGER;
+		nr_wanted--;
+		if (gsp_addr_valid(&pos->addr))
+			send_bcast_link(gsp, pos);
+	}
+}
+
+// to the live linked nodes but from and the origin
+static void bcast_forward(struct gossip *gsp, const struct gossip_seen_msg *msg,
+                          const struct sockaddr *from)
+{
+	int64_t now = gossip_now();
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->gnodes, node) {
+		if (pos->bcast_link == GOSSIP_BCAST_NONE ||
+		    !gsp_addr_valid(&pos->addr) ||
+		    now - pos->alive_seen > GOSSIP_ALIVE_TIMEOUT ||
+		    !strcmp(pos->pubid, msg->origin))
+			continue;
+
+		const struct sockaddr *to = gsp_addr_sa(&pos->addr);
+		if (from && gsp_addr_equal(to, from))
+			continue;
+
+		send_bcast(gsp, pos->bcast_link == GOSSIP_BCAST_EAGER ?
+		           GOSSIP_PHASE_BCAST : GOSSIP_PHASE_IHAVE,
+		           msg, to, pos->addr.len);
+	}
+}
+
+// the node named by "from" in the head of a packet, as BCAST and ACK1 have
+static struct gossip_node *packet_from(struct gossip *gsp, const char *buf,
+                                       const struct json_tok *toks)
+{
+	int from = json_tok_get(buf, toks, 0, "from");
+	if (from < 0 || toks[from].type != JSON_TOK_STRING)
+		return NULL;
+
+	struct gossip_node *gnode = find_gossip_node(gsp,
+		buf + toks[from].start, json_tok_len(&toks[from]));
+	return gnode == gsp->self ? NULL : gnode;
+}
+
+static int bcast_items(const char *buf, const struct json_tok *toks)
+{
+	int items = json_tok_get(buf, toks, 0, "gnodes");
+	if (items < 0 || toks[items].type != JSON_TOK_ARRAY)
+		return -1;
+	return items;
+}
+
+static void handle_packet_bcast(struct gossip *gsp, const char *buf,
+                                const struct json_tok *toks,
+                                const struct sockaddr *from,
+                                socklen_t from_len)
+{
+	struct gossip_node *peer = packet_from(gsp, buf, toks);
+	int items = bcast_items(buf, toks);
+	if (items < 0)
+		return;
+
+	json_tok_array_for_each(item, toks, items) {
+		uint64_t id = json_tok_get_int64(buf, toks, item, "id");
+		int origin = json_tok_get(buf, toks, item, "origin");
+		int text = json_tok_get(buf, toks, item, "msg");
+		if (origin < 0 || toks[origin].type != JSON_TOK_STRING ||
+		    text < 0 || toks[text].type != JSON_TOK_STRING)
+			continue;
+
+		struct gossip_seen_msg *msg =
+			gossip_seen_add(&gsp->bcast_seen, id);
+		if (!msg)
+			continue;
+
+		// a second copy: the link it came by goes lazy
+		if (msg->text) {
+			if (peer)
+				peer->bcast_link = GOSSIP_BCAST_LAZY;
+			send_bcast(gsp, GOSSIP_PHASE_PRUNE, NULL, from, from_len);
+			continue;
+		}
+
+		if (!msg->origin)
+			msg->origin = json_tok_strdup(buf, &toks[origin]);
+		char *dup = json_tok_strdup(buf, &toks[text]);
+		if (!msg->origin || !dup) {
+			free(dup);
+			continue;
+		}
+		gossip_seen_set_text(&gsp->bcast_seen, msg, dup);
+		msg->text_time = gsp->bcast_time = gossip_now();
+
+		if (peer && peer->bcast_link == GOSSIP_BCAST_LAZY)
+			peer->bcast_link = GOSSIP_BCAST_EAGER;
+		bcast_forward(gsp, msg, from);
+
+		// last, the callback may broadcast and recycle msg
+		if (gsp->bcast_cb)
+			gsp->bcast_cb(gsp, msg->origin, msg->text,
+			              gsp->bcast_data);
+	}
+}
+
+static void handle_packet_ihave(struct gossip *gsp, const char *buf,
+                                const struct json_tok *toks,
+                                const struct sockaddr *from,
+                                socklen_t from_len)
+{
+	int items = bcast_items(buf, toks);
+	if (items < 0)
+		return;
+
+	json_tok_array_for_each(item, toks, items) {
+		uint64_t id = json_tok_get_int64(buf, toks, item, "id");
+		struct gossip_seen_msg *msg =
+			gossip_seen_add(&gsp->bcast_seen, id);
+		if (!msg || msg->text)
+			continue;
+
+		// the first announce starts the wait, GRAFTs go round them all
+		if (!msg->nr_ihave_addrs)
+			msg->graft_time = gossip_now() + gsp->bcast_timeout;
+		gossip_seen_add_ihave(msg, from, from_len);
+	}
+}
+
+static void handle_packet_graft(struct gossip *gsp, const char *buf,
+                                const struct json_tok *toks,
+                                const struct sockaddr *from,
+                                socklen_t from_len)
+{
+	struct gossip_node *peer = packet_from(gsp, buf, toks);
+	int items = bcast_items(buf, toks);
+	if (items < 0)
+		return;
+
+	json_tok_array_for_each(item, toks, items) {
+		// the entry of a peer linking to us, that we may not know
+		if (!peer && json_tok_get(buf, toks, item, "pubkey") >= 0) {
+			if (!zone_admit(gsp, buf, toks, item))
+				continue;
+			peer = gossip_node_from_tok(buf, toks, item);
+			if (!peer)
+				continue;
+			if (!view_admit(gsp, false)) {
+				free_gossip_node(peer);
+				peer = NULL;
+				continue;
+			}
+			note_update(gsp, peer);
+			add_gossip_node(gsp, peer);
+			continue;
+		}
+
+		uint64_t id = json_tok_get_int64(buf, toks, item, "id");
+		struct gossip_seen_msg *msg =
+			gossip_seen_find(&gsp->bcast_seen, id);
+		if (msg && msg->text)
+			send_bcast(gsp, GOSSIP_PHASE_BCAST, msg, from, from_len);
+	}
+
+	if (peer)
+		peer->bcast_link = GOSSIP_BCAST_EAGER;
+}
+
+static void handle_packet_prune(struct gossip *gsp, const char *buf,
+                                const struct json_tok *toks)
+{
+	struct gossip_node *peer = packet_from(gsp, buf, toks);
+	if (peer)
+		peer->bcast_link = GOSSIP_BCAST_LAZY;
+}
+
+// ask for the messages announced but missing after bcast_timeout, for a while
+static void bcast_graft_missing(struct gossip *gsp)
+{
+	struct gossip_seen *seen = &gsp->bcast_seen;
+	if (!seen->nr_missing)
+		return;
+
+	int64_t now = gossip_now();
+	for (int i = 0; i < seen->nr_msgs; i++) {
+		struct gossip_seen_msg *msg = &seen->msgs[i];
+		if (!msg->id || msg->text || now < msg->graft_time)
+			continue;
+
+		// the announcers are all gone, a quiet ring may never evict it
+		if (msg->nr_grafts >= msg->nr_ihave_addrs * GOSSIP_BCAST_GRAFTS) {
+			gossip_seen_drop(seen, msg);
+			continue;
+		}
+
+		// another announcer each time, in case one is gone
+		const struct gsp_addr *to = gossip_seen_next_graft(msg);
+		send_bcast(gsp, GOSSIP_PHASE_GRAFT, msg, gsp_addr_sa(to),
+		           to->len);
+		msg->nr_grafts++;
+		msg->graft_time = now + gsp->bcast_timeout;
+	}
+}
+
+// an IHAVE of the messages that came lately, to the peer of a round
+static void bcast_repair(struct gossip *gsp, struct gossip_node *peer)
+{
+	struct gossip_seen *seen = &gsp->bcast_seen;
+	int64_t now = gossip_now();
+
+	if (now - gsp->bcast_time > GOSSIP_BCAST_REPAIR ||
+	    !gsp_addr_valid(&peer->addr))
+		return;
+
+	const struct sockaddr *to = gsp_addr_sa(&peer->addr);
+	struct packet pkt;
+	int nr = 0;
+
+	if (packet_begin(gsp, &pkt, GOSSIP_PHASE_IHAVE, 0, to))
+		return;
+	ser_buf_puts(&pkt.sb, ",\"from\":");
+	ser_buf_put_string(&pkt.sb, gsp->self->pubid);
+	packet_begin_items(&pkt);
+
+	for (int i = 0; i < seen->nr_msgs; i++) {
+		const struct gossip_seen_msg *msg = &seen->msgs[i];
+		if (!msg->id || !msg->text ||
+		    now - msg->text_time > GOSSIP_BCAST_REPAIR)
+			continue;
+		if (put_bcast_id(&pkt, msg->id))
+			break;
+		nr++;
+	}
+
+	if (nr)
+		send_packet(gsp, &pkt, to, peer->addr.len);
+}
+
+void gossip_set_bcast_cb(struct gossip *gsp, gossip_bcast_cb cb,
+                         void *user_data)
+{
+	gsp->bcast_cb = cb;
+	gsp->bcast_data = user_data;
+}
+
 /*
- * gossip
+ * the high half of the ids of our broadcasts: the first 32 bits of the sha1
+ * pubid as they are, calc_tag() folding hex digits into far fewer
  */
+static uint32_t bcast_tag(const char *pubid)
+{
+	char hex[9], *end;
+	snprintf(hex, sizeof(hex), "%s", pubid);
+	unsigned long tag = strtoul(hex, &end, 16);
+	if (end != hex + 8)
+		return calc_tag(pubid, strlen(pubid));
+	return (uint32_t)tag;
+}
 
-static json_object *gossip_node_min_to_json(const struct gossip_node *gnode)
+int gossip_broadcast(struct gossip *gsp, const char *text)
 {
-	json_object *root = json_object_new_object();
+	if (!text || strlen(text) > GOSSIP_BCAST_LEN_MAX)
+		return -1;
 
-	JSON_ADD_STRING(root, "pubid", gnode->pubid);
-	JSON_ADD_INT64(root, "version", gnode->version);
-	JSON_ADD_INT64(root, "alive_time", gnode->alive_time);
+	if (!++gsp->bcast_seq)
+		gsp->bcast_seq++;
+	uint64_t tag = bcast_tag(gsp->self->pubid);
+	struct gossip_seen_msg *msg =
+		gossip_seen_add(&gsp->bcast_seen, tag << 32 | gsp->bcast_seq);
+	if (!msg || msg->text)
+		return -1;
 
-	return root;
+	msg->origin = strdup(gsp->self->pubid);
+	char *dup = strdup(text);
+	if (!msg->origin || !dup) {
+		free(dup);
+		return -1;
+	}
+	gossip_seen_set_text(&gsp->bcast_seen, msg, dup);
+	msg->text_time = gsp->bcast_time = gossip_now();
+
+	bcast_link_peers(gsp);
+	bcast_forward(gsp, msg, NULL);
+	return 0;
 }
 
-static struct gossip_node *
-find_gossip_node(struct gossip *gsp, const char *pubid)
+static int scan_packet(struct gossip *gsp, const char *buf, size_t len)
 {
-	// FIXME: rewrite this function with hlist
-	struct gossip_node *pos;
-	list_for_each_entry(pos, &gsp->gnodes, node) {
-		if (strcmp(pos->pubid, pubid) == 0)
-			return pos;
+	int nr;
+
+	while ((nr = json_scan(buf, len, gsp->toks, gsp->nr_toks)) ==
+	       JSON_SCAN_NOMEM) {
+		int nr_toks = gsp->nr_toks ? gsp->nr_toks << 1 : 128;
+		void *toks = realloc(gsp->toks, nr_toks * sizeof(*gsp->toks));
+		if (!toks) return -1;
+		gsp->toks = toks;
+		gsp->nr_toks = nr_toks;
 	}
 
-	return NULL;
+	if (nr < 0 || gsp->toks[0].type != JSON_TOK_OBJECT)
+		return -1;
+
+	return 0;
 }
 
-static struct gossip_node *
-get_random_active_gossip_node(struct gossip *gsp)
+static inline int packet_nr_items(const char *buf,
+                                  const struct json_tok *toks)
 {
-	int index = 0;
-	int ran = rand() % gsp->nr_active_gnodes;
-
-	struct gossip_node *pos;
-	list_for_each_entry(pos, &gsp->active_gnodes, active_node) {
-		if (index++ == ran)
-			return pos;
-	}
-
-	assert(false);
-	return NULL;
+	int gnodes = json_tok_get(buf, toks, 0, "gnodes");
+	return gnodes < 0 ? 0 : toks[gnodes].size;
 }
 
-static bool gossip_node_is_seed(struct gossip_node *gnode, char **seed, int nr)
+// the node that sent a SYNC, whose own entry comes first
+static struct gossip_node *packet_sender(struct gossip *gsp, const char *buf,
+                                         const struct json_tok *toks)
 {
-	char host[64];
-	snprintf(host, 64, "%s:%d", gnode->public_ipaddr, gnode->public_port);
+	int gnodes = json_tok_get(buf, toks, 0, "gnodes");
+	if (gnodes < 0 || toks[gnodes].type != JSON_TOK_ARRAY ||
+	    !toks[gnodes].size)
+		return NULL;
 
-	for (int i = 0; i < nr; i++) {
-		if (strcmp(seed[i], host) == 0)
-			return true;
-	}
+	int pubid = json_tok_get(buf, toks, gnodes + 1, "pubid");
+	if (pubid < 0 || toks[pubid].type != JSON_TOK_STRING)
+		return NULL;
 
-	return false;
+	struct gossip_node *gnode = find_gossip_node(gsp,
+		buf + toks[pubid].start, json_tok_len(&toks[pubid]));
+	return gnode == gsp->self ? NULL : gnode;
 }
 
-static json_object *
-make_packet_sync(struct gossip *gsp, struct gossip_node *target)
+// the ACK1 of our SYNC gives a round trip to the peer and its coordinates
+static void update_coord(struct gossip *gsp, const char *buf,
+                         const struct json_tok *toks)
 {
-	json_object *root = json_object_new_object();
-	JSON_ADD_INT(root, "phase", GOSSIP_PHASE_SYNC);
-	JSON_ADD_INT(root, "full_node", gsp->self->full_node);
-
-	json_object *gnodes = json_object_new_array();
-	JSON_ADD_OBJECT(root, "gnodes", gnodes);
+	int64_t ts = json_tok_get_int64(buf, toks, 0, "echo");
+	struct gossip_node *peer = packet_from(gsp, buf, toks);
+	if (!peer || get_coord(buf, toks, &peer->coord) || ts <= 0)
+		return;
 
-	json_object_array_add(gnodes, gossip_node_min_to_json(gsp->self));
-	if (target)
-		json_object_array_add(gnodes, gossip_node_min_to_json(target));
+	int64_t rtt = monotonic_usec() - ts;
+	if (rtt > 0)
+		gossip_coord_update(&gsp->self->coord, &peer->coord,
+		                    rtt / 1000.0);
+}
 
-	int sync_count = 0;
-	int nr_left = target ? gsp->nr_gnodes - 2 : gsp->nr_gnodes - 1;
+// returns the phase of the packet handled, -1 when it is not decodable
+static int handle_packet(struct gossip *gsp, const void *buf, ssize_t len,
+                         struct sockaddr *addr, socklen_t addr_len)
+{
+	GOSSIP_TRACE_BEGIN(trace_start);
 
-	struct gossip_node *pos;
-	list_for_each_entry(pos, &gsp->gnodes, node) {
-		if (pos == gsp->self || pos == target)
-			continue;
+	if (len > 0 && *(const char *)buf == GOSSIP_LZ_MAGIC) {
+		len = inflate_packet(buf, len);
+		if (len < 0)
+			return -1;
+		buf = lz_buf + GOSSIP_LZ_DICT_LEN;
+	}
 
-		if (rand() % nr_left >= (GOSSIP_DEFAULT_SYNC_COUNT - sync_count))
-			continue;
+	if (scan_packet(gsp, buf, len))
+		return -1;
 
-		sync_count++;
-		nr_left--;
-		json_object_array_add(gnodes, gossip_node_min_to_json(pos));
+	const struct json_tok *toks = gsp->toks;
+	int phase = json_tok_get_int64(buf, toks, 0, "phase");
+	int caps = json_tok_get_int64(buf, toks, 0, "caps");
+	struct packet pkt;
+
+	if (phase == GOSSIP_PHASE_SYNC) {
+		struct gossip_node *peer = packet_sender(gsp, buf, toks);
+		if (peer)
+			get_coord(buf, toks, &peer->coord);
+
+		note_zone(gsp, buf, toks);
+
+		if (packet_begin(gsp, &pkt, GOSSIP_PHASE_ACK1, caps, addr))
+			return -1;
+		int64_t ts = json_tok_get_int64(buf, toks, 0, "ts");
+		if (ts > 0) {
+			// our entry need not come first, it goes by priority
+			ser_buf_puts(&pkt.sb, ",\"from\":");
+			ser_buf_put_string(&pkt.sb, gsp->self->pubid);
+			ser_buf_puts(&pkt.sb, ",\"echo\":");
+			ser_buf_put_int64(&pkt.sb, ts);
+			put_coord(&pkt, &gsp->self->coord);
+		}
+		put_zone(gsp, &pkt);
+		packet_begin_items(&pkt);
+		handle_packet_sync(gsp, &pkt, buf, toks);
+		send_packet(gsp, &pkt, addr, addr_len);
+	} else if (phase == GOSSIP_PHASE_ACK1) {
+		update_coord(gsp, buf, toks);
+		note_zone(gsp, buf, toks);
+
+		if (packet_begin(gsp, &pkt, GOSSIP_PHASE_ACK2, caps, addr))
+			return -1;
+		packet_begin_items(&pkt);
+		handle_packet_ack1(gsp, &pkt, buf, toks);
+		send_packet(gsp, &pkt, addr, addr_len);
+	} else if (phase == GOSSIP_PHASE_ACK2) {
+		handle_packet_ack2(gsp, buf, toks);
+	} else if (phase == GOSSIP_PHASE_PUSH) {
+		handle_packet_push(gsp, buf, toks, addr);
+	} else if (phase == GOSSIP_PHASE_BCAST) {
+		handle_packet_bcast(gsp, buf, toks, addr, addr_len);
+	} else if (phase == GOSSIP_PHASE_IHAVE) {
+		handle_packet_ihave(gsp, buf, toks, addr, addr_len);
+	} else if (phase == GOSSIP_PHASE_GRAFT) {
+		handle_packet_graft(gsp, buf, toks, addr, addr_len);
+	} else if (phase == GOSSIP_PHASE_PRUNE) {
+		handle_packet_prune(gsp, buf, toks);
+	} else {
+		return -1;
 	}
 
-	assert(nr_left == 0 || sync_count == GOSSIP_DEFAULT_SYNC_COUNT);
-
-	return root;
+	GOSSIP_TRACE_END(trace_start, GOSSIP_TRACE_HANDLE, phase,
+	                 packet_nr_items(buf, toks), len);
+	return phase;
 }
 
-static void append_packet_sync(struct gossip *gsp, json_object *root)
+static int read_cb(struct gsp_transport *tp, const void *buf, ssize_t len,
+                   struct sockaddr *addr, socklen_t addr_len)
 {
-	json_object *gnodes = json_object_object_get(root, "gnodes");
-
-	int sync_count = 0;
-	int nr_left = gsp->nr_gnodes - 1;
-
-	struct gossip_node *pos;
-	list_for_each_entry(pos, &gsp->gnodes, node) {
-		if (pos == gsp->self)
-			continue;
-
-		if (rand() % nr_left >=
-		    (GOSSIP_DEFAULT_SYNC_COUNT/2 - sync_count))
-			continue;
+	struct gossip *gsp = tp->user_data;
+	int64_t start = monotonic_usec();
 
-		sync_count++;
-		nr_left--;
-		json_object *tmp = json_object_new_object();
-		JSON_ADD_STRING(tmp, "pubid", pos->pubid);
-		JSON_ADD_INT64(tmp, "version", 0);
-		JSON_ADD_INT64(tmp, "update_time", 0);
-		json_object_array_add(gnodes, tmp);
+	int phase = handle_packet(gsp, buf, len, addr, addr_len);
+	if (phase < 0) {
+		gsp->stats.rx_errors++;
+		return -1;
 	}
 
-	assert(nr_left == 0 || sync_count == GOSSIP_DEFAULT_SYNC_COUNT/2);
+	gsp->shm_dirty = 1;
+	gsp->stats.rx_packets[phase]++;
+	gsp->stats.rx_bytes[phase] += len;
+	gossip_hist_add(&gsp->stats.packet_bytes, len);
+	gossip_hist_add(&gsp->stats.handle_usec, monotonic_usec() - start);
+	return 0;
 }
 
-static json_object *handle_packet_sync(struct gossip *gsp, json_object *sync)
+static int do_sync_node(struct gossip *gsp, struct gossip_node **gnode_out)
 {
-	// init ack1
-	json_object *ack1 = json_object_new_object();
-	JSON_ADD_INT(ack1, "phase", GOSSIP_PHASE_ACK1);
-	json_object *ack1_gnodes = json_object_new_array();
-	JSON_ADD_OBJECT(ack1, "gnodes", ack1_gnodes);
-	append_packet_sync(gsp, ack1);
-
-	// make ack1_gnodes
-	int has_self = 0;
-	json_object *sync_gnodes = JSON_GET_OBJECT(sync, "gnodes");
-	size_t nr = json_object_array_length(sync_gnodes);
-
-	for (size_t i = 0; i < nr; i++) {
-		json_object *item = json_object_array_get_idx(sync_gnodes, i);
-		const char *pubid = JSON_GET_STRING(item, "pubid");
-		int64_t version = JSON_GET_INT64(item, "version");
-		int64_t alive_time = JSON_GET_INT64(item, "alive_time");
+	assert(gsp->nr_active_gnodes);
 
-		if (strcmp(pubid, gsp->self->pubid) == 0)
-			has_self = 1;
+	struct gossip_node *gnode = pick_sync_node(gsp);
+	assert(gnode && gnode->full_node && !list_empty(&gnode->active_node));
 
-		// FIXME: time of each node is always different
-		//if (alive_time > time(NULL))
-		//	continue;
+	struct gossip_zone *zone = foreign_zone(gsp, gnode);
 
-		struct gossip_node *gnode = find_gossip_node(gsp, pubid);
-		if (!gnode || version > gnode->version) {
-			// sync
-			json_object *tmp = json_object_new_object();
-			JSON_ADD_STRING(tmp, "pubid", pubid);
-			json_object_array_add(ack1_gnodes, tmp);
-		} else if (version == gnode->version) {
-			if (alive_time >= gnode->alive_time) {
-				gnode->alive_time = alive_time;
-			} else {
-				// ack alive_time
-				json_object *tmp = json_object_new_object();
-				JSON_ADD_STRING(tmp, "pubid", pubid);
-				JSON_ADD_INT64(tmp, "version", version);
-				JSON_ADD_INT64(tmp, "alive_time",
-				               gnode->alive_time);
-				json_object_array_add(ack1_gnodes, tmp);
-			}
-		} else if (version < gnode->version) {
-			json_object_array_add(
-				ack1_gnodes, gossip_node_to_json(gnode));
+	// FIXME: find alive node directly rather than judge here
+	if (gossip_now() - gnode->alive_seen > GOSSIP_ALIVE_TIMEOUT) {
+		if (zone && zone->nr_reps <= gsp->zone_reps) {
+			// no replacement yet: make room for one, and still ask
+			zone->stale_time = gossip_now();
 		} else {
-			assert(false);
+			gsp->stats.expired++;
+			if (zone)
+				zone->stale_time = 0;
+			// make room for another node of its zone or view
+			if (gsp->passive_view || zone) {
+				del_gossip_node(gsp, gnode);
+				fill_active_view(gsp);
+				return -1;
+			}
+
+			list_del_init(&gnode->active_node);
+			gsp->nr_active_gnodes--;
+			return -1;
 		}
+	} else if (zone && zone->nr_reps > zone_max_reps(gsp, zone)) {
+		// the one it was a spare for came back
+		del_gossip_node(gsp, gnode);
+		fill_active_view(gsp);
+		return -1;
 	}
 
-	if (!has_self) {
-		json_object_array_add(
-			ack1_gnodes, gossip_node_to_json(gsp->self));
-	}
+	if (!gsp_addr_valid(&gnode->addr))
+		return -1;
 
-	return ack1;
+	struct packet pkt;
+	const struct sockaddr *to = gsp_addr_sa(&gnode->addr);
+	if (make_packet_sync(gsp, &pkt, gnode, to) == 0)
+		send_packet(gsp, &pkt, to, gnode->addr.len);
+
+	*gnode_out = gnode;
+	return 0;
 }
 
-static json_object *handle_packet_ack1(struct gossip *gsp, json_object *ack1)
+static void do_sync_seed(struct gossip *gsp)
 {
-	json_object *ack2 = json_object_new_object();
-	JSON_ADD_INT(ack2, "phase", GOSSIP_PHASE_ACK2);
-	json_object *ack2_gnodes = json_object_new_array();
-	JSON_ADD_OBJECT(ack2, "gnodes", ack2_gnodes);
-
-	json_object *ack1_gnodes = JSON_GET_OBJECT(ack1, "gnodes");
-	size_t nr = json_object_array_length(ack1_gnodes);
+	if (!gsp->seeds) return;
 
-	for (size_t i = 0; i < nr; i++) {
-		json_object *item = json_object_array_get_idx(ack1_gnodes, i);
-		const char *pubid = JSON_GET_STRING(item, "pubid");
-		int64_t version = JSON_GET_INT64(item, "version");
-		int64_t alive_time = JSON_GET_INT64(item, "alive_time");
+	int ran = rand() % gsp->nr_seeds;
+	struct gsp_addr *addr = &gsp->seed_addrs[ran];
+	if (!gsp_addr_valid(addr))
+		return;
 
-		// FIXME: time of each node is always different
-		//if (alive_time > time(NULL))
-		//	continue;
+	struct packet pkt;
+	if (make_packet_sync(gsp, &pkt, NULL, gsp_addr_sa(addr)) == 0)
+		send_packet(gsp, &pkt, gsp_addr_sa(addr), addr->len);
+}
 
-		struct gossip_node *gnode = find_gossip_node(gsp, pubid);
+/*
+ * bootstrap
+ *
+ * The snapshot of a seed is a run of ACK2 packets, one per chunk, as large
+ * as a datagram may be. It is built when the joiner connects and drained by
+ * gossip_loop_once() without blocking, while the joiner applies each chunk
+ * as it arrives, then goes on with gossip for what changes afterwards.
+ */
 
-		if (!gnode) {
-			if (JSON_HAS(item, "pubkey"))
-				gnode = gossip_node_from_json(item);
-			else {
-				gnode = make_gossip_node("unknown");
-				free(gnode->pubid);
-				gnode->pubid = strdup(pubid);
-			}
+static int put_snapshot_packet(struct gsp_stream *st, struct packet *pkt)
+{
+	if (packet_end(pkt))
+		return -1;
 
-			unsigned int tag =
-				calc_tag(gnode->pubid, strlen(gnode->pubid));
-			struct hlist_head *head =
-				&gsp->gnode_heads[tag_hash_fn(tag)];
-			hlist_add_head(&gnode->hash_node, head);
+	size_t off = 0;
+	for (int i = 0; i < pkt->nr_segs; i++) {
+		if (gsp_stream_put_chunk(st, train_buf + off, pkt->seg_lens[i]))
+			return -1;
+		off += pkt->seg_lens[i];
+	}
 
-			list_add(&gnode->node, &gsp->gnodes);
-			gsp->nr_gnodes++;
+	return 0;
+}
 
-			if (gnode->full_node) {
-				list_add(&gnode->active_node,
-				         &gsp->active_gnodes);
-				gsp->nr_active_gnodes++;
-			}
-		} else if (version > gnode->version) {
-			gossip_node_update_from_json(gnode, item);
-
-			if (gnode->full_node &&
-			    list_empty(&gnode->active_node)) {
-				list_add(&gnode->active_node,
-				         &gsp->active_gnodes);
-				gsp->nr_active_gnodes++;
-			} else if (!gnode->full_node &&
-			           !list_empty(&gnode->active_node)) {
-				list_del(&gnode->active_node);
-				gsp->nr_active_gnodes--;
-			}
-		} else if (version == gnode->version) {
-			if (alive_time >= gnode->alive_time)
-				gnode->alive_time = alive_time;
-		} else {
-			json_object_array_add(
-				ack2_gnodes, gossip_node_to_json(gnode));
-		}
-	}
+// the stream is budgeted as it drains, not its packets
+static int snapshot_begin(struct gossip *gsp, struct packet *pkt)
+{
+	if (packet_begin(gsp, pkt, GOSSIP_PHASE_ACK2, GOSSIP_CAP_LZ, NULL))
+		return -1;
 
-	return ack2;
+	pkt->seg_size = GOSSIP_PACKET_LEN_MAX;
+	packet_begin_items(pkt);
+	return 0;
 }
 
-static void handle_packet_ack2(struct gossip *gsp, json_object *ack2)
+static int make_snapshot(struct gossip *gsp, struct gsp_stream *st)
 {
-	json_object *ack2_gnodes = JSON_GET_OBJECT(ack2, "gnodes");
-	size_t nr = json_object_array_length(ack2_gnodes);
+	struct packet pkt;
 
-	for (size_t i = 0; i < nr; i++) {
-		json_object *item = json_object_array_get_idx(ack2_gnodes, i);
-		const char *pubid = JSON_GET_STRING(item, "pubid");
-		int64_t version = JSON_GET_INT64(item, "version");
-		//int64_t alive_time = JSON_GET_INT64(item, "alive_time");
+	if (snapshot_begin(gsp, &pkt))
+		return -1;
 
-		// FIXME: time of each node is always different
-		//if (alive_time > time(NULL))
-		//	continue;
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &gsp->gnodes, node) {
+		if (put_gnode_full(&pkt, pos) == 0 || !pkt.nr_items)
+			continue;
 
-		struct gossip_node *gnode = find_gossip_node(gsp, pubid);
+		// the packet is full, the entry opens the next one
+		if (put_snapshot_packet(st, &pkt) || snapshot_begin(gsp, &pkt))
+			return -1;
+		put_gnode_full(&pkt, pos);
+	}
 
-		if (!gnode) {
-			gnode = gossip_node_from_json(item);
+	return put_snapshot_packet(st, &pkt);
+}
 
-			unsigned int tag =
-				calc_tag(gnode->pubid, strlen(gnode->pubid));
-			struct hlist_head *head =
-				&gsp->gnode_heads[tag_hash_fn(tag)];
-			hlist_add_head(&gnode->hash_node, head);
+static void serve_bootstrap(struct gossip *gsp)
+{
+	if (gsp->bootstrap_fd < 0)
+		return;
 
-			list_add(&gnode->node, &gsp->gnodes);
-			gsp->nr_gnodes++;
+	for (int i = 0; i < GOSSIP_BOOTSTRAP_MAX_STREAMS; i++) {
+		struct gsp_stream *st = &gsp->bootstrap_streams[i];
 
-			if (gnode->full_node) {
-				list_add(&gnode->active_node,
-				         &gsp->active_gnodes);
-				gsp->nr_active_gnodes++;
-			}
-		} else if (version > gnode->version) {
-			gossip_node_update_from_json(gnode, item);
-
-			if (gnode->full_node &&
-			    list_empty(&gnode->active_node)) {
-				list_add(&gnode->active_node,
-				         &gsp->active_gnodes);
-				gsp->nr_active_gnodes++;
-			} else if (!gnode->full_node &&
-			           !list_empty(&gnode->active_node)) {
-				list_del(&gnode->active_node);
-				gsp->nr_active_gnodes--;
+		if (st->fd < 0) {
+			if (gsp_stream_accept(gsp->bootstrap_fd, st))
+				continue;
+			if (make_snapshot(gsp, st)) {
+				gsp_stream_close(st);
+				continue;
 			}
 		}
+
+		int64_t budget = gossip_rate_budget(&gsp->rate, NULL,
+		                                    monotonic_usec());
+		int64_t tx_bytes = st->tx_bytes;
+		int ret = gsp_stream_flush(st, budget);
+		gossip_rate_charge(&gsp->rate, NULL, st->tx_bytes - tx_bytes);
+		if (ret > 0)
+			gsp->stats.snapshots++;
+		if (ret)
+			gsp_stream_close(st);
 	}
 }
 
-static int read_cb(struct gsp_udp *udp, const void *buf, ssize_t len,
-                   struct sockaddr *addr, socklen_t addr_len)
+void gossip_set_rate_limit(struct gossip *gsp, int64_t bytes_per_sec,
+                           int64_t peer_bytes_per_sec)
 {
-	struct gossip *gsp = udp->user_data;
-	JSON_PARSE(resp, buf, len);
-
-	if (!resp) {
-		char tmp[len + 1];
-		memcpy(tmp, buf, len);
-		tmp[len] = '\0';
-		fprintf(stderr, "buf => %s\n", tmp);
-		return -1;
-	}
-
-	if (JSON_GET_INT(resp, "phase") == GOSSIP_PHASE_SYNC) {
-		json_object *ack1 = handle_packet_sync(gsp, resp);
-		const char *result = JSON_DUMP(ack1);
-		gsp_udp_write(gsp->udp, result, strlen(result), addr, addr_len);
-		json_object_put(ack1);
-	} else if (JSON_GET_INT(resp, "phase") == GOSSIP_PHASE_ACK1) {
-		json_object *ack2 = handle_packet_ack1(gsp, resp);
-		const char *result = JSON_DUMP(ack2);
-		gsp_udp_write(gsp->udp, result, strlen(result), addr, addr_len);
-		json_object_put(ack2);
-	} else if (JSON_GET_INT(resp, "phase") == GOSSIP_PHASE_ACK2) {
-		handle_packet_ack2(gsp, resp);
-	}
-
-	json_object_put(resp);
-
-	return 0;
+	gossip_rate_init(&gsp->rate, bytes_per_sec, peer_bytes_per_sec);
 }
 
-static int do_sync_node(struct gossip *gsp, struct gossip_node **gnode_out)
+int gossip_serve_bootstrap(struct gossip *gsp, int port)
 {
-	assert(gsp->nr_active_gnodes);
-
-	struct gossip_node *gnode = get_random_active_gossip_node(gsp);
-	assert(gnode && gnode->full_node && !list_empty(&gnode->active_node));
+	struct gsp_addr addr;
 
-	// FIXME: find alive node directly rather than judge here
-	if (time(NULL) - gnode->alive_time > 600) {
-		list_del_init(&gnode->active_node);
-		gsp->nr_active_gnodes--;
-		return -1;
-	}
-
-	struct sockaddr_in addr = {0};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(gnode->public_port);
-	addr.sin_addr.s_addr = inet_addr(gnode->public_ipaddr);
+	if (!port) port = GOSSIP_DEFAULT_PORT;
+	if (gsp->bootstrap_fd >= 0)
+		return 0;
 
-	json_object *root = make_packet_sync(gsp, gnode);
-	const char *result = JSON_DUMP(root);
-	gsp_udp_write(gsp->udp, result, strlen(result),
-	              (struct sockaddr *)&addr, sizeof(addr));
-	json_object_put(root);
+	// dual-stack unless the host has no IPv6, as gossip_init()
+	if (gsp_addr_resolve(&addr, "::", port, true) == 0)
+		gsp->bootstrap_fd = gsp_stream_listen(&addr);
+	if (gsp->bootstrap_fd < 0 &&
+	    gsp_addr_resolve(&addr, "0.0.0.0", port, true) == 0)
+		gsp->bootstrap_fd = gsp_stream_listen(&addr);
 
-	*gnode_out = gnode;
-	return 0;
+	return gsp->bootstrap_fd < 0 ? -1 : 0;
 }
 
-static void do_sync_seed(struct gossip *gsp)
+// returns the number of nodes learned, -1 when the transfer failed
+int gossip_bootstrap(struct gossip *gsp, const char *seed)
 {
-	if (!gsp->seeds) return;
+	struct gsp_addr addr;
+	struct gsp_stream st;
 
-	int ran = rand() % gsp->nr_seeds;
-	const char *seed = gsp->seeds[ran];
+	if (gsp_addr_parse(&addr, seed, false) ||
+	    gsp_stream_connect(&st, &addr, GOSSIP_BOOTSTRAP_TIMEOUT))
+		return -1;
 
-	char ipaddr[64];
-	int port;
-	sscanf(seed, "%63[^:]:%d", ipaddr, &port);
+	int nr_gnodes = gsp->nr_gnodes;
+	const char *chunk;
+	ssize_t len;
 
-	struct sockaddr_in addr = {0};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = inet_addr(ipaddr);
+	while ((len = gsp_stream_read_chunk(&st, &chunk,
+	                                    GOSSIP_BOOTSTRAP_TIMEOUT)) > 0)
+		read_cb(gsp->tp, chunk, len, gsp_addr_sa(&addr), addr.len);
 
-	json_object *root = make_packet_sync(gsp, NULL);
-	const char *result = JSON_DUMP(root);
-	gsp_udp_write(gsp->udp, result, strlen(result),
-	              (struct sockaddr *)&addr, sizeof(addr));
-	json_object_put(root);
+	gsp_stream_close(&st);
+	return len < 0 ? -1 : gsp->nr_gnodes - nr_gnodes;
 }
 
 int gossip_init(struct gossip *gsp, struct gossip_node *gnode, int port)
 {
-	// udp
+	// udp, dual-stack unless the host has no IPv6
 	struct gsp_udp_info info = {
-		.ipaddr = "0.0.0.0",
+		.ipaddr = "::",
 		.port = GOSSIP_DEFAULT_PORT,
 		.recv_buf_len = GSP_UDP_RECV_BUF_LEN_MAX,
 	};
 	if (port) info.port = port;
 
-	gsp->udp = calloc(1, sizeof(*gsp->udp));
-	if (gsp_udp_init(gsp->udp, &info))
+	struct gsp_udp *udp = calloc(1, sizeof(*udp));
+	if (!udp) return -1;
+	if (gsp_udp_init(udp, &info)) {
+		info.ipaddr = "0.0.0.0";
+		if (gsp_udp_init(udp, &info)) {
+			free(udp);
+			return -1;
+		}
+	}
+
+	if (gossip_init_transport(gsp, gnode, &udp->tp)) {
+		gsp_udp_close(udp);
+		free(udp);
 		return -1;
-	gsp->udp->user_data = gsp;
+	}
+
+	gsp->udp = udp;
+	return 0;
+}
+
+static void free_zones(struct gossip *gsp)
+{
+	for (int i = 0; i < gsp->nr_zones; i++)
+		free(gsp->zones[i].name);
+	free(gsp->zones);
+	gsp->zones = NULL;
+	gsp->nr_zones = 0;
+}
+
+int gossip_init_transport(struct gossip *gsp, struct gossip_node *gnode,
+                          struct gsp_transport *tp)
+{
+	// transport
+	gsp->udp = NULL;
+	gsp->tp = tp;
+	gsp->tp->user_data = gsp;
+	gsp_transport_read_start(gsp->tp, read_cb);
 	gsp->last_sync_time = 0;
+	gsp->sync_count = GOSSIP_DEFAULT_SYNC_COUNT;
+	gsp->interval_min = GOSSIP_INTERVAL_MIN;
+	gsp->interval_max = GOSSIP_INTERVAL_MAX;
+	gsp->sync_interval = GOSSIP_INTERVAL_MIN;
+	gsp->sync_wait = GOSSIP_INTERVAL_MIN;
+	gsp->sync_changes = 0;
+	gsp->sync_version = gnode->version;
+	gsp->push_fanout = GOSSIP_PUSH_FANOUT;
+	gsp->push_ttl = GOSSIP_PUSH_TTL;
+	gsp->random_peers = GOSSIP_RANDOM_PEERS;
+
+	// self data
+	gsp->pending_data = NULL;
+	gsp->data_interval = GOSSIP_DATA_INTERVAL;
+	gsp->data_time = 0;
+
+	// zones, ours first
+	gsp->zones = NULL;
+	gsp->nr_zones = 0;
+	gsp->zone_reps = GOSSIP_ZONE_REPS;
+	if (gnode->zone &&
+	    !get_zone(gsp, gnode->zone, strlen(gnode->zone), true))
+		goto err_zones;
+
+	// partial view, none until gossip_set_partial_view()
+	gsp->active_view = GOSSIP_ACTIVE_VIEW;
+	gsp->passive_view = 0;
+
+	// broadcast, ids going on from a random number, not rand(): the library
+	// never seeds it, so a restart would repeat the ids of the run before
+	gsp->bcast_peers = GOSSIP_BCAST_PEERS;
+	gsp->bcast_timeout = GOSSIP_BCAST_TIMEOUT;
+	gsp->bcast_seq = random_u32();
+	gsp->bcast_cb = NULL;
+	gsp->bcast_data = NULL;
+	if (gossip_seen_init(&gsp->bcast_seen, GOSSIP_BCAST_CACHE))
+		goto err_zones;
 
 	// seed
 	gsp->nr_seeds = 0;
 	gsp->seeds = NULL;
+	gsp->seed_addrs = NULL;
 
 	// gnode
 	gsp->gnode_heads = (struct hlist_head *)calloc(
 		NR_HASH, sizeof(struct hlist_head));
+	if (!gsp->gnode_heads)
+		goto err_seen;
 	gsp->nr_gnodes = 0;
 	INIT_LIST_HEAD(&gsp->gnodes);
 	gsp->nr_active_gnodes = 0;
 	INIT_LIST_HEAD(&gsp->active_gnodes);
 
+	// shared memory export, none until gossip_export_shm()
+	gsp->shm = NULL;
+	gsp->shm_interval = GOSSIP_SHM_INTERVAL;
+	gsp->shm_dirty = 0;
+	gsp->shm_time = 0;
+
+	// packet tokens
+	gsp->toks = NULL;
+	gsp->nr_toks = 0;
+
+	// compression and segmentation
+	gsp->compress = 1;
+	gsp->segment_len = GOSSIP_SEGMENT_LEN;
+
+	// rate limit, none until gossip_set_rate_limit()
+	gossip_rate_init(&gsp->rate, 0, 0);
+
+	// bootstrap
+	gsp->bootstrap_fd = -1;
+	for (int i = 0; i < GOSSIP_BOOTSTRAP_MAX_STREAMS; i++)
+		gsp_stream_init(&gsp->bootstrap_streams[i], -1);
+
+	memset(&gsp->stats, 0, sizeof(gsp->stats));
+
 	// self
 	gsp->self = gnode;
 	unsigned int tag = calc_tag(gnode->pubid, strlen(gnode->pubid));
@@ -556,17 +2557,35 @@ int gossip_init(struct gossip *gsp, struct gossip_node *gnode, int port)
 	gsp->nr_gnodes++;
 
 	return 0;
+
+	// in reverse, leaving the transport to the caller as it was
+err_seen:
+	gossip_seen_close(&gsp->bcast_seen);
+err_zones:
+	free_zones(gsp);
+	gsp_transport_read_start(gsp->tp, NULL);
+	gsp->tp->user_data = NULL;
+	return -1;
 }
 
 int gossip_close(struct gossip *gsp)
 {
-	gsp_udp_close(gsp->udp);
+	gsp_transport_close(gsp->tp);
 	free(gsp->udp);
 
+	if (gsp->bootstrap_fd >= 0)
+		close(gsp->bootstrap_fd);
+	for (int i = 0; i < GOSSIP_BOOTSTRAP_MAX_STREAMS; i++)
+		gsp_stream_close(&gsp->bootstrap_streams[i]);
+
+	if (gsp->pending_data)
+		json_object_put(gsp->pending_data);
+
 	if (gsp->seeds) {
 		for (int i = 0; i < gsp->nr_seeds; i++)
 			free(gsp->seeds[i]);
 		free(gsp->seeds);
+		free(gsp->seed_addrs);
 	}
 
 	struct gossip_node *pos, *n;
@@ -577,6 +2596,15 @@ int gossip_close(struct gossip *gsp)
 	}
 
 	free(gsp->gnode_heads);
+	free(gsp->toks);
+
+	free_zones(gsp);
+	gossip_seen_close(&gsp->bcast_seen);
+
+	if (gsp->shm) {
+		gossip_shm_close(gsp->shm);
+		free(gsp->shm);
+	}
 
 	return 0;
 }
@@ -590,13 +2618,32 @@ void gossip_add_seeds(struct gossip *gsp, const char *seeds)
 	const char *end = strchr(start, ',');
 	if (!end) end = strchr(start, '\0');
 
-	void *tmp = malloc(end - start + 1);
-	memset(tmp, 0, end - start + 1);
+	// a seed that cannot be added is left out, the others still are
+	char *tmp = calloc(1, end - start + 1);
+	if (!tmp)
+		goto next;
 	memcpy(tmp, start, end - start);
 
+	char **strs = realloc(gsp->seeds, (gsp->nr_seeds + 1) * sizeof(*strs));
+	if (!strs) {
+		free(tmp);
+		goto next;
+	}
+	gsp->seeds = strs;
+
+	struct gsp_addr *addrs = realloc(gsp->seed_addrs,
+	                                 (gsp->nr_seeds + 1) * sizeof(*addrs));
+	if (!addrs) {
+		free(tmp);
+		goto next;
+	}
+	gsp->seed_addrs = addrs;
+
+	gsp->seeds[gsp->nr_seeds] = tmp;
+	gsp_addr_parse(&gsp->seed_addrs[gsp->nr_seeds], tmp, false);
 	gsp->nr_seeds++;
-	gsp->seeds = realloc(gsp->seeds, gsp->nr_seeds * sizeof(void *));
-	gsp->seeds[gsp->nr_seeds - 1] = tmp;
+
+next:
 
 	if (*end != '\0' && *(end + 1) != '\0')
 		gossip_add_seeds(gsp, end + 1);
@@ -616,26 +2663,251 @@ void gossip_clear_seeds(struct gossip *gsp)
 		free(gsp->seeds[i]);
 	free(gsp->seeds);
 	gsp->seeds = NULL;
+	free(gsp->seed_addrs);
+	gsp->seed_addrs = NULL;
+}
+
+/*
+ * shared memory export
+ */
+
+static void export_gnode(struct gossip *gsp, struct gossip_node *gnode)
+{
+	struct gossip_shm_record rec;
+	size_t len = strlen(gnode->pubid);
+	if (len >= sizeof(rec.pubid))
+		return;
+
+	// the data is not compared, nor copied unless the version is new
+	memset(&rec, 0, offsetof(struct gossip_shm_record, data));
+	memcpy(rec.pubid, gnode->pubid, len);
+	rec.version = gnode->version;
+	rec.alive_time = gnode->alive_time;
+	rec.alive_seen = gnode->alive_seen;
+	rec.update_time = gnode->update_time;
+
+	if (gnode->full_node) {
+		rec.flags |= GOSSIP_SHM_F_FULL;
+		snprintf(rec.ipaddr, sizeof(rec.ipaddr), "%s",
+		         gnode->public_ipaddr);
+		rec.port = gnode->public_port;
+	}
+	if (gnode == gsp->self ||
+	    gossip_now() - gnode->alive_seen <= GOSSIP_ALIVE_TIMEOUT)
+		rec.flags |= GOSSIP_SHM_F_ALIVE;
+	if (gnode == gsp->self)
+		rec.flags |= GOSSIP_SHM_F_SELF;
+	if (!list_empty(&gnode->active_node))
+		rec.flags |= GOSSIP_SHM_F_ACTIVE;
+
+	// the data object as the wire form has it
+	const char *data = NULL;
+	const char *wire = gossip_node_get_wire(gnode, &len);
+	if (wire) {
+		data = wire + gnode->wire_data;
+		rec.data_len = len - gnode->wire_data - 1;
+	}
+	if (rec.data_len > GOSSIP_SHM_DATA_LEN) {
+		rec.flags |= GOSSIP_SHM_F_DATA_LONG;
+		rec.data_len = 0;
+	}
+
+	gossip_shm_put(gsp->shm, &rec, data);
+}
+
+static void export_shm(struct gossip *gsp)
+{
+	struct gossip_node *pos;
+
+	gossip_shm_begin(gsp->shm);
+	list_for_each_entry(pos, &gsp->gnodes, node)
+		export_gnode(gsp, pos);
+	gossip_shm_end(gsp->shm);
+
+	gsp->shm_dirty = 0;
+	gsp->shm_time = monotonic_usec();
+}
+
+int gossip_export_shm(struct gossip *gsp, const char *name, int nr_records)
+{
+	if (gsp->shm) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	struct gossip_shm *shm = malloc(sizeof(*shm));
+	if (!shm) return -1;
+
+	if (gossip_shm_create(shm, name,
+	                      nr_records ? nr_records : GOSSIP_SHM_RECORDS)) {
+		free(shm);
+		return -1;
+	}
+
+	gsp->shm = shm;
+	export_shm(gsp);
+	return 0;
+}
+
+void gossip_get_stats(struct gossip *gsp, struct gossip_stats *stats)
+{
+	*stats = gsp->stats;
+	stats->nr_gnodes = gsp->nr_gnodes;
+	stats->nr_active_gnodes = gsp->nr_active_gnodes;
+}
+
+// our heartbeat goes up even when the clock went back
+static void self_heartbeat(struct gossip *gsp)
+{
+	struct gossip_node *self = gsp->self;
+	int64_t now = gossip_now();
+
+	self->alive_time = now > self->alive_time ? now : self->alive_time + 1;
+	self->alive_seen = now;
+}
+
+// push a change of ours now, rather than at the next rounds
+int gossip_publish_self(struct gossip *gsp)
+{
+	self_heartbeat(gsp);
+	gsp->shm_dirty = 1;
+	return push_gnode(gsp, gsp->self, gsp->push_ttl, NULL);
+}
+
+/*
+ * Queue value for key in the data of self, taking its reference; a NULL value
+ * removes the key. Returns 1 when the change is pending, 0 when it is dropped
+ * for leaving the data as it is.
+ */
+int gossip_set_data(struct gossip *gsp, const char *key, json_object *value)
+{
+	json_object *data = gossip_node_get_data(gsp->self);
+	json_object *cur;
+	int has = json_object_object_get_ex(data, key, &cur);
+
+	if (has ? value && json_object_equal(cur, value) : !value) {
+		// back to what self has, a pending change is void
+		if (gsp->pending_data)
+			json_object_object_del(gsp->pending_data, key);
+		json_object_put(value);
+		return 0;
+	}
+
+	if (!gsp->pending_data) {
+		gsp->pending_data = json_object_new_object();
+		if (!gsp->pending_data) {
+			json_object_put(value);
+			return -1;
+		}
+	}
+
+	if (json_object_object_add(gsp->pending_data, key, value)) {
+		json_object_put(value);
+		return -1;
+	}
+
+	return 1;
+}
+
+// apply the pending changes now, returns 1 if the version was bumped
+int gossip_flush_data(struct gossip *gsp)
+{
+	json_object *pending = gsp->pending_data;
+	if (!pending || !json_object_object_length(pending))
+		return 0;
+
+	struct gossip_node *self = gsp->self;
+	json_object *data = gossip_node_get_data(self);
+
+	json_object_object_foreach(pending, key, value) {
+		if (value)
+			json_object_object_add(data, key,
+			                       json_object_get(value));
+		else
+			json_object_object_del(data, key);
+	}
+
+	json_object_put(pending);
+	gsp->pending_data = NULL;
+	gsp->shm_dirty = 1;
+
+	gossip_node_invalidate(self);
+	self->version++;
+	self->update_time = gossip_now();
+	gsp->data_time = self->update_time;
+	return 1;
+}
+
+/*
+ * Pick the wait before the next round, as trickle timers do: back to the
+ * shortest when versions were exchanged since the last one or ours changed,
+ * twice as long when not, less a random part of up to half of it. A node
+ * still joining, with seeds but no peer yet, keeps to the shortest.
+ */
+static void schedule_sync(struct gossip *gsp)
+{
+	bool changed = gsp->sync_changes ||
+		gsp->self->version != gsp->sync_version ||
+		(!gsp->nr_active_gnodes && gsp->nr_seeds);
+	int interval = changed ? 0 : gsp->sync_interval << 1;
+
+	if (interval > gsp->interval_max)
+		interval = gsp->interval_max;
+	if (interval < gsp->interval_min)
+		interval = gsp->interval_min;
+	if (interval < 1)
+		interval = 1;
+
+	gsp->sync_interval = interval;
+	gsp->sync_wait = interval - rand() % (interval / 2 + 1);
+	gsp->sync_changes = 0;
+	gsp->sync_version = gsp->self->version;
 }
 
 int gossip_loop_once(struct gossip *gsp)
 {
-	gsp_udp_read_start(gsp->udp, read_cb);
+	gsp_transport_loop(gsp->tp, GSP_TRANSPORT_LOOP_ONCE);
+	serve_bootstrap(gsp);
+
+	if (gsp->pending_data &&
+	    gossip_now() - gsp->data_time >= gsp->data_interval)
+		gossip_flush_data(gsp);
 
-	gsp_udp_loop(gsp->udp, GSP_UDP_LOOP_ONCE);
+	// a change cuts a long wait short
+	if ((gsp->sync_changes || gsp->self->version != gsp->sync_version) &&
+	    gsp->sync_wait > gsp->interval_min)
+		gsp->sync_wait = gsp->interval_min;
+	bcast_graft_missing(gsp);
 
-	if (time(NULL) - gsp->last_sync_time < (GOSSIP_STALL >> 1))
+	if (gsp->shm && gsp->shm_dirty &&
+	    monotonic_usec() - gsp->shm_time >= gsp->shm_interval * 1000LL)
+		export_shm(gsp);
+
+	if (gossip_now() - gsp->last_sync_time < gsp->sync_wait)
 		return 0;
 
-	gsp->self->alive_time = time(NULL);
+	GOSSIP_TRACE_BEGIN(trace_start);
+	self_heartbeat(gsp);
+	update_own_zone(gsp);
+	fill_active_view(gsp);
+	turn_active_view(gsp);
+	bcast_link_peers(gsp);
+	gsp->shuffle_left = GOSSIP_SHUFFLE_LEN;
 
 	struct gossip_node *gnode = NULL;
 	if (!gsp->nr_active_gnodes ||
 		do_sync_node(gsp, &gnode) != 0 ||
-		!gossip_node_is_seed(gnode, gsp->seeds, gsp->nr_seeds))
+		!gossip_node_is_seed(gsp, gnode))
 		do_sync_seed(gsp);
-
-	gsp->last_sync_time = time(NULL);
+	if (gnode)
+		bcast_repair(gsp, gnode);
+
+	gsp->last_sync_time = gossip_now();
+	gsp->shm_dirty = 1;
+	gsp->stats.rounds++;
+	schedule_sync(gsp);
+	GOSSIP_TRACE_END(trace_start, GOSSIP_TRACE_ROUND, GOSSIP_PHASE_SYNC,
+	                 0, 0);
 
 	return 0;
 }
@@ -6,46 +6,236 @@
 #include "list.h"
 #include "serialize.h"
 #include "gsp_udp.h"
+#include "gsp_addr.h"
+#include "gsp_stream.h"
+#include "json_scan.h"
+#include "gossip_stats.h"
+#include "gossip_rate.h"
+#include "gossip_coord.h"
+#include "gossip_seen.h"
+#include "gossip_shm.h"
 
 #define GOSSIP_DEFAULT_PORT 25688
 #define GOSSIP_DEFAULT_SYNC_COUNT 6
 
 #define GOSSIP_STALL 10
+
+/*
+ * alive_time is a heartbeat: its node sets it from its own clock at every
+ * round, never lower than before, and the others only compare it with the
+ * heartbeats of that same node. A peer is judged alive on our own clock, by
+ * alive_seen, when its heartbeat last went up; it leaves the active list
+ * GOSSIP_ALIVE_TIMEOUT seconds after that, whatever the skew between us.
+ */
+#define GOSSIP_ALIVE_TIMEOUT 600
 #define GOSSIP_PHASE_SYNC 0
 #define GOSSIP_PHASE_ACK1 1
 #define GOSSIP_PHASE_ACK2 2
+#define GOSSIP_PHASE_PUSH 3
+#define GOSSIP_PHASE_BCAST 4
+#define GOSSIP_PHASE_IHAVE 5
+#define GOSSIP_PHASE_GRAFT 6
+#define GOSSIP_PHASE_PRUNE 7
+
+/*
+ * gossip_publish_self() pushes our entry to push_fanout active peers at once.
+ * A peer that learns something from a PUSH passes it on the same way while
+ * the "ttl" it came with, at most push_ttl, lasts. Since each node passes a
+ * rumor on only once, about e^-fanout of the cluster never hears it; the
+ * default fanout of 0 grows with the cluster, log2 of the active peers + 2.
+ */
+#define GOSSIP_PUSH_FANOUT 0
+#define GOSSIP_PUSH_TTL 4
+
+/*
+ * gossip_broadcast() sends a message to every node over a tree that grows
+ * out of links between a few peers, Plumtree style. Each node links to
+ * bcast_peers random active peers, which link back. A message goes in full
+ * over eager links, and only as an IHAVE of its id over lazy ones. A node
+ * getting a message a second time PRUNEs the link it came by into a lazy
+ * one; a node that still misses an announced message bcast_timeout seconds
+ * later GRAFTs one of the links it was announced on, another each time, and
+ * gets it over that, giving up after GOSSIP_BCAST_GRAFTS asks of each. For GOSSIP_BCAST_REPAIR seconds after a message came,
+ * rounds announce it to their peer too, for the nodes every copy and IHAVE
+ * of it was lost to. The last GOSSIP_BCAST_CACHE messages are kept, to tell
+ * duplicates and to answer GRAFTs, so the callback of gossip_set_bcast_cb()
+ * gets each message of the other nodes once.
+ */
+#define GOSSIP_BCAST_PEERS 3
+#define GOSSIP_BCAST_CACHE 1024
+#define GOSSIP_BCAST_TIMEOUT 1
+#define GOSSIP_BCAST_GRAFTS 3
+#define GOSSIP_BCAST_REPAIR 60
+#define GOSSIP_BCAST_LEN_MAX 8192
+
+enum {
+	GOSSIP_BCAST_NONE,
+	GOSSIP_BCAST_EAGER,
+	GOSSIP_BCAST_LAZY,
+};
+
+/*
+ * A SYNC carries the network coordinates of its sender and a timestamp that
+ * the ACK1 echoes back with the coordinates of the peer, so that each round
+ * places us a bit better. A round syncs with a uniformly random peer for a
+ * random_peers fraction of rounds, and otherwise with the nearest of
+ * GOSSIP_NEAR_SAMPLES random peers, which keeps most rounds local while
+ * updates still cross the whole cluster.
+ */
+#define GOSSIP_RANDOM_PEERS 0.25
+#define GOSSIP_NEAR_SAMPLES 4
+
+/*
+ * Zones: a node put in one with gossip_node_set_zone() before gossip_init()
+ * keeps every node of its zone but only zone_reps nodes of each other zone,
+ * which rounds still cross zones through. Of the rest of another zone it
+ * only has the aggregate that the members of that zone put in their SYNC and
+ * ACK1: how many nodes it has and a digest of their versions. A node outside
+ * any zone keeps every node, as do all of them while none has a zone.
+ *
+ * Rounds go to a node of another zone before its heartbeat is halfway to
+ * GOSSIP_ALIVE_TIMEOUT, and a SYNC to one lists the others we keep of its
+ * zone, so one round keeps all their heartbeats fresh. One found silent is
+ * still synced with, and only dropped once another node of its zone has been
+ * taken in to replace it.
+ */
+#define GOSSIP_ZONE_REPS 3
+#define GOSSIP_MAX_ZONES 256
+
+struct gossip_zone {
+	char *name;
+	int nr_reps;        // of its nodes we keep, for zones other than ours
+	int64_t nr_nodes;   // as its members report it
+	uint64_t digest;    // of the pubids and versions of its nodes
+	int64_t seen_time;  // of the last report
+	int64_t stale_time; // when one of the nodes we keep of it went silent
+};
+
+/*
+ * Partial view, as HyParView has it, for meshes too big for every node to
+ * know every other: once gossip_set_partial_view() is called, a node keeps
+ * at most active_view peers to sync with and passive_view more entries, a
+ * bound of 0 taking GOSSIP_ACTIVE_VIEW or GOSSIP_PASSIVE_VIEW. The samples
+ * that rounds exchange keep shuffling the passive view, a new node taking
+ * the place of a random passive one, and an active peer that expires is
+ * forgotten and replaced with a passive full node.
+ */
+#define GOSSIP_ACTIVE_VIEW 5
+#define GOSSIP_PASSIVE_VIEW 30
+#define GOSSIP_SHUFFLE_LEN 3
+
+/*
+ * Rounds run interval_min seconds apart while versions flow, and back off,
+ * doubling up to interval_max, while rounds exchange nothing new. Each wait is
+ * cut by a random part of up to half the interval, so that nodes started
+ * together drift out of step. Set both bounds equal for a fixed interval.
+ */
+#define GOSSIP_INTERVAL_MIN 1
+#define GOSSIP_INTERVAL_MAX 10
+
+/*
+ * Capabilities advertised in the "caps" of SYNC and ACK1. A reply is only
+ * compressed when the packet it answers advertised GOSSIP_CAP_LZ.
+ */
+#define GOSSIP_CAP_LZ 1
+
+// compressed packet: magic, 32-bit little endian raw length, lz block
+#define GOSSIP_LZ_MAGIC 0x01
+#define GOSSIP_LZ_HDR_LEN 5
+#define GOSSIP_LZ_MIN_LEN 256
+
+/*
+ * Replies longer than segment_len are cut into segments of that size, each a
+ * packet of its own, sent as one train with segmentation offload where the
+ * transport has it. The default keeps a segment within an ethernet MTU.
+ */
+#define GOSSIP_SEGMENT_LEN 1400
+#define GOSSIP_SEGMENT_LEN_MIN 512
+#define GOSSIP_MAX_SEGMENTS 64
+
+/*
+ * A joiner may pull the whole membership of a seed at once with
+ * gossip_bootstrap(), over TCP on the port number of the seed's gossip, once
+ * the seed serves it with gossip_serve_bootstrap().
+ */
+#define GOSSIP_BOOTSTRAP_MAX_STREAMS 4
+#define GOSSIP_BOOTSTRAP_TIMEOUT 5000 // ms
+
+/*
+ * gossip_set_data() queues changes to the data of self instead of applying
+ * them: a key set again before the flush only replaces its pending value, and
+ * the pending set goes into self under a single version bump at most once per
+ * data_interval seconds, from gossip_loop_once().
+ */
+#define GOSSIP_DATA_INTERVAL 1
+
+/*
+ * gossip_export_shm() publishes the membership in a shared memory segment,
+ * see gossip_shm.h, where the other processes of the host look nodes up
+ * without asking us. gossip_loop_once() brings it up to date after packets
+ * or a round, at most once every shm_interval ms.
+ */
+#define GOSSIP_SHM_RECORDS 1024
+#define GOSSIP_SHM_INTERVAL 100 // ms
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Every timestamp of gossip comes from gossip_now(), seconds of time() unless
+ * a clock has been installed, e.g. the virtual clock of a simulation.
+ */
+typedef int64_t (*gossip_clock_fn)(void);
+void gossip_set_clock(gossip_clock_fn clock);
+int64_t gossip_now(void);
+
 struct gossip_node {
 	int full_node;
 	char *public_ipaddr;
 	int public_port;
+	struct gsp_addr addr; // public_ipaddr:public_port of a full node
 
 	char *pubkey;
 	char *pubid;
+	char *zone; // NULL outside any zone
 	int64_t version;
 	int64_t alive_time;
+	int64_t alive_seen; // ours, not sent
 	int64_t update_time;
+	struct gossip_coord coord; // as last heard from the node, ours for self
+	int bcast_link; // GOSSIP_BCAST_*, ours, not sent
 
+	// NULL for a node learned off the wire until gossip_node_get_data(),
+	// which is the way to read and change it
 	json_object *data;
 
+	// cached wire form, valid while wire_version == version
+	char *wire;
+	size_t wire_len;
+	size_t wire_data;
+	int64_t wire_version;
+
 	struct hlist_node hash_node;
 	struct list_head node;
 	struct list_head active_node;
 };
 
+#define GOSSIP_NODE_WIRE_FIELDS(X) \
+	X(struct gossip_node, full_node, SER_T_INT, NULL) \
+	X(struct gossip_node, public_ipaddr, SER_T_STRING, NULL) \
+	X(struct gossip_node, public_port, SER_T_INT, NULL) \
+	X(struct gossip_node, pubkey, SER_T_STRING, NULL) \
+	X(struct gossip_node, pubid, SER_T_STRING, NULL) \
+	X(struct gossip_node, version, SER_T_INT64, NULL) \
+	X(struct gossip_node, update_time, SER_T_INT64, NULL)
+
+#define GOSSIP_NODE_SER_FIELDS(X) \
+	GOSSIP_NODE_WIRE_FIELDS(X) \
+	X(struct gossip_node, alive_time, SER_T_INT64, NULL)
+
 static const struct ser_meta gossip_node_meta[] = {
-	INIT_SER_META(struct gossip_node, full_node, SER_T_INT, NULL),
-	INIT_SER_META(struct gossip_node, public_ipaddr, SER_T_STRING, NULL),
-	INIT_SER_META(struct gossip_node, public_port, SER_T_INT, NULL),
-	INIT_SER_META(struct gossip_node, pubkey, SER_T_STRING, NULL),
-	INIT_SER_META(struct gossip_node, pubid, SER_T_STRING, NULL),
-	INIT_SER_META(struct gossip_node, version, SER_T_INT64, NULL),
-	INIT_SER_META(struct gossip_node, alive_time, SER_T_INT64, NULL),
-	INIT_SER_META(struct gossip_node, update_time, SER_T_INT64, NULL),
+	GOSSIP_NODE_SER_FIELDS(SER_META_X)
 	INIT_SER_META_NONE(),
 };
 
@@ -54,16 +244,40 @@ void free_gossip_node(struct gossip_node *gnode);
 void gossip_node_set_full(struct gossip_node *gnode,
                           const char *ipaddr, int port);
 void gossip_node_unset_full(struct gossip_node *gnode);
+void gossip_node_set_zone(struct gossip_node *gnode, const char *zone);
 
+json_object *gossip_node_get_data(struct gossip_node *gnode);
 json_object *gossip_node_to_json(const struct gossip_node *gnode);
 struct gossip_node *gossip_node_from_json(json_object *root);
 
+struct gossip;
+
+// a message of gossip_broadcast() from the node of pubid origin
+typedef void (*gossip_bcast_cb)(struct gossip *gsp, const char *origin,
+                                const char *msg, void *user_data);
+
 struct gossip {
-	struct gsp_udp *udp;
+	struct gsp_transport *tp;
+	struct gsp_udp *udp; // owned transport of gossip_init()
 	int64_t last_sync_time;
+	int sync_count;
+	int interval_min;
+	int interval_max;
+	int sync_interval;    // seconds, between interval_min and interval_max
+	int sync_wait;        // after last_sync_time, sync_interval less jitter
+	int sync_changes;     // versions exchanged since the last round
+	int64_t sync_version; // self->version at the last round
+	int push_fanout;
+	int push_ttl;
+	double random_peers;
+
+	json_object *pending_data; // of gossip_set_data(), NULL if none
+	int data_interval;
+	int64_t data_time; // of the last flush of pending_data
 
 	int nr_seeds;
 	char **seeds;
+	struct gsp_addr *seed_addrs; // resolved once, by gossip_add_seeds()
 
 	struct hlist_head *gnode_heads;
 	int nr_gnodes;
@@ -72,13 +286,65 @@ struct gossip {
 	struct list_head active_gnodes;
 
 	struct gossip_node *self;
+
+	struct gossip_zone *zones; // ours first, once we are in one
+	int nr_zones;
+	int zone_reps;
+
+	int active_view;
+	int passive_view; // 0 to keep every node
+	int shuffle_left;
+
+	int bcast_peers;
+	int bcast_timeout;
+	uint32_t bcast_seq;
+	int64_t bcast_time; // of the last message to come
+	struct gossip_seen bcast_seen;
+	gossip_bcast_cb bcast_cb;
+	void *bcast_data;
+
+	struct gossip_shm *shm; // of gossip_export_shm(), NULL if none
+	int shm_interval;
+	int shm_dirty;
+	int64_t shm_time; // of the last export, usec
+
+	struct json_tok *toks;
+	int nr_toks;
+
+	int compress;
+	size_t segment_len; // below GOSSIP_SEGMENT_LEN_MIN, a single segment
+
+	int bootstrap_fd; // listener of gossip_serve_bootstrap(), -1 if none
+	struct gsp_stream bootstrap_streams[GOSSIP_BOOTSTRAP_MAX_STREAMS];
+
+	struct gossip_rate rate;
+	struct gossip_stats stats;
 };
 
 int gossip_init(struct gossip *gsp, struct gossip_node *gnode, int port);
+int gossip_init_transport(struct gossip *gsp, struct gossip_node *gnode,
+                          struct gsp_transport *tp);
 int gossip_close(struct gossip *gsp);
 void gossip_add_seeds(struct gossip *gsp, const char *seeds);
 void gossip_clear_seeds(struct gossip *gsp);
+void gossip_set_rate_limit(struct gossip *gsp, int64_t bytes_per_sec,
+                           int64_t peer_bytes_per_sec);
+void gossip_set_partial_view(struct gossip *gsp, int active_view,
+                             int passive_view);
+int gossip_serve_bootstrap(struct gossip *gsp, int port);
+int gossip_bootstrap(struct gossip *gsp, const char *seed);
+struct gossip_node *gossip_find_node(struct gossip *gsp, const char *pubid);
+const struct gossip_zone *gossip_find_zone(struct gossip *gsp,
+                                           const char *name);
+void gossip_get_stats(struct gossip *gsp, struct gossip_stats *stats);
 int gossip_loop_once(struct gossip *gsp);
+int gossip_publish_self(struct gossip *gsp);
+int gossip_set_data(struct gossip *gsp, const char *key, json_object *value);
+int gossip_flush_data(struct gossip *gsp);
+void gossip_set_bcast_cb(struct gossip *gsp, gossip_bcast_cb cb,
+                         void *user_data);
+int gossip_broadcast(struct gossip *gsp, const char *msg);
+int gossip_export_shm(struct gossip *gsp, const char *name, int nr_records);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,88 @@
+#include "gossip_coord.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// tuning of the Vivaldi paper, as serf has it
+#define COORD_CE 0.25 // weight of a sample in the error
+#define COORD_CC 0.25 // step of a move
+#define COORD_ZERO 1.0e-6
+
+void gossip_coord_init(struct gossip_coord *coord)
+{
+	memset(coord, 0, sizeof(*coord));
+	coord->height = GOSSIP_COORD_HEIGHT_MIN;
+	coord->error = GOSSIP_COORD_ERROR_MAX;
+}
+
+static double vec_dist(const double *a, const double *b)
+{
+	double sum = 0;
+
+	for (int i = 0; i < GOSSIP_COORD_DIMS; i++)
+		sum += (a[i] - b[i]) * (a[i] - b[i]);
+	return sqrt(sum);
+}
+
+double gossip_coord_dist(const struct gossip_coord *a,
+                         const struct gossip_coord *b)
+{
+	return vec_dist(a->vec, b->vec) + a->height + b->height;
+}
+
+/*
+ * Unit vector from b to a in unit, returning the distance between them; two
+ * points at the same place are pulled apart in a random direction.
+ */
+static double unit_vector(const double *a, const double *b, double *unit)
+{
+	double mag = vec_dist(a, b);
+
+	if (mag > COORD_ZERO) {
+		for (int i = 0; i < GOSSIP_COORD_DIMS; i++)
+			unit[i] = (a[i] - b[i]) / mag;
+		return mag;
+	}
+
+	double sum = 0;
+	for (int i = 0; i < GOSSIP_COORD_DIMS; i++) {
+		unit[i] = (double)rand() / RAND_MAX - 0.5;
+		sum += unit[i] * unit[i];
+	}
+
+	sum = sqrt(sum);
+	for (int i = 0; i < GOSSIP_COORD_DIMS; i++)
+		unit[i] = sum > COORD_ZERO ? unit[i] / sum : i == 0;
+	return 0;
+}
+
+void gossip_coord_update(struct gossip_coord *coord,
+                         const struct gossip_coord *peer, double rtt_ms)
+{
+	if (!isfinite(rtt_ms) || rtt_ms <= 0 || !isfinite(peer->error))
+		return;
+
+	double rtt = rtt_ms;
+	double dist = gossip_coord_dist(coord, peer);
+	double total = coord->error + peer->error;
+	double weight = total > COORD_ZERO ? coord->error / total : 0.5;
+
+	double sample = fabs(dist - rtt) / rtt;
+	coord->error = sample * COORD_CE * weight +
+		coord->error * (1 - COORD_CE * weight);
+	if (coord->error > GOSSIP_COORD_ERROR_MAX)
+		coord->error = GOSSIP_COORD_ERROR_MAX;
+
+	double force = COORD_CC * weight * (rtt - dist);
+	double unit[GOSSIP_COORD_DIMS];
+	double mag = unit_vector(coord->vec, peer->vec, unit);
+
+	for (int i = 0; i < GOSSIP_COORD_DIMS; i++)
+		coord->vec[i] += unit[i] * force;
+
+	if (mag > COORD_ZERO) {
+		coord->height += (coord->height + peer->height) * force / mag;
+		if (coord->height < GOSSIP_COORD_HEIGHT_MIN)
+			coord->height = GOSSIP_COORD_HEIGHT_MIN;
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef __GOSSIP_COORD_H
+#define __GOSSIP_COORD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Vivaldi network coordinates: a point in a few dimensions plus a height,
+ * standing for the access link, such that the distance between two nodes
+ * estimates their round trip time, in milliseconds. Each measured round trip
+ * to a peer moves our point along the line to its point, as a spring would,
+ * by a step weighted with how sure we are compared with the peer.
+ */
+
+#define GOSSIP_COORD_DIMS 3
+#define GOSSIP_COORD_ERROR_MAX 1.5   // error of a node yet unplaced
+#define GOSSIP_COORD_HEIGHT_MIN 0.01 // ms
+
+struct gossip_coord {
+	double vec[GOSSIP_COORD_DIMS];
+	double height;
+	double error; // relative, of the distances we predict
+};
+
+void gossip_coord_init(struct gossip_coord *coord);
+// estimated round trip time between a and b, in ms
+double gossip_coord_dist(const struct gossip_coord *a,
+                         const struct gossip_coord *b);
+// move coord after a round trip of rtt_ms to a peer at peer
+void gossip_coord_update(struct gossip_coord *coord,
+                         const struct gossip_coord *peer, double rtt_ms);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
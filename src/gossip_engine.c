@@ -0,0 +1,637 @@
+#include "gossip_engine.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+	CLUSTER_IDLE,
+	CLUSTER_QUEUED,
+	CLUSTER_RUNNING,
+	CLUSTER_AGAIN, // running, with datagrams come since
+};
+
+struct gossip_cluster {
+	struct gsp_transport tp;
+	struct gossip_engine *eng; // NULL once the engine is closed
+	uint32_t id;
+	struct gossip *gsp;
+	pthread_mutex_t run_lock; // of gsp
+
+	pthread_mutex_t lock; // of what follows
+	pthread_cond_t idle_cond;
+	int state;
+	int closing;
+	struct list_head inbox;
+	int nr_inbox;
+
+	struct hlist_node hash_node;
+	struct list_head node;
+	struct list_head run_node;
+};
+
+struct engine_packet {
+	struct list_head node;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	size_t len;
+	char data[];
+};
+
+static int64_t monotonic_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static struct gossip_cluster *find_cluster(struct gossip_engine *eng,
+                                           uint32_t id)
+{
+	struct gossip_cluster *pos;
+	hlist_for_each_entry(pos, &eng->heads[id % GOSSIP_ENGINE_NR_HASH],
+	                     hash_node) {
+		if (pos->id == id)
+			return pos;
+	}
+
+	return NULL;
+}
+
+/*
+ * workers
+ */
+
+static void worker_push(struct gossip_worker *w, struct gossip_cluster *c)
+{
+	struct gossip_engine *eng = w->eng;
+
+	pthread_mutex_lock(&w->lock);
+	list_add_tail(&c->run_node, &w->queue);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&eng->ready_lock);
+	eng->nr_ready++;
+	pthread_cond_signal(&eng->ready_cond);
+	pthread_mutex_unlock(&eng->ready_lock);
+}
+
+// the oldest of our own clusters, or the newest of another worker's
+static struct gossip_cluster *worker_pop(struct gossip_worker *w)
+{
+	struct gossip_engine *eng = w->eng;
+	struct gossip_cluster *c = NULL;
+	int self = w - eng->workers;
+
+	for (int i = 0; i < eng->nr_workers && !c; i++) {
+		struct gossip_worker *v =
+			&eng->workers[(self + i) % eng->nr_workers];
+
+		pthread_mutex_lock(&v->lock);
+		if (!list_empty(&v->queue)) {
+			c = i ? list_last_entry(&v->queue, struct gossip_cluster,
+			                        run_node)
+			      : list_first_entry(&v->queue,
+			                         struct gossip_cluster, run_node);
+			list_del_init(&c->run_node);
+		}
+		pthread_mutex_unlock(&v->lock);
+
+		if (c && i)
+			w->nr_steals++;
+	}
+
+	if (c) {
+		pthread_mutex_lock(&eng->ready_lock);
+		eng->nr_ready--;
+		pthread_mutex_unlock(&eng->ready_lock);
+	}
+
+	return c;
+}
+
+// with c->lock held
+static void schedule_cluster(struct gossip_cluster *c, struct gossip_worker *w)
+{
+	if (c->closing)
+		return;
+
+	if (c->state == CLUSTER_IDLE) {
+		c->state = CLUSTER_QUEUED;
+		worker_push(w, c);
+	} else if (c->state == CLUSTER_RUNNING) {
+		c->state = CLUSTER_AGAIN;
+	}
+}
+
+static struct gossip_worker *home_worker(struct gossip_engine *eng,
+                                         const struct gossip_cluster *c)
+{
+	return &eng->workers[c->id % eng->nr_workers];
+}
+
+// out of CLUSTER_RUNNING, queued to w again if datagrams came meanwhile
+static void cluster_ran(struct gossip_cluster *c, struct gossip_worker *w)
+{
+	pthread_mutex_lock(&c->lock);
+	if (c->state == CLUSTER_AGAIN && !c->closing) {
+		c->state = CLUSTER_QUEUED;
+		worker_push(w, c);
+	} else {
+		c->state = CLUSTER_IDLE;
+		pthread_cond_broadcast(&c->idle_cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void run_cluster(struct gossip_worker *w, struct gossip_cluster *c)
+{
+	pthread_mutex_lock(&c->lock);
+	if (c->closing) {
+		c->state = CLUSTER_IDLE;
+		pthread_cond_broadcast(&c->idle_cond);
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	c->state = CLUSTER_RUNNING;
+	pthread_mutex_unlock(&c->lock);
+
+	pthread_mutex_lock(&c->run_lock);
+	gossip_loop_once(c->gsp);
+	pthread_mutex_unlock(&c->run_lock);
+	w->nr_runs++;
+
+	// what came in meanwhile is ours to run again, being hot here
+	cluster_ran(c, w);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct gossip_worker *w = arg;
+	struct gossip_engine *eng = w->eng;
+
+	for (;;) {
+		pthread_mutex_lock(&eng->ready_lock);
+		int stop;
+		while (!(stop = __atomic_load_n(&eng->stop, __ATOMIC_ACQUIRE)) &&
+		       !eng->nr_ready)
+			pthread_cond_wait(&eng->ready_cond, &eng->ready_lock);
+		pthread_mutex_unlock(&eng->ready_lock);
+		if (stop)
+			break;
+
+		struct gossip_cluster *c = worker_pop(w);
+		if (c)
+			run_cluster(w, c);
+	}
+
+	return NULL;
+}
+
+/*
+ * receive
+ */
+
+static int engine_read_cb(struct gsp_transport *tp, const void *buf,
+                          ssize_t len, struct sockaddr *addr,
+                          socklen_t addr_len)
+{
+	struct gossip_engine *eng =
+		container_of(tp, struct gossip_engine, udp.tp);
+	const unsigned char *hdr = buf;
+
+	eng->rx_packets++;
+	if (len <= GOSSIP_ENGINE_HDR_LEN || hdr[0] != GOSSIP_ENGINE_MAGIC ||
+	    addr_len > sizeof(struct sockaddr_storage)) {
+		eng->rx_dropped++;
+		return -1;
+	}
+
+	uint32_t id = hdr[1] | hdr[2] << 8 | hdr[3] << 16 |
+		(uint32_t)hdr[4] << 24;
+	len -= GOSSIP_ENGINE_HDR_LEN;
+
+	struct engine_packet *pkt = malloc(sizeof(*pkt) + len);
+	if (!pkt) {
+		eng->rx_dropped++;
+		return -1;
+	}
+	memcpy(&pkt->from, addr, addr_len);
+	pkt->from_len = addr_len;
+	pkt->len = len;
+	memcpy(pkt->data, hdr + GOSSIP_ENGINE_HDR_LEN, len);
+
+	bool queued = false;
+	pthread_mutex_lock(&eng->lock);
+	struct gossip_cluster *c = find_cluster(eng, id);
+	if (c) {
+		pthread_mutex_lock(&c->lock);
+		if (c->nr_inbox < GOSSIP_ENGINE_INBOX_MAX) {
+			list_add_tail(&pkt->node, &c->inbox);
+			c->nr_inbox++;
+			schedule_cluster(c, home_worker(eng, c));
+			queued = true;
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+	pthread_mutex_unlock(&eng->lock);
+
+	if (!queued) {
+		eng->rx_dropped++;
+		free(pkt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void tick_clusters(struct gossip_engine *eng)
+{
+	struct gossip_cluster *pos;
+
+	pthread_mutex_lock(&eng->lock);
+	list_for_each_entry(pos, &eng->clusters, node) {
+		pthread_mutex_lock(&pos->lock);
+		schedule_cluster(pos, home_worker(eng, pos));
+		pthread_mutex_unlock(&pos->lock);
+	}
+	pthread_mutex_unlock(&eng->lock);
+}
+
+// a datagram at a time, or the receive timeout of gsp_udp, between ticks
+static void *rx_thread(void *arg)
+{
+	struct gossip_engine *eng = arg;
+
+	while (!__atomic_load_n(&eng->stop, __ATOMIC_ACQUIRE)) {
+		gsp_transport_loop(&eng->udp.tp, GSP_TRANSPORT_LOOP_ONCE);
+
+		int64_t now = monotonic_msec();
+		if (now - eng->tick_time >= GOSSIP_ENGINE_TICK) {
+			eng->tick_time = now;
+			tick_clusters(eng);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * cluster transport
+ */
+
+#define FRAME_BUF_LEN (GSP_UDP_GRO_BUF_LEN + \
+	GOSSIP_MAX_SEGMENTS * GOSSIP_ENGINE_HDR_LEN)
+
+// of each worker, freed by the destructor of frame_key when it exits
+static __thread char *frame_buf;
+
+static pthread_key_t frame_key;
+static pthread_once_t frame_once = PTHREAD_ONCE_INIT;
+static int frame_key_err;
+
+static void make_frame_key(void)
+{
+	frame_key_err = pthread_key_create(&frame_key, free);
+}
+
+static int prepare_frame_buf(void)
+{
+	if (frame_buf)
+		return 0;
+
+	if (pthread_once(&frame_once, make_frame_key) || frame_key_err)
+		return -1;
+
+	char *buf = malloc(FRAME_BUF_LEN);
+	if (!buf)
+		return -1;
+	if (pthread_setspecific(frame_key, buf)) {
+		free(buf);
+		return -1;
+	}
+
+	frame_buf = buf;
+	return 0;
+}
+
+// buf cut into seg_size segments, each behind the header of cluster id
+static ssize_t frame_segments(uint32_t id, const void *buf, size_t len,
+                              size_t seg_size)
+{
+	if (prepare_frame_buf())
+		return -1;
+
+	if (!seg_size || seg_size > len)
+		seg_size = len;
+
+	size_t nr_segs = len ? (len + seg_size - 1) / seg_size : 1;
+	if (len + nr_segs * GOSSIP_ENGINE_HDR_LEN > FRAME_BUF_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	char *p = frame_buf;
+	size_t off = 0;
+	do {
+		size_t n = len - off < seg_size ? len - off : seg_size;
+
+		p[0] = GOSSIP_ENGINE_MAGIC;
+		p[1] = id;
+		p[2] = id >> 8;
+		p[3] = id >> 16;
+		p[4] = id >> 24;
+		memcpy(p + GOSSIP_ENGINE_HDR_LEN, (const char *)buf + off, n);
+		p += GOSSIP_ENGINE_HDR_LEN + n;
+		off += n;
+	} while (off < len);
+
+	return p - frame_buf;
+}
+
+static ssize_t cluster_write_segments(struct gsp_transport *tp,
+                                      const void *buf, size_t len,
+                                      size_t seg_size,
+                                      const struct sockaddr *addr,
+                                      socklen_t addr_len)
+{
+	struct gossip_cluster *c = container_of(tp, struct gossip_cluster, tp);
+	struct gossip_engine *eng = c->eng;
+
+	if (!eng) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	ssize_t n = frame_segments(c->id, buf, len, seg_size);
+	if (n < 0)
+		return -1;
+
+	if (!seg_size || seg_size > len)
+		seg_size = len;
+
+	pthread_mutex_lock(&eng->tx_lock);
+	ssize_t ret = gsp_transport_write_segments(&eng->udp.tp, frame_buf, n,
+		seg_size + GOSSIP_ENGINE_HDR_LEN, addr, addr_len);
+	pthread_mutex_unlock(&eng->tx_lock);
+
+	return ret < 0 ? -1 : (ssize_t)len;
+}
+
+static ssize_t cluster_write(struct gsp_transport *tp, const void *buf,
+                             size_t len, const struct sockaddr *addr,
+                             socklen_t addr_len)
+{
+	return cluster_write_segments(tp, buf, len, len, addr, addr_len);
+}
+
+// the datagrams queued by the receive thread, flags aside
+static int cluster_loop(struct gsp_transport *tp, int flags)
+{
+	struct gossip_cluster *c = container_of(tp, struct gossip_cluster, tp);
+	LIST_HEAD(inbox);
+
+	pthread_mutex_lock(&c->lock);
+	list_splice_init(&c->inbox, &inbox);
+	c->nr_inbox = 0;
+	pthread_mutex_unlock(&c->lock);
+
+	struct engine_packet *pos, *n;
+	list_for_each_entry_safe(pos, n, &inbox, node) {
+		list_del(&pos->node);
+		if (tp->read_cb) {
+			tp->read_cb(tp, pos->data, pos->len,
+			            (struct sockaddr *)&pos->from,
+			            pos->from_len);
+		}
+		free(pos);
+	}
+
+	return 0;
+}
+
+static void free_cluster(struct gossip_cluster *c)
+{
+	struct engine_packet *pos, *n;
+	list_for_each_entry_safe(pos, n, &c->inbox, node) {
+		list_del(&pos->node);
+		free(pos);
+	}
+
+	pthread_mutex_destroy(&c->run_lock);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->idle_cond);
+	free(c);
+}
+
+static int cluster_close(struct gsp_transport *tp)
+{
+	struct gossip_cluster *c = container_of(tp, struct gossip_cluster, tp);
+	struct gossip_engine *eng = c->eng;
+
+	if (eng) {
+		pthread_mutex_lock(&eng->lock);
+		if (!hlist_unhashed(&c->hash_node)) {
+			hlist_del_init(&c->hash_node);
+			list_del_init(&c->node);
+			eng->nr_clusters--;
+		}
+		pthread_mutex_unlock(&eng->lock);
+	}
+
+	// a worker may still have it queued or be running it
+	pthread_mutex_lock(&c->lock);
+	c->closing = 1;
+	while (c->state != CLUSTER_IDLE)
+		pthread_cond_wait(&c->idle_cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+
+	free_cluster(c);
+	return 0;
+}
+
+static const struct gsp_transport_operations cluster_transport_ops = {
+	.write = cluster_write,
+	.write_segments = cluster_write_segments,
+	.loop = cluster_loop,
+	.close = cluster_close,
+};
+
+/*
+ * gossip_engine
+ */
+
+static void stop_workers(struct gossip_engine *eng, int nr_started)
+{
+	pthread_mutex_lock(&eng->ready_lock);
+	__atomic_store_n(&eng->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&eng->ready_cond);
+	pthread_mutex_unlock(&eng->ready_lock);
+
+	for (int i = 0; i < nr_started; i++)
+		pthread_join(eng->workers[i].thread, NULL);
+}
+
+static void free_engine(struct gossip_engine *eng)
+{
+	for (int i = 0; i < eng->nr_workers; i++)
+		pthread_mutex_destroy(&eng->workers[i].lock);
+	free(eng->workers);
+	eng->workers = NULL;
+
+	pthread_mutex_destroy(&eng->tx_lock);
+	pthread_mutex_destroy(&eng->lock);
+	pthread_mutex_destroy(&eng->ready_lock);
+	pthread_cond_destroy(&eng->ready_cond);
+	gsp_udp_close(&eng->udp);
+}
+
+int gossip_engine_init(struct gossip_engine *eng, int port, int nr_threads)
+{
+	memset(eng, 0, sizeof(*eng));
+
+	// udp, dual-stack unless the host has no IPv6, room for the header
+	struct gsp_udp_info info = {
+		.ipaddr = "::",
+		.port = port ? port : GOSSIP_DEFAULT_PORT,
+		.recv_buf_len = GSP_UDP_RECV_BUF_LEN_MAX + GOSSIP_ENGINE_HDR_LEN,
+	};
+	if (gsp_udp_init(&eng->udp, &info)) {
+		info.ipaddr = "0.0.0.0";
+		if (gsp_udp_init(&eng->udp, &info))
+			return -1;
+	}
+	gsp_transport_read_start(&eng->udp.tp, engine_read_cb);
+
+	pthread_mutex_init(&eng->tx_lock, NULL);
+	pthread_mutex_init(&eng->lock, NULL);
+	pthread_mutex_init(&eng->ready_lock, NULL);
+	pthread_cond_init(&eng->ready_cond, NULL);
+	for (int i = 0; i < GOSSIP_ENGINE_NR_HASH; i++)
+		INIT_HLIST_HEAD(&eng->heads[i]);
+	INIT_LIST_HEAD(&eng->clusters);
+
+	if (nr_threads <= 0)
+		nr_threads = GOSSIP_ENGINE_THREADS;
+	eng->workers = calloc(nr_threads, sizeof(*eng->workers));
+	if (!eng->workers) {
+		free_engine(eng);
+		return -1;
+	}
+
+	eng->nr_workers = nr_threads;
+	for (int i = 0; i < nr_threads; i++) {
+		eng->workers[i].eng = eng;
+		pthread_mutex_init(&eng->workers[i].lock, NULL);
+		INIT_LIST_HEAD(&eng->workers[i].queue);
+	}
+
+	for (int i = 0; i < nr_threads; i++) {
+		if (pthread_create(&eng->workers[i].thread, NULL,
+		                   worker_thread, &eng->workers[i])) {
+			stop_workers(eng, i);
+			free_engine(eng);
+			return -1;
+		}
+	}
+
+	eng->tick_time = monotonic_msec();
+	if (pthread_create(&eng->rx_thread, NULL, rx_thread, eng)) {
+		stop_workers(eng, nr_threads);
+		free_engine(eng);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The clusters left keep their gossip, with a transport that fails every
+ * write, until gossip_close().
+ */
+int gossip_engine_close(struct gossip_engine *eng)
+{
+	__atomic_store_n(&eng->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(eng->rx_thread, NULL);
+	stop_workers(eng, eng->nr_workers);
+
+	struct gossip_cluster *pos, *n;
+	list_for_each_entry_safe(pos, n, &eng->clusters, node) {
+		hlist_del_init(&pos->hash_node);
+		list_del_init(&pos->node);
+
+		pthread_mutex_lock(&pos->lock);
+		pos->eng = NULL;
+		pos->state = CLUSTER_IDLE;
+		list_del_init(&pos->run_node);
+		pthread_mutex_unlock(&pos->lock);
+	}
+	eng->nr_clusters = 0;
+
+	free_engine(eng);
+	return 0;
+}
+
+int gossip_engine_add(struct gossip_engine *eng, struct gossip *gsp,
+                      struct gossip_node *gnode, uint32_t cluster_id)
+{
+	struct gossip_cluster *c = calloc(1, sizeof(*c));
+	if (!c) return -1;
+
+	c->tp.ops = &cluster_transport_ops;
+	c->eng = eng;
+	c->id = cluster_id;
+	c->gsp = gsp;
+	pthread_mutex_init(&c->run_lock, NULL);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->idle_cond, NULL);
+	INIT_LIST_HEAD(&c->inbox);
+	INIT_HLIST_NODE(&c->hash_node);
+	INIT_LIST_HEAD(&c->node);
+	INIT_LIST_HEAD(&c->run_node);
+
+	/*
+	 * The id is taken at once, the cluster counting as running until the
+	 * gossip is set up: the datagrams that come meanwhile wait for it.
+	 */
+	c->state = CLUSTER_RUNNING;
+	pthread_mutex_lock(&eng->lock);
+	if (find_cluster(eng, cluster_id)) {
+		pthread_mutex_unlock(&eng->lock);
+		free_cluster(c);
+		errno = EEXIST;
+		return -1;
+	}
+	hlist_add_head(&c->hash_node,
+	               &eng->heads[cluster_id % GOSSIP_ENGINE_NR_HASH]);
+	list_add_tail(&c->node, &eng->clusters);
+	eng->nr_clusters++;
+	pthread_mutex_unlock(&eng->lock);
+
+	if (gossip_init_transport(gsp, gnode, &c->tp)) {
+		pthread_mutex_lock(&eng->lock);
+		hlist_del_init(&c->hash_node);
+		list_del_init(&c->node);
+		eng->nr_clusters--;
+		pthread_mutex_unlock(&eng->lock);
+		free_cluster(c);
+		return -1;
+	}
+
+	cluster_ran(c, home_worker(eng, c));
+	return 0;
+}
+
+void gossip_engine_lock(struct gossip *gsp)
+{
+	struct gossip_cluster *c =
+		container_of(gsp->tp, struct gossip_cluster, tp);
+	pthread_mutex_lock(&c->run_lock);
+}
+
+void gossip_engine_unlock(struct gossip *gsp)
+{
+	struct gossip_cluster *c =
+		container_of(gsp->tp, struct gossip_cluster, tp);
+	pthread_mutex_unlock(&c->run_lock);
+}
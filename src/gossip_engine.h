@@ -0,0 +1,88 @@
+#ifndef __GOSSIP_ENGINE_H
+#define __GOSSIP_ENGINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "list.h"
+#include "gsp_udp.h"
+#include "gossip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An engine hosts many gossip clusters on one UDP socket and a few threads.
+ * Each datagram of a cluster starts with GOSSIP_ENGINE_MAGIC and the 32-bit
+ * little endian id of the cluster, then the packet as gossip has it. A
+ * thread of the engine receives from the socket and queues each datagram to
+ * the cluster of its id, and the workers run gossip_loop_once() of the
+ * clusters that have datagrams queued, and of all of them every
+ * GOSSIP_ENGINE_TICK ms. Each worker takes the clusters to run from its own
+ * queue first, and steals from the others when it has none.
+ *
+ * A cluster is a struct gossip set up by gossip_engine_add() instead of
+ * gossip_init(), its nodes all having the address of the engine socket.
+ * gossip_loop_once() is the engine's to call: any other use of the gossip,
+ * from gossip_broadcast() to reading its nodes, goes between
+ * gossip_engine_lock() and gossip_engine_unlock(), which the callbacks of the
+ * gossip run under. gossip_close() takes it off the engine, waiting for a
+ * worker that runs it, so it must not be called with the lock held.
+ */
+
+#define GOSSIP_ENGINE_MAGIC 0x02
+#define GOSSIP_ENGINE_HDR_LEN 5
+#define GOSSIP_ENGINE_THREADS 4
+#define GOSSIP_ENGINE_TICK 100      // ms
+#define GOSSIP_ENGINE_INBOX_MAX 1024 // datagrams queued to a cluster
+#define GOSSIP_ENGINE_NR_HASH 64
+
+struct gossip_engine;
+
+struct gossip_worker {
+	struct gossip_engine *eng;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	struct list_head queue; // clusters to run
+
+	int64_t nr_runs;
+	int64_t nr_steals;
+};
+
+struct gossip_engine {
+	struct gsp_udp udp;
+	pthread_mutex_t tx_lock;
+
+	pthread_mutex_t lock; // of the clusters
+	struct hlist_head heads[GOSSIP_ENGINE_NR_HASH];
+	struct list_head clusters;
+	int nr_clusters;
+
+	struct gossip_worker *workers;
+	int nr_workers;
+	pthread_mutex_t ready_lock;
+	pthread_cond_t ready_cond;
+	int nr_ready; // clusters queued to any worker
+
+	pthread_t rx_thread;
+	int stop;
+	int64_t tick_time;
+
+	int64_t rx_packets;
+	int64_t rx_dropped; // not framed, of no cluster or over its inbox
+};
+
+// nr_threads workers, GOSSIP_ENGINE_THREADS when 0
+int gossip_engine_init(struct gossip_engine *eng, int port, int nr_threads);
+int gossip_engine_close(struct gossip_engine *eng);
+
+int gossip_engine_add(struct gossip_engine *eng, struct gossip *gsp,
+                      struct gossip_node *gnode, uint32_t cluster_id);
+void gossip_engine_lock(struct gossip *gsp);
+void gossip_engine_unlock(struct gossip *gsp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
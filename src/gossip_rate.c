@@ -0,0 +1,80 @@
+#include "gossip_rate.h"
+#include <string.h>
+#include "gsp_addr.h"
+
+void gossip_rate_init(struct gossip_rate *rate, int64_t bytes_per_sec,
+                      int64_t peer_bytes_per_sec)
+{
+	memset(rate, 0, sizeof(*rate));
+	rate->rate = bytes_per_sec > 0 ? bytes_per_sec : 0;
+	rate->peer_rate = peer_bytes_per_sec > 0 ? peer_bytes_per_sec : 0;
+}
+
+static double bucket_burst(int64_t rate)
+{
+	return rate > GOSSIP_RATE_BURST_MIN ? rate : GOSSIP_RATE_BURST_MIN;
+}
+
+static void bucket_refill(struct gossip_bucket *b, int64_t rate,
+                          int64_t now_usec)
+{
+	double burst = bucket_burst(rate);
+
+	if (!b->last_usec) {
+		b->tokens = burst;
+	} else if (now_usec > b->last_usec) {
+		b->tokens += (double)(now_usec - b->last_usec) * rate / 1e6;
+		if (b->tokens > burst)
+			b->tokens = burst;
+	}
+
+	b->last_usec = now_usec;
+}
+
+static struct gossip_bucket *peer_bucket(struct gossip_rate *rate,
+                                         const struct sockaddr *addr)
+{
+	unsigned int key = gsp_addr_hash(addr);
+	struct gossip_bucket *b = &rate->peers[key % GOSSIP_RATE_NR_PEERS];
+
+	if (b->key != key) {
+		b->key = key;
+		b->last_usec = 0;
+	}
+
+	return b;
+}
+
+int64_t gossip_rate_budget(struct gossip_rate *rate,
+                           const struct sockaddr *addr, int64_t now_usec)
+{
+	double budget = INT64_MAX;
+
+	if (rate->rate) {
+		bucket_refill(&rate->global, rate->rate, now_usec);
+		budget = rate->global.tokens;
+	}
+
+	if (rate->peer_rate && addr) {
+		struct gossip_bucket *b = peer_bucket(rate, addr);
+		bucket_refill(b, rate->peer_rate, now_usec);
+		if (b->tokens < budget)
+			budget = b->tokens;
+	}
+
+	if (budget <= 0)
+		return 0;
+	return budget >= INT64_MAX ? INT64_MAX : (int64_t)budget;
+}
+
+void gossip_rate_charge(struct gossip_rate *rate,
+                        const struct sockaddr *addr, int64_t bytes)
+{
+	if (rate->rate)
+		rate->global.tokens -= bytes;
+
+	if (rate->peer_rate && addr) {
+		struct gossip_bucket *b = peer_bucket(rate, addr);
+		b->tokens -= bytes;
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef __GOSSIP_RATE_H
+#define __GOSSIP_RATE_H
+
+#include <stdint.h>
+#include "gsp_transport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Token buckets bounding what gossip sends, in bytes per second, overall and
+ * to each peer; a rate of 0 is unlimited. A bucket holds a second of its
+ * rate, never less than GOSSIP_RATE_BURST_MIN so that a few segments may go.
+ * Peers are hashed by address into a fixed table: two of them sharing a slot
+ * share a budget, and a new one taking a slot over starts with a full one.
+ */
+
+#define GOSSIP_RATE_NR_PEERS 256
+#define GOSSIP_RATE_BURST_MIN 8192
+
+struct gossip_bucket {
+	double tokens; // bytes, below 0 after an overdraft
+	int64_t last_usec; // of the last refill, 0 while unused
+	unsigned int key;
+};
+
+struct gossip_rate {
+	int64_t rate;
+	int64_t peer_rate;
+	struct gossip_bucket global;
+	struct gossip_bucket peers[GOSSIP_RATE_NR_PEERS];
+};
+
+void gossip_rate_init(struct gossip_rate *rate, int64_t bytes_per_sec,
+                      int64_t peer_bytes_per_sec);
+// bytes that may be sent now, to addr or anywhere when it is NULL
+int64_t gossip_rate_budget(struct gossip_rate *rate,
+                           const struct sockaddr *addr, int64_t now_usec);
+void gossip_rate_charge(struct gossip_rate *rate,
+                        const struct sockaddr *addr, int64_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,154 @@
+#include "gossip_seen.h"
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int seen_hash(const struct gossip_seen *seen, uint64_t id)
+{
+	return (unsigned int)(id ^ id >> 32) & seen->hash_mask;
+}
+
+int gossip_seen_init(struct gossip_seen *seen, int nr_msgs)
+{
+	memset(seen, 0, sizeof(*seen));
+	if (nr_msgs <= 0)
+		return -1;
+
+	// a power of two of heads, at least one per slot
+	unsigned int nr_heads = 1;
+	while (nr_heads < (unsigned int)nr_msgs)
+		nr_heads <<= 1;
+
+	seen->msgs = calloc(nr_msgs, sizeof(*seen->msgs));
+	seen->heads = malloc(nr_heads * sizeof(*seen->heads));
+	if (!seen->msgs || !seen->heads) {
+		gossip_seen_close(seen);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < nr_heads; i++)
+		INIT_HLIST_HEAD(&seen->heads[i]);
+	for (int i = 0; i < nr_msgs; i++)
+		INIT_HLIST_NODE(&seen->msgs[i].hash_node);
+
+	seen->nr_msgs = nr_msgs;
+	seen->hash_mask = nr_heads - 1;
+	return 0;
+}
+
+static void clear_msg(struct gossip_seen *seen, struct gossip_seen_msg *msg)
+{
+	if (msg->id) {
+		hlist_del_init(&msg->hash_node);
+		if (!msg->text)
+			seen->nr_missing--;
+	}
+
+	free(msg->origin);
+	free(msg->text);
+	free(msg->ihave_addrs);
+	msg->id = 0;
+	msg->origin = NULL;
+	msg->text = NULL;
+	msg->ihave_addrs = NULL;
+	msg->nr_ihave_addrs = 0;
+	msg->next_graft = 0;
+	msg->nr_grafts = 0;
+	msg->graft_time = 0;
+	msg->text_time = 0;
+}
+
+void gossip_seen_close(struct gossip_seen *seen)
+{
+	for (int i = 0; i < seen->nr_msgs; i++)
+		clear_msg(seen, &seen->msgs[i]);
+	free(seen->msgs);
+	free(seen->heads);
+	memset(seen, 0, sizeof(*seen));
+}
+
+struct gossip_seen_msg *gossip_seen_find(struct gossip_seen *seen,
+                                         uint64_t id)
+{
+	if (!id || !seen->nr_msgs)
+		return NULL;
+
+	struct gossip_seen_msg *pos;
+	hlist_for_each_entry(pos, &seen->heads[seen_hash(seen, id)],
+	                     hash_node) {
+		if (pos->id == id)
+			return pos;
+	}
+
+	return NULL;
+}
+
+struct gossip_seen_msg *gossip_seen_add(struct gossip_seen *seen, uint64_t id)
+{
+	struct gossip_seen_msg *msg = gossip_seen_find(seen, id);
+	if (msg || !id || !seen->nr_msgs)
+		return msg;
+
+	msg = &seen->msgs[seen->next];
+	seen->next = (seen->next + 1) % seen->nr_msgs;
+
+	clear_msg(seen, msg);
+	msg->id = id;
+	hlist_add_head(&msg->hash_node, &seen->heads[seen_hash(seen, id)]);
+	seen->nr_missing++;
+	return msg;
+}
+
+int gossip_seen_add_ihave(struct gossip_seen_msg *msg,
+                          const struct sockaddr *addr, socklen_t len)
+{
+	if (!len || len > sizeof(struct sockaddr_storage))
+		return -1;
+
+	for (int i = 0; i < msg->nr_ihave_addrs; i++) {
+		if (gsp_addr_equal(gsp_addr_sa(&msg->ihave_addrs[i]), addr))
+			return 0;
+	}
+
+	struct gsp_addr *addrs = realloc(msg->ihave_addrs,
+		(msg->nr_ihave_addrs + 1) * sizeof(*addrs));
+	if (!addrs)
+		return -1;
+	msg->ihave_addrs = addrs;
+
+	struct gsp_addr *pos = &addrs[msg->nr_ihave_addrs++];
+	memcpy(&pos->ss, addr, len);
+	pos->len = len;
+	return 0;
+}
+
+const struct gsp_addr *gossip_seen_next_graft(struct gossip_seen_msg *msg)
+{
+	if (!msg->nr_ihave_addrs)
+		return NULL;
+
+	int i = msg->next_graft++ % msg->nr_ihave_addrs;
+	return &msg->ihave_addrs[i];
+}
+
+void gossip_seen_drop(struct gossip_seen *seen, struct gossip_seen_msg *msg)
+{
+	clear_msg(seen, msg);
+}
+
+int gossip_seen_set_text(struct gossip_seen *seen,
+                         struct gossip_seen_msg *msg, char *text)
+{
+	if (msg->text) {
+		free(text);
+		return -1;
+	}
+
+	msg->text = text;
+	seen->nr_missing--;
+
+	// no more asks to go round
+	free(msg->ihave_addrs);
+	msg->ihave_addrs = NULL;
+	msg->nr_ihave_addrs = 0;
+	return 0;
+}
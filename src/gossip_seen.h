@@ -0,0 +1,63 @@
+#ifndef __GOSSIP_SEEN_H
+#define __GOSSIP_SEEN_H
+
+#include <stdint.h>
+#include "list.h"
+#include "gsp_addr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The broadcast messages seen lately, by id: a ring of a fixed number of
+ * slots, the oldest taken over by the next message, and a hash of the ids
+ * into it. A message only announced so far has no text yet, but the addresses
+ * it was announced from, which the asks for it go round, and when to ask.
+ */
+
+struct gossip_seen_msg {
+	uint64_t id; // 0 while the slot is free
+	char *origin; // pubid
+	char *text;   // NULL until it comes
+	struct gsp_addr *ihave_addrs; // of the announces of a missing one
+	int nr_ihave_addrs;
+	int next_graft; // of ihave_addrs, to ask next
+	int nr_grafts;  // asks so far
+	int64_t graft_time;
+	int64_t text_time; // when the text came
+
+	struct hlist_node hash_node;
+};
+
+struct gossip_seen {
+	struct gossip_seen_msg *msgs;
+	int nr_msgs;
+	int next; // the oldest slot
+	int nr_missing;
+
+	struct hlist_head *heads;
+	unsigned int hash_mask;
+};
+
+int gossip_seen_init(struct gossip_seen *seen, int nr_msgs);
+void gossip_seen_close(struct gossip_seen *seen);
+struct gossip_seen_msg *gossip_seen_find(struct gossip_seen *seen,
+                                         uint64_t id);
+// a slot for id, found or taken over from the oldest message
+struct gossip_seen_msg *gossip_seen_add(struct gossip_seen *seen, uint64_t id);
+// note an announce of msg from addr, once per address
+int gossip_seen_add_ihave(struct gossip_seen_msg *msg,
+                          const struct sockaddr *addr, socklen_t len);
+// the announcer to ask for msg next, round them all; NULL if none
+const struct gsp_addr *gossip_seen_next_graft(struct gossip_seen_msg *msg);
+// forget msg, as if never seen, so it is not missing any more
+void gossip_seen_drop(struct gossip_seen *seen, struct gossip_seen_msg *msg);
+// give msg its text, taking ownership of it; 0 if it had none yet
+int gossip_seen_set_text(struct gossip_seen *seen,
+                         struct gossip_seen_msg *msg, char *text);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
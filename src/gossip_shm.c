@@ -0,0 +1,452 @@
+#include "gossip_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the fields of a record that tell whether it changed, all but the data
+#define RECORD_HEAD_LEN offsetof(struct gossip_shm_record, data)
+
+static uint64_t pubid_hash(const char *pubid)
+{
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+
+	for (int i = 0; i < GOSSIP_SHM_ID_LEN && pubid[i]; i++) {
+		hash ^= (unsigned char)pubid[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static size_t segment_size(uint32_t nr_slots)
+{
+	return GOSSIP_SHM_HDR_SIZE +
+		(size_t)nr_slots * sizeof(struct gossip_shm_record);
+}
+
+static int map_segment(struct gossip_shm *shm, int fd, int prot)
+{
+	void *addr = mmap(NULL, shm->size, prot, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	shm->hdr = addr;
+	shm->records = (struct gossip_shm_record *)
+		((char *)addr + GOSSIP_SHM_HDR_SIZE);
+	return 0;
+}
+
+static bool same_layout(const struct gossip_shm_hdr *hdr, uint32_t nr_slots)
+{
+	return hdr->magic == GOSSIP_SHM_MAGIC &&
+		hdr->layout == GOSSIP_SHM_LAYOUT &&
+		hdr->nr_slots == nr_slots &&
+		hdr->record_size == sizeof(struct gossip_shm_record);
+}
+
+// whether the segment at fd has a writer other than us that still runs
+static bool writer_running(int fd)
+{
+	const struct gossip_shm_hdr *hdr = mmap(NULL, GOSSIP_SHM_HDR_SIZE,
+		PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return false;
+
+	int64_t pid = __atomic_load_n(&hdr->pid, __ATOMIC_ACQUIRE);
+	bool running = hdr->magic == GOSSIP_SHM_MAGIC && pid > 0 &&
+		pid != getpid() && (kill((pid_t)pid, 0) == 0 || errno == EPERM);
+
+	munmap((void *)hdr, GOSSIP_SHM_HDR_SIZE);
+	return running;
+}
+
+/*
+ * seqlock
+ */
+
+static void write_begin(struct gossip_shm *shm)
+{
+	if (shm->writing)
+		return;
+
+	uint64_t seq = shm->hdr->seq;
+	__atomic_store_n(&shm->hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shm->writing = 1;
+}
+
+static void write_end(struct gossip_shm *shm)
+{
+	if (!shm->writing)
+		return;
+
+	shm->hdr->nr_records = shm->nr_used;
+	shm->hdr->nr_dropped = shm->nr_dropped;
+	shm->hdr->generation++;
+	__atomic_store_n(&shm->hdr->seq, shm->hdr->seq + 1, __ATOMIC_RELEASE);
+	shm->writing = 0;
+}
+
+// the sequence to read under, waiting out a writer, odd when it took too long
+static uint64_t read_begin(const struct gossip_shm *shm, int *tries)
+{
+	uint64_t seq;
+
+	while ((seq = __atomic_load_n(&shm->hdr->seq, __ATOMIC_ACQUIRE)) & 1) {
+		if (++*tries >= GOSSIP_SHM_RETRIES)
+			break;
+		sched_yield();
+	}
+
+	return seq;
+}
+
+static bool read_retry(const struct gossip_shm *shm, uint64_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&shm->hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * gossip_shm
+ */
+
+int gossip_shm_create(struct gossip_shm *shm, const char *name,
+                      int nr_records)
+{
+	int saved_errno;
+
+	memset(shm, 0, sizeof(*shm));
+	if (nr_records <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// at most half full, deleted slots aside
+	uint32_t nr_slots = 2;
+	while (nr_slots < 2 * (uint32_t)nr_records)
+		nr_slots <<= 1;
+
+	shm->writer = 1;
+	shm->nr_slots = nr_slots;
+	shm->nr_records = nr_records;
+	shm->size = segment_size(nr_slots);
+	shm->name = strdup(name);
+	shm->marks = calloc(nr_slots, sizeof(*shm->marks));
+	if (!shm->name || !shm->marks)
+		goto err;
+
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		goto err;
+
+	// only the segment of a writer gone is ours to take over
+	struct stat st;
+	if (fstat(fd, &st) == 0 &&
+	    (size_t)st.st_size >= GOSSIP_SHM_HDR_SIZE && writer_running(fd)) {
+		close(fd);
+		errno = EBUSY;
+		goto err;
+	}
+
+	// a segment of another size may be mapped still, make a new one
+	if (fstat(fd, &st) == 0 && st.st_size && (size_t)st.st_size != shm->size) {
+		close(fd);
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			goto err;
+	}
+
+	if (ftruncate(fd, shm->size) || map_segment(shm, fd,
+	                                            PROT_READ | PROT_WRITE)) {
+		close(fd);
+		goto err;
+	}
+	close(fd);
+
+	struct gossip_shm_hdr *hdr = shm->hdr;
+	if (same_layout(hdr, nr_slots)) {
+		// taken over, its readers seeing it emptied
+		shm->writing = hdr->seq & 1; // the last writer died writing
+		write_begin(shm);
+		memset(shm->records, 0, shm->size - GOSSIP_SHM_HDR_SIZE);
+		hdr->pid = getpid();
+		write_end(shm);
+		return 0;
+	}
+
+	memset(hdr, 0, GOSSIP_SHM_HDR_SIZE);
+	hdr->layout = GOSSIP_SHM_LAYOUT;
+	hdr->nr_slots = nr_slots;
+	hdr->record_size = sizeof(struct gossip_shm_record);
+	hdr->pid = getpid();
+	__atomic_store_n(&hdr->magic, GOSSIP_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+
+err:
+	saved_errno = errno;
+	gossip_shm_close(shm);
+	errno = saved_errno;
+	return -1;
+}
+
+int gossip_shm_attach(struct gossip_shm *shm, const char *name)
+{
+	memset(shm, 0, sizeof(*shm));
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < GOSSIP_SHM_HDR_SIZE) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	shm->size = st.st_size;
+	if (map_segment(shm, fd, PROT_READ)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	// the size of the table is never trusted past this check
+	uint32_t nr_slots = shm->hdr->nr_slots;
+	if (!same_layout(shm->hdr, nr_slots) || !nr_slots ||
+	    (nr_slots & (nr_slots - 1)) || segment_size(nr_slots) > shm->size) {
+		gossip_shm_close(shm);
+		errno = EINVAL;
+		return -1;
+	}
+
+	shm->nr_slots = nr_slots;
+	shm->name = strdup(name);
+	return 0;
+}
+
+void gossip_shm_close(struct gossip_shm *shm)
+{
+	if (shm->hdr) {
+		if (shm->writer) {
+			__atomic_store_n(&shm->hdr->pid, 0, __ATOMIC_RELEASE);
+			shm_unlink(shm->name);
+		}
+		munmap(shm->hdr, shm->size);
+	}
+
+	free(shm->name);
+	free(shm->marks);
+	memset(shm, 0, sizeof(*shm));
+}
+
+/*
+ * writer
+ */
+
+// the slot of pubid, or else the first one it may take, -1 when full
+static int find_slot(struct gossip_shm *shm, const char *pubid, bool *found)
+{
+	uint32_t mask = shm->nr_slots - 1;
+	uint32_t i = pubid_hash(pubid) & mask;
+	int room = -1;
+
+	*found = false;
+	for (uint32_t n = 0; n < shm->nr_slots; n++, i = (i + 1) & mask) {
+		struct gossip_shm_record *slot = &shm->records[i];
+
+		if (slot->state == GOSSIP_SHM_FREE)
+			return room >= 0 ? room : (int)i;
+		if (slot->state == GOSSIP_SHM_DEAD) {
+			if (room < 0)
+				room = i;
+		} else if (!strncmp(slot->pubid, pubid, GOSSIP_SHM_ID_LEN)) {
+			*found = true;
+			return i;
+		}
+	}
+
+	return room;
+}
+
+// the table again without its deleted slots
+static void rehash(struct gossip_shm *shm)
+{
+	struct gossip_shm_record *used = malloc(
+		(size_t)shm->nr_used * sizeof(*used));
+	uint32_t *marks = malloc((size_t)shm->nr_used * sizeof(*marks));
+	if (shm->nr_used && (!used || !marks)) {
+		free(used);
+		free(marks);
+		return;
+	}
+
+	int nr = 0;
+	for (uint32_t i = 0; i < shm->nr_slots; i++) {
+		if (shm->records[i].state == GOSSIP_SHM_USED) {
+			used[nr] = shm->records[i];
+			marks[nr++] = shm->marks[i];
+		}
+	}
+
+	write_begin(shm);
+	memset(shm->records, 0, shm->size - GOSSIP_SHM_HDR_SIZE);
+	for (int j = 0; j < nr; j++) {
+		bool found;
+		int i = find_slot(shm, used[j].pubid, &found);
+		shm->records[i] = used[j];
+		shm->marks[i] = marks[j];
+	}
+	shm->nr_dead = 0;
+
+	free(used);
+	free(marks);
+}
+
+void gossip_shm_begin(struct gossip_shm *shm)
+{
+	shm->pass++;
+	shm->nr_put = 0;
+	shm->nr_dropped = 0;
+}
+
+int gossip_shm_put(struct gossip_shm *shm,
+                   const struct gossip_shm_record *rec, const char *data)
+{
+	bool found;
+	int i = find_slot(shm, rec->pubid, &found);
+	if (i < 0 || shm->nr_put >= shm->nr_records) {
+		shm->nr_dropped++;
+		return -1;
+	}
+
+	struct gossip_shm_record *slot = &shm->records[i];
+	struct gossip_shm_record head;
+	memcpy(&head, rec, RECORD_HEAD_LEN);
+	head.state = GOSSIP_SHM_USED;
+	shm->marks[i] = shm->pass;
+	shm->nr_put++;
+
+	if (found && !memcmp(slot, &head, RECORD_HEAD_LEN))
+		return 0;
+
+	write_begin(shm);
+	if (!found) {
+		if (slot->state == GOSSIP_SHM_DEAD)
+			shm->nr_dead--;
+		shm->nr_used++;
+	}
+
+	// the data goes with the version
+	bool new_version = !found || slot->version != head.version;
+	memcpy(slot, &head, RECORD_HEAD_LEN);
+	if (new_version && head.data_len <= GOSSIP_SHM_DATA_LEN)
+		memcpy(slot->data, data, head.data_len);
+	return 0;
+}
+
+void gossip_shm_end(struct gossip_shm *shm)
+{
+	for (uint32_t i = 0; i < shm->nr_slots; i++) {
+		struct gossip_shm_record *slot = &shm->records[i];
+
+		if (slot->state == GOSSIP_SHM_USED &&
+		    shm->marks[i] != shm->pass) {
+			write_begin(shm);
+			slot->state = GOSSIP_SHM_DEAD;
+			shm->nr_used--;
+			shm->nr_dead++;
+		}
+	}
+
+	if (shm->nr_dead > (int)shm->nr_slots / 4)
+		rehash(shm);
+	if (shm->hdr->nr_dropped != (uint32_t)shm->nr_dropped)
+		write_begin(shm);
+
+	write_end(shm);
+}
+
+/*
+ * readers
+ */
+
+int gossip_shm_lookup(const struct gossip_shm *shm, const char *pubid,
+                      struct gossip_shm_record *rec)
+{
+	uint32_t mask = shm->nr_slots - 1;
+	uint64_t hash = pubid_hash(pubid);
+	int tries = 0;
+
+	while (tries < GOSSIP_SHM_RETRIES) {
+		uint64_t seq = read_begin(shm, &tries);
+		if (seq & 1)
+			break;
+
+		int ret = -1;
+		uint32_t i = hash & mask;
+		for (uint32_t n = 0; n < shm->nr_slots; n++, i = (i + 1) & mask) {
+			const struct gossip_shm_record *slot = &shm->records[i];
+			uint32_t state = slot->state;
+
+			if (state == GOSSIP_SHM_FREE)
+				break;
+			if (state == GOSSIP_SHM_USED &&
+			    !strncmp(slot->pubid, pubid, GOSSIP_SHM_ID_LEN)) {
+				memcpy(rec, slot, sizeof(*rec));
+				ret = 0;
+				break;
+			}
+		}
+
+		if (!read_retry(shm, seq)) {
+			if (ret)
+				errno = ENOENT;
+			return ret;
+		}
+		tries++;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+int gossip_shm_list(const struct gossip_shm *shm,
+                    struct gossip_shm_record *recs, int max)
+{
+	int tries = 0;
+
+	while (tries < GOSSIP_SHM_RETRIES) {
+		uint64_t seq = read_begin(shm, &tries);
+		if (seq & 1)
+			break;
+
+		int nr = 0;
+		for (uint32_t i = 0; i < shm->nr_slots && nr < max; i++) {
+			if (shm->records[i].state == GOSSIP_SHM_USED)
+				memcpy(&recs[nr++], &shm->records[i],
+				       sizeof(*recs));
+		}
+
+		if (!read_retry(shm, seq))
+			return nr;
+		tries++;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+uint64_t gossip_shm_generation(const struct gossip_shm *shm)
+{
+	return __atomic_load_n(&shm->hdr->generation, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,119 @@
+#ifndef __GOSSIP_SHM_H
+#define __GOSSIP_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The membership of a gossip node in a POSIX shared memory segment, for the
+ * other processes of the host: a header, then a hash table of fixed size
+ * records keyed by pubid, open addressed with linear probing. The node is the
+ * only writer and does all its writing between two increments of the
+ * sequence number of the header, so that readers take no lock: they copy what
+ * they look for and start over when the sequence was odd, or moved, meanwhile.
+ *
+ * A writer that starts again on a segment of the same layout takes it over,
+ * and the readers attached to it go on, unless the pid of the header is of
+ * another process still running: that fails with EBUSY. One that closes sets
+ * the pid to 0 and unlinks the segment, which its readers should then attach
+ * to again.
+ */
+
+#define GOSSIP_SHM_MAGIC 0x47535348 // "GSSH"
+#define GOSSIP_SHM_LAYOUT 1         // of the structs below
+#define GOSSIP_SHM_HDR_SIZE 64
+#define GOSSIP_SHM_ID_LEN 48
+#define GOSSIP_SHM_ADDR_LEN 48
+#define GOSSIP_SHM_DATA_LEN 880
+#define GOSSIP_SHM_RETRIES 10000 // reads over a writer in the middle
+
+// slot states
+enum {
+	GOSSIP_SHM_FREE,
+	GOSSIP_SHM_USED,
+	GOSSIP_SHM_DEAD, // deleted, the probes going on past it
+};
+
+// record flags
+#define GOSSIP_SHM_F_SELF 1
+#define GOSSIP_SHM_F_FULL 2      // has an address to sync with
+#define GOSSIP_SHM_F_ACTIVE 4    // on the active list of the writer
+#define GOSSIP_SHM_F_ALIVE 8     // heartbeat seen within the alive timeout
+#define GOSSIP_SHM_F_DATA_LONG 16 // data over GOSSIP_SHM_DATA_LEN, left out
+
+struct gossip_shm_hdr {
+	uint32_t magic;
+	uint32_t layout;
+	uint32_t nr_slots; // a power of two
+	uint32_t record_size;
+	uint64_t seq;        // odd while the writer is at the table
+	uint64_t generation; // of the last change
+	int64_t pid;         // of the writer, 0 once it closed
+	uint32_t nr_records;
+	uint32_t nr_dropped; // nodes left out for the table being full
+};
+
+struct gossip_shm_record {
+	int64_t version;
+	int64_t alive_time;  // heartbeat, on the clock of the node
+	int64_t alive_seen;  // when it last went up, on the writer's clock
+	int64_t update_time;
+	uint32_t state;
+	uint32_t flags;
+	int32_t port;
+	uint32_t data_len;
+	char pubid[GOSSIP_SHM_ID_LEN];
+	char ipaddr[GOSSIP_SHM_ADDR_LEN];
+	char data[GOSSIP_SHM_DATA_LEN]; // JSON, not NUL-terminated
+};
+
+struct gossip_shm {
+	char *name;
+	int writer;
+	struct gossip_shm_hdr *hdr;
+	struct gossip_shm_record *records;
+	size_t size;
+	uint32_t nr_slots;
+
+	// of the writer
+	int nr_records; // at most, the table having twice as many slots
+	int nr_used;    // with those the pass is about to delete
+	int nr_put;     // by the pass
+	int nr_dead;
+	int nr_dropped;
+	uint32_t pass;
+	uint32_t *marks; // pass of the last put of each slot
+	int writing;
+};
+
+// a segment for nr_records nodes at most, created or taken over, or EBUSY
+int gossip_shm_create(struct gossip_shm *shm, const char *name,
+                      int nr_records);
+int gossip_shm_attach(struct gossip_shm *shm, const char *name);
+void gossip_shm_close(struct gossip_shm *shm);
+
+/*
+ * A pass of the writer: every node put between begin and end, all others
+ * deleted at the end. The rec->data_len bytes of data are only copied when
+ * the version of the record changed, rec->data is not read.
+ */
+void gossip_shm_begin(struct gossip_shm *shm);
+int gossip_shm_put(struct gossip_shm *shm,
+                   const struct gossip_shm_record *rec, const char *data);
+void gossip_shm_end(struct gossip_shm *shm);
+
+// of the readers, -1 when not found or a writer held the table too long
+int gossip_shm_lookup(const struct gossip_shm *shm, const char *pubid,
+                      struct gossip_shm_record *rec);
+int gossip_shm_list(const struct gossip_shm *shm,
+                    struct gossip_shm_record *recs, int max);
+uint64_t gossip_shm_generation(const struct gossip_shm *shm);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,137 @@
+#include "gossip_stats.h"
+#include "serialize.h"
+#include <stdio.h>
+
+static const char *phase_names[GOSSIP_NR_PHASES] = {
+	"sync", "ack1", "ack2", "push", "bcast", "ihave", "graft", "prune",
+};
+
+void gossip_hist_add(struct gossip_hist *hist, int64_t value)
+{
+	int i = 0;
+
+	if (value > 1)
+		i = 64 - __builtin_clzll(value - 1);
+	if (i >= GOSSIP_HIST_NR_BUCKETS)
+		i = GOSSIP_HIST_NR_BUCKETS - 1;
+
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += value;
+}
+
+static void put_head(struct ser_buf *sb, const char *name,
+                     const char *type, const char *help)
+{
+	ser_buf_puts(sb, "# HELP gossip_");
+	ser_buf_puts(sb, name);
+	ser_buf_putc(sb, ' ');
+	ser_buf_puts(sb, help);
+	ser_buf_puts(sb, "\n# TYPE gossip_");
+	ser_buf_puts(sb, name);
+	ser_buf_putc(sb, ' ');
+	ser_buf_puts(sb, type);
+	ser_buf_putc(sb, '\n');
+}
+
+static void put_value(struct ser_buf *sb, const char *name,
+                      const char *label, int64_t value)
+{
+	ser_buf_puts(sb, "gossip_");
+	ser_buf_puts(sb, name);
+	if (label) {
+		ser_buf_putc(sb, '{');
+		ser_buf_puts(sb, label);
+		ser_buf_putc(sb, '}');
+	}
+	ser_buf_putc(sb, ' ');
+	ser_buf_put_int64(sb, value);
+	ser_buf_putc(sb, '\n');
+}
+
+static void put_scalar(struct ser_buf *sb, const char *name, const char *type,
+                       const char *help, int64_t value)
+{
+	put_head(sb, name, type, help);
+	put_value(sb, name, NULL, value);
+}
+
+static void put_phases(struct ser_buf *sb, const char *name,
+                       const char *help, const int64_t *values)
+{
+	char label[32];
+
+	put_head(sb, name, "counter", help);
+	for (int i = 0; i < GOSSIP_NR_PHASES; i++) {
+		snprintf(label, sizeof(label), "phase=\"%s\"", phase_names[i]);
+		put_value(sb, name, label, values[i]);
+	}
+}
+
+static void put_hist(struct ser_buf *sb, const char *name, const char *help,
+                     const struct gossip_hist *hist)
+{
+	char metric[64], label[32];
+	int64_t count = 0;
+
+	put_head(sb, name, "histogram", help);
+
+	snprintf(metric, sizeof(metric), "%s_bucket", name);
+	for (int i = 0; i < GOSSIP_HIST_NR_BUCKETS - 1; i++) {
+		count += hist->buckets[i];
+		snprintf(label, sizeof(label), "le=\"%lld\"", 1LL << i);
+		put_value(sb, metric, label, count);
+	}
+	put_value(sb, metric, "le=\"+Inf\"", hist->count);
+
+	snprintf(metric, sizeof(metric), "%s_sum", name);
+	put_value(sb, metric, NULL, hist->sum);
+	snprintf(metric, sizeof(metric), "%s_count", name);
+	put_value(sb, metric, NULL, hist->count);
+}
+
+size_t gossip_stats_dump(const struct gossip_stats *stats,
+                         char *buf, size_t size)
+{
+	struct ser_buf sb;
+	ser_buf_init(&sb, buf, size);
+
+	put_phases(&sb, "tx_packets_total", "Packets sent.",
+	           stats->tx_packets);
+	put_phases(&sb, "tx_bytes_total", "Bytes sent.", stats->tx_bytes);
+	put_phases(&sb, "rx_packets_total", "Packets received.",
+	           stats->rx_packets);
+	put_phases(&sb, "rx_bytes_total", "Bytes received.", stats->rx_bytes);
+
+	put_scalar(&sb, "tx_errors_total", "counter",
+	           "Packets the transport failed to send.", stats->tx_errors);
+	put_scalar(&sb, "rx_errors_total", "counter",
+	           "Packets dropped as undecodable.", stats->rx_errors);
+	put_scalar(&sb, "rounds_total", "counter",
+	           "Gossip rounds executed.", stats->rounds);
+	put_scalar(&sb, "expired_total", "counter",
+	           "Peers expired from the active list.", stats->expired);
+	put_scalar(&sb, "snapshots_total", "counter",
+	           "Membership snapshots served to joiners.",
+	           stats->snapshots);
+	put_scalar(&sb, "throttled_total", "counter",
+	           "Reply items held back by the rate limit.",
+	           stats->throttled);
+	put_scalar(&sb, "updates_total", "counter",
+	           "New nodes and versions learned from peers.",
+	           stats->updates);
+
+	put_hist(&sb, "packet_bytes", "Size of packets sent and received.",
+	         &stats->packet_bytes);
+	put_hist(&sb, "handle_usec", "Time spent handling a packet.",
+	         &stats->handle_usec);
+	put_hist(&sb, "convergence_lag_seconds",
+	         "Delay from a node update to it being applied here.",
+	         &stats->convergence_lag);
+
+	put_scalar(&sb, "nodes", "gauge", "Known nodes.", stats->nr_gnodes);
+	put_scalar(&sb, "active_nodes", "gauge", "Full nodes synced with.",
+	           stats->nr_active_gnodes);
+
+	return sb.len;
+}
@@ -0,0 +1,62 @@
+#ifndef __GOSSIP_STATS_H
+#define __GOSSIP_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GOSSIP_NR_PHASES 8
+
+/*
+ * Power of two histogram: bucket i counts the values up to 2^i, the last
+ * bucket everything above.
+ */
+#define GOSSIP_HIST_NR_BUCKETS 24
+
+struct gossip_hist {
+	int64_t buckets[GOSSIP_HIST_NR_BUCKETS];
+	int64_t count;
+	int64_t sum;
+};
+
+void gossip_hist_add(struct gossip_hist *hist, int64_t value);
+
+struct gossip_stats {
+	// per phase, bytes as on the wire, i.e. compressed
+	int64_t tx_packets[GOSSIP_NR_PHASES];
+	int64_t tx_bytes[GOSSIP_NR_PHASES];
+	int64_t rx_packets[GOSSIP_NR_PHASES];
+	int64_t rx_bytes[GOSSIP_NR_PHASES];
+
+	int64_t tx_errors; // transport write failures
+	int64_t rx_errors; // packets not decoded or of no known phase
+
+	int64_t rounds;    // syncs started by gossip_loop_once()
+	int64_t expired;   // peers dropped from the active list
+	int64_t snapshots; // membership snapshots served to joiners
+	int64_t throttled; // reply items held back by the rate limit
+	int64_t updates;   // new nodes and versions learned from peers
+
+	struct gossip_hist packet_bytes;    // rx and tx
+	struct gossip_hist handle_usec;     // read_cb latency
+	struct gossip_hist convergence_lag; // seconds, update_time to applied
+
+	// gauges, filled in by gossip_get_stats()
+	int64_t nr_gnodes;
+	int64_t nr_active_gnodes;
+};
+
+/*
+ * Write stats in the Prometheus text format, returning the length it needs
+ * like ser_dump(); the output is truncated when that is not below size.
+ */
+size_t gossip_stats_dump(const struct gossip_stats *stats,
+                         char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,122 @@
+#include "gossip_trace.h"
+
+#ifdef GOSSIP_TRACE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "gossip_stats.h"
+
+struct trace_ring {
+	struct gossip_trace_event events[GOSSIP_TRACE_RING_LEN];
+	uint64_t head; // events recorded, written by the owner thread only
+	int tid;
+	struct trace_ring *next;
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+static int nr_rings;
+
+static __thread struct trace_ring *ring;
+
+// rings are never freed, a dump may still read a ring of an exited thread
+static struct trace_ring *get_ring(void)
+{
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	pthread_mutex_lock(&rings_lock);
+	ring->tid = ++nr_rings;
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	return ring;
+}
+
+int64_t gossip_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void gossip_trace_record(int type, int phase, int64_t start,
+                         int items, int bytes)
+{
+	struct trace_ring *r = get_ring();
+	if (!r)
+		return;
+
+	uint64_t head = r->head;
+	struct gossip_trace_event *ev =
+		&r->events[head & (GOSSIP_TRACE_RING_LEN - 1)];
+
+	ev->ts = start;
+	ev->dur = gossip_trace_now() - start;
+	ev->type = type;
+	ev->phase = phase;
+	ev->items = items;
+	ev->bytes = bytes;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static const char *type_names[] = { "handle", "send", "round" };
+static const char *phase_names[GOSSIP_NR_PHASES] = {
+	"sync", "ack1", "ack2", "push", "bcast", "ihave", "graft", "prune",
+};
+
+static void dump_ring(FILE *fp, struct trace_ring *r, int *first)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = head > GOSSIP_TRACE_RING_LEN ?
+		head - GOSSIP_TRACE_RING_LEN : 0;
+
+	for (uint64_t i = tail; i < head; i++) {
+		const struct gossip_trace_event *ev =
+			&r->events[i & (GOSSIP_TRACE_RING_LEN - 1)];
+		if (ev->type < 0 || ev->type > GOSSIP_TRACE_ROUND)
+			continue;
+
+		fprintf(fp, "%s\n{\"name\":\"%s", *first ? "" : ",",
+		        type_names[ev->type]);
+		if (ev->type != GOSSIP_TRACE_ROUND &&
+		    ev->phase >= 0 && ev->phase < GOSSIP_NR_PHASES)
+			fprintf(fp, " %s", phase_names[ev->phase]);
+		fprintf(fp, "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		        "\"ts\":%.3f,\"dur\":%.3f,"
+		        "\"args\":{\"items\":%d,\"bytes\":%d}}",
+		        (int)getpid(), r->tid, ev->ts / 1000.0, ev->dur / 1000.0,
+		        ev->items, ev->bytes);
+		*first = 0;
+	}
+}
+
+int gossip_trace_dump(const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	int first = 1;
+	fprintf(fp, "{\"traceEvents\":[");
+
+	pthread_mutex_lock(&rings_lock);
+	for (struct trace_ring *r = rings; r; r = r->next)
+		dump_ring(fp, r, &first);
+	pthread_mutex_unlock(&rings_lock);
+
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	return fclose(fp) ? -1 : 0;
+}
+
+#endif
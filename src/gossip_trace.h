@@ -0,0 +1,63 @@
+#ifndef __GOSSIP_TRACE_H
+#define __GOSSIP_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hot path trace points, built with -DWITH_TRACE=ON only; otherwise the
+ * macros below expand to nothing and their arguments are not evaluated.
+ *
+ * Every thread records into its own ring of the last GOSSIP_TRACE_RING_LEN
+ * events, without locking. gossip_trace_dump() writes all rings as a
+ * Chrome trace (chrome://tracing, ui.perfetto.dev); events overwritten
+ * while it runs may come out garbled.
+ */
+
+#define GOSSIP_TRACE_RING_LEN 8192 // power of two
+
+enum {
+	GOSSIP_TRACE_HANDLE = 0, // a packet received and handled by read_cb
+	GOSSIP_TRACE_SEND,       // a packet compressed and written
+	GOSSIP_TRACE_ROUND,      // a sync started by gossip_loop_once
+};
+
+struct gossip_trace_event {
+	int64_t ts;  // ns, CLOCK_MONOTONIC
+	int64_t dur; // ns
+	int type;
+	int phase;
+	int items;
+	int bytes;
+};
+
+#ifdef GOSSIP_TRACE
+
+int64_t gossip_trace_now(void);
+void gossip_trace_record(int type, int phase, int64_t start,
+                         int items, int bytes);
+int gossip_trace_dump(const char *path);
+
+#define GOSSIP_TRACE_BEGIN(var) int64_t var = gossip_trace_now()
+#define GOSSIP_TRACE_END(var, type, phase, items, bytes) \
+	gossip_trace_record(type, phase, var, items, bytes)
+
+#else
+
+static inline int gossip_trace_dump(const char *path)
+{
+	return -1;
+}
+
+#define GOSSIP_TRACE_BEGIN(var) do {} while (0)
+#define GOSSIP_TRACE_END(var, type, phase, items, bytes) do {} while (0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif
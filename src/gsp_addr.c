@@ -0,0 +1,151 @@
+#include "gsp_addr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __WIN32
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+int gsp_addr_resolve(struct gsp_addr *addr, const char *host, int port,
+                     bool numeric)
+{
+	struct addrinfo hints = {0}, *res;
+	char service[8];
+
+	gsp_addr_clear(addr);
+	if (!host || !*host || port <= 0 || port > 65535)
+		return -1;
+
+	// plain literals, without the allocations of getaddrinfo()
+	struct sockaddr_in *in = (struct sockaddr_in *)&addr->ss;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr->ss;
+	memset(&addr->ss, 0, sizeof(addr->ss));
+	if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		addr->len = sizeof(*in);
+		return 0;
+	}
+	if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		addr->len = sizeof(*in6);
+		return 0;
+	}
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV | (numeric ? AI_NUMERICHOST : 0);
+	snprintf(service, sizeof(service), "%d", port);
+
+	if (getaddrinfo(host, service, &hints, &res))
+		return -1;
+
+	if (res->ai_addrlen <= sizeof(addr->ss)) {
+		memcpy(&addr->ss, res->ai_addr, res->ai_addrlen);
+		addr->len = res->ai_addrlen;
+	}
+
+	freeaddrinfo(res);
+	return gsp_addr_valid(addr) ? 0 : -1;
+}
+
+int gsp_addr_parse(struct gsp_addr *addr, const char *hostport, bool numeric)
+{
+	char host[256];
+	const char *sep;
+	size_t len;
+
+	gsp_addr_clear(addr);
+
+	if (*hostport == '[') {
+		const char *end = strchr(hostport, ']');
+		if (!end || end[1] != ':')
+			return -1;
+		hostport++;
+		len = end - hostport;
+		sep = end + 1;
+	} else {
+		sep = strrchr(hostport, ':');
+		if (!sep)
+			return -1;
+		len = sep - hostport;
+	}
+
+	if (len >= sizeof(host))
+		return -1;
+	memcpy(host, hostport, len);
+	host[len] = '\0';
+
+	char *end;
+	long port = strtol(sep + 1, &end, 10);
+	if (end == sep + 1 || *end)
+		return -1;
+
+	return gsp_addr_resolve(addr, host, port, numeric);
+}
+
+// the IPv4 address of an AF_INET or v4-mapped AF_INET6 address
+static bool addr_v4(const struct sockaddr *sa, uint32_t *ip, uint16_t *port)
+{
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)sa;
+		*ip = in->sin_addr.s_addr;
+		*port = in->sin_port;
+		return true;
+	}
+
+	if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 =
+			(const struct sockaddr_in6 *)sa;
+		if (!IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+			return false;
+		memcpy(ip, in6->sin6_addr.s6_addr + 12, 4);
+		*port = in6->sin6_port;
+		return true;
+	}
+
+	return false;
+}
+
+bool gsp_addr_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+	uint32_t ip_a, ip_b;
+	uint16_t port_a, port_b;
+
+	bool v4_a = addr_v4(a, &ip_a, &port_a);
+	bool v4_b = addr_v4(b, &ip_b, &port_b);
+	if (v4_a || v4_b)
+		return v4_a && v4_b && ip_a == ip_b && port_a == port_b;
+
+	if (a->sa_family != AF_INET6 || b->sa_family != AF_INET6)
+		return false;
+
+	const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+	const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+	return a6->sin6_port == b6->sin6_port &&
+		a6->sin6_scope_id == b6->sin6_scope_id &&
+		memcmp(&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
+}
+
+unsigned int gsp_addr_hash(const struct sockaddr *addr)
+{
+	uint32_t ip;
+	uint16_t port;
+
+	if (addr_v4(addr, &ip, &port))
+		return ip * 2654435761U ^ port;
+
+	if (addr->sa_family != AF_INET6)
+		return 0;
+
+	const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+	unsigned int hash = in6->sin6_port;
+	for (int i = 0; i < 16; i++)
+		hash = hash * 31 + in6->sin6_addr.s6_addr[i];
+	return hash;
+}
@@ -0,0 +1,49 @@
+#ifndef __GSP_ADDR_H
+#define __GSP_ADDR_H
+
+#include <stdbool.h>
+#include "gsp_transport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A resolved IPv4 or IPv6 transport address, so that sending never has to
+ * parse text. len is 0 while unresolved.
+ */
+struct gsp_addr {
+	struct sockaddr_storage ss;
+	socklen_t len;
+};
+
+#define gsp_addr_sa(addr) ((struct sockaddr *)&(addr)->ss)
+
+static inline void gsp_addr_clear(struct gsp_addr *addr)
+{
+	addr->len = 0;
+}
+
+static inline bool gsp_addr_valid(const struct gsp_addr *addr)
+{
+	return addr->len != 0;
+}
+
+/*
+ * Resolve host, an address literal, or a name too when numeric is false.
+ * Names may resolve slowly, only ask for them off the packet path.
+ */
+int gsp_addr_resolve(struct gsp_addr *addr, const char *host, int port,
+                     bool numeric);
+
+// "host:port", "ipv4:port" or "[ipv6]:port"
+int gsp_addr_parse(struct gsp_addr *addr, const char *hostport, bool numeric);
+
+// IPv4 and the same address mapped into IPv6 are equal
+bool gsp_addr_equal(const struct sockaddr *a, const struct sockaddr *b);
+unsigned int gsp_addr_hash(const struct sockaddr *addr);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
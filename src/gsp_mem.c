@@ -0,0 +1,192 @@
+#include "gsp_mem.h"
+#include "gsp_addr.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __WIN32
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+struct gsp_mem_packet {
+	struct list_head node;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	size_t len;
+	char data[];
+};
+
+static unsigned int addr_hash(const struct sockaddr *addr)
+{
+	return gsp_addr_hash(addr) % GSP_MEM_NR_HASH;
+}
+
+static struct gsp_mem *
+find_endpoint(struct gsp_mem_net *net, const struct sockaddr *addr)
+{
+	struct gsp_mem *pos;
+	hlist_for_each_entry(pos, &net->heads[addr_hash(addr)], hash_node) {
+		if (gsp_addr_equal((struct sockaddr *)&pos->addr, addr))
+			return pos;
+	}
+
+	return NULL;
+}
+
+/*
+ * gsp_mem_net
+ */
+
+int gsp_mem_net_init(struct gsp_mem_net *net)
+{
+	memset(net, 0, sizeof(*net));
+	return pthread_mutex_init(&net->lock, NULL);
+}
+
+void gsp_mem_net_close(struct gsp_mem_net *net)
+{
+	pthread_mutex_destroy(&net->lock);
+}
+
+/*
+ * gsp_mem
+ */
+
+static ssize_t mem_write(struct gsp_transport *tp, const void *buf, size_t len,
+                         const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct gsp_mem *mem = container_of(tp, struct gsp_mem, tp);
+
+	struct gsp_mem_packet *pkt = malloc(sizeof(*pkt) + len);
+	if (!pkt) return -1;
+
+	memcpy(&pkt->from, &mem->addr, mem->addr_len);
+	pkt->from_len = mem->addr_len;
+	pkt->len = len;
+	memcpy(pkt->data, buf, len);
+
+	struct gsp_mem_net *net = mem->net;
+	pthread_mutex_lock(&net->lock);
+
+	mem->tx_packets++;
+	mem->tx_bytes += len;
+
+	struct gsp_mem *dest = find_endpoint(net, addr);
+	if (dest && net->loss_rate > 0 &&
+	    rand_r(&net->seed) < net->loss_rate * ((double)RAND_MAX + 1))
+		dest = NULL;
+
+	if (dest) {
+		list_add_tail(&pkt->node, &dest->queue);
+		dest->nr_queued++;
+		net->nr_queued++;
+		pthread_cond_signal(&dest->cond);
+	} else {
+		net->nr_dropped++;
+	}
+
+	pthread_mutex_unlock(&net->lock);
+
+	if (!dest)
+		free(pkt);
+
+	return len;
+}
+
+static int mem_loop(struct gsp_transport *tp, int flags)
+{
+	struct gsp_mem *mem = container_of(tp, struct gsp_mem, tp);
+
+	do {
+		LIST_HEAD(queue);
+
+		// replies queued while delivering wait for the next loop
+		pthread_mutex_lock(&mem->net->lock);
+		while (flags == GSP_TRANSPORT_LOOP_FOREVER &&
+		       list_empty(&mem->queue))
+			pthread_cond_wait(&mem->cond, &mem->net->lock);
+		list_splice_init(&mem->queue, &queue);
+		mem->net->nr_queued -= mem->nr_queued;
+		mem->nr_queued = 0;
+		pthread_mutex_unlock(&mem->net->lock);
+
+		struct gsp_mem_packet *pos, *n;
+		list_for_each_entry_safe(pos, n, &queue, node) {
+			list_del(&pos->node);
+			mem->rx_packets++;
+			mem->rx_bytes += pos->len;
+			if (tp->read_cb) {
+				tp->read_cb(tp, pos->data, pos->len,
+				            (struct sockaddr *)&pos->from,
+				            pos->from_len);
+			}
+			free(pos);
+		}
+	} while (flags == GSP_TRANSPORT_LOOP_FOREVER);
+
+	return 0;
+}
+
+static int mem_close(struct gsp_transport *tp)
+{
+	struct gsp_mem *mem = container_of(tp, struct gsp_mem, tp);
+
+	pthread_mutex_lock(&mem->net->lock);
+	hlist_del_init(&mem->hash_node);
+	mem->net->nr_endpoints--;
+	mem->net->nr_queued -= mem->nr_queued;
+	mem->nr_queued = 0;
+	pthread_mutex_unlock(&mem->net->lock);
+
+	struct gsp_mem_packet *pos, *n;
+	list_for_each_entry_safe(pos, n, &mem->queue, node) {
+		list_del(&pos->node);
+		free(pos);
+	}
+
+	pthread_cond_destroy(&mem->cond);
+	return 0;
+}
+
+static const struct gsp_transport_operations mem_transport_ops = {
+	.write = mem_write,
+	.loop = mem_loop,
+	.close = mem_close,
+};
+
+int gsp_mem_init(struct gsp_mem *mem, struct gsp_mem_net *net,
+                 const char *ipaddr, int port)
+{
+	memset(mem, 0, sizeof(*mem));
+	mem->tp.ops = &mem_transport_ops;
+	mem->net = net;
+	INIT_LIST_HEAD(&mem->queue);
+	INIT_HLIST_NODE(&mem->hash_node);
+
+	struct gsp_addr bind_addr;
+	if (gsp_addr_resolve(&bind_addr, ipaddr, port, true)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (pthread_cond_init(&mem->cond, NULL))
+		return -1;
+	memcpy(&mem->addr, &bind_addr.ss, bind_addr.len);
+	mem->addr_len = bind_addr.len;
+	struct sockaddr *addr = (struct sockaddr *)&mem->addr;
+
+	pthread_mutex_lock(&net->lock);
+	if (find_endpoint(net, addr)) {
+		pthread_mutex_unlock(&net->lock);
+		pthread_cond_destroy(&mem->cond);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	hlist_add_head(&mem->hash_node,
+	               &net->heads[addr_hash(addr)]);
+	net->nr_endpoints++;
+	pthread_mutex_unlock(&net->lock);
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef __GSP_MEM_H
+#define __GSP_MEM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "gsp_transport.h"
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In-process transport: every gsp_mem endpoint bound to a gsp_mem_net gets
+ * the datagrams written to its address queued in memory, and loop() hands
+ * them to read_cb. Datagrams to unbound addresses are dropped, as UDP would,
+ * and so is a loss_rate fraction of the others, picked with rand_r(&seed) so
+ * that a simulation can be replayed. With GSP_TRANSPORT_LOOP_FOREVER, loop()
+ * sleeps on the cond of the endpoint while its queue is empty.
+ */
+
+#define GSP_MEM_NR_HASH 1021
+
+struct gsp_mem_net {
+	pthread_mutex_t lock;
+	struct hlist_head heads[GSP_MEM_NR_HASH];
+	int nr_endpoints;
+
+	double loss_rate;
+	unsigned int seed;
+
+	int64_t nr_queued;
+	int64_t nr_dropped;
+};
+
+struct gsp_mem {
+	struct gsp_transport tp;
+
+	struct gsp_mem_net *net;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	struct list_head queue;
+	int nr_queued;
+	pthread_cond_t cond; // signalled under net->lock by a write to us
+
+	int64_t tx_packets;
+	int64_t tx_bytes;
+	int64_t rx_packets;
+	int64_t rx_bytes;
+
+	struct hlist_node hash_node;
+};
+
+int gsp_mem_net_init(struct gsp_mem_net *net);
+void gsp_mem_net_close(struct gsp_mem_net *net);
+
+int gsp_mem_init(struct gsp_mem *mem, struct gsp_mem_net *net,
+                 const char *ipaddr, int port);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
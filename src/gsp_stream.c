@@ -0,0 +1,260 @@
+#include "gsp_stream.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+static int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void close_keep_errno(int fd)
+{
+	int err = errno;
+	close(fd);
+	errno = err;
+}
+
+void gsp_stream_init(struct gsp_stream *st, int fd)
+{
+	memset(st, 0, sizeof(*st));
+	st->fd = fd;
+}
+
+int gsp_stream_listen(const struct gsp_addr *addr)
+{
+	int fd = socket(addr->ss.ss_family, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	// dual-stack, as gsp_udp
+	if (addr->ss.ss_family == AF_INET6) {
+		int v6only = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+		           &v6only, sizeof(v6only));
+	}
+
+	if (bind(fd, (const struct sockaddr *)&addr->ss, addr->len) ||
+	    listen(fd, GSP_STREAM_BACKLOG) || set_nonblock(fd)) {
+		close_keep_errno(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int gsp_stream_accept(int listen_fd, struct gsp_stream *st)
+{
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1)
+		return -1;
+
+	if (set_nonblock(fd)) {
+		close_keep_errno(fd);
+		return -1;
+	}
+
+	gsp_stream_init(st, fd);
+	return 0;
+}
+
+int gsp_stream_connect(struct gsp_stream *st, const struct gsp_addr *addr,
+                       int timeout_ms)
+{
+	int fd = socket(addr->ss.ss_family, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (set_nonblock(fd))
+		goto err;
+
+	if (connect(fd, (const struct sockaddr *)&addr->ss, addr->len) &&
+	    errno != EINPROGRESS)
+		goto err;
+
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	if (poll(&pfd, 1, timeout_ms) != 1) {
+		errno = ETIMEDOUT;
+		goto err;
+	}
+
+	int soerr = 0;
+	socklen_t soerr_len = sizeof(soerr);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &soerr_len))
+		goto err;
+	if (soerr) {
+		errno = soerr;
+		goto err;
+	}
+
+	gsp_stream_init(st, fd);
+	return 0;
+
+err:
+	close_keep_errno(fd);
+	return -1;
+}
+
+void gsp_stream_close(struct gsp_stream *st)
+{
+	if (st->fd >= 0)
+		close(st->fd);
+	free(st->out);
+	free(st->in);
+	gsp_stream_init(st, -1);
+}
+
+/*
+ * write
+ */
+
+int gsp_stream_put_chunk(struct gsp_stream *st, const void *buf, size_t len)
+{
+	if (len > GSP_STREAM_CHUNK_LEN_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	// drop what is sent already before growing
+	if (st->out_off) {
+		memmove(st->out, st->out + st->out_off,
+		        st->out_len - st->out_off);
+		st->out_len -= st->out_off;
+		st->out_off = 0;
+	}
+
+	size_t need = st->out_len + 4 + len;
+	if (need > st->out_size) {
+		size_t size = st->out_size ? st->out_size : 4096;
+		while (size < need)
+			size <<= 1;
+
+		char *out = realloc(st->out, size);
+		if (!out)
+			return -1;
+		st->out = out;
+		st->out_size = size;
+	}
+
+	unsigned char *hdr = (unsigned char *)st->out + st->out_len;
+	hdr[0] = len >> 24;
+	hdr[1] = (len >> 16) & 0xff;
+	hdr[2] = (len >> 8) & 0xff;
+	hdr[3] = len & 0xff;
+	memcpy(hdr + 4, buf, len);
+	st->out_len = need;
+	return 0;
+}
+
+int gsp_stream_flush(struct gsp_stream *st, int64_t max)
+{
+	while (st->out_off < st->out_len) {
+		size_t len = st->out_len - st->out_off;
+		if ((int64_t)len > max)
+			len = max;
+		if (!len)
+			return 0;
+
+		ssize_t nr = send(st->fd, st->out + st->out_off, len,
+		                  MSG_NOSIGNAL);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		st->out_off += nr;
+		st->tx_bytes += nr;
+		max -= nr;
+	}
+
+	st->out_off = st->out_len = 0;
+	return 1;
+}
+
+/*
+ * read
+ */
+
+// bytes read, short only at the end of the stream
+static ssize_t read_full(int fd, char *buf, size_t len, int timeout_ms)
+{
+	size_t off = 0;
+
+	while (off < len) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (!ret)
+				errno = ETIMEDOUT;
+			return -1;
+		}
+
+		ssize_t nr = recv(fd, buf + off, len - off, 0);
+		if (nr < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EWOULDBLOCK)
+				continue;
+			return -1;
+		}
+		if (!nr)
+			break;
+		off += nr;
+	}
+
+	return off;
+}
+
+ssize_t gsp_stream_read_chunk(struct gsp_stream *st, const char **chunk,
+                              int timeout_ms)
+{
+	unsigned char hdr[4];
+
+	ssize_t nr = read_full(st->fd, (char *)hdr, sizeof(hdr), timeout_ms);
+	if (nr <= 0)
+		return nr;
+	if (nr != sizeof(hdr)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	size_t len = (size_t)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+	if (!len || len > GSP_STREAM_CHUNK_LEN_MAX) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (len > st->in_size) {
+		char *in = realloc(st->in, len);
+		if (!in)
+			return -1;
+		st->in = in;
+		st->in_size = len;
+	}
+
+	nr = read_full(st->fd, st->in, len, timeout_ms);
+	if (nr < 0)
+		return -1;
+	if ((size_t)nr != len) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	*chunk = st->in;
+	return len;
+}
@@ -0,0 +1,58 @@
+#ifndef __GSP_STREAM_H
+#define __GSP_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "gsp_addr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Chunks over TCP, for the bulk transfers that do not fit gossip datagrams:
+ * each chunk is a 32-bit big endian length, then its bytes. A writer queues
+ * chunks and gsp_stream_flush() pushes them without blocking; a reader takes
+ * them one at a time with gsp_stream_read_chunk(), which blocks up to a
+ * timeout.
+ */
+
+#define GSP_STREAM_BACKLOG 16
+#define GSP_STREAM_CHUNK_LEN_MAX (1 << 20)
+
+struct gsp_stream {
+	int fd; // -1 when closed
+
+	char *out;
+	size_t out_len;
+	size_t out_off;
+	size_t out_size;
+	int64_t tx_bytes;
+
+	char *in;
+	size_t in_size;
+};
+
+void gsp_stream_init(struct gsp_stream *st, int fd);
+int gsp_stream_listen(const struct gsp_addr *addr);
+int gsp_stream_accept(int listen_fd, struct gsp_stream *st);
+int gsp_stream_connect(struct gsp_stream *st, const struct gsp_addr *addr,
+                       int timeout_ms);
+void gsp_stream_close(struct gsp_stream *st);
+
+int gsp_stream_put_chunk(struct gsp_stream *st, const void *buf, size_t len);
+
+/*
+ * Send what is queued, max bytes at most: 1 once all of it is sent, 0 while
+ * some is pending, -1 on error.
+ */
+int gsp_stream_flush(struct gsp_stream *st, int64_t max);
+// length of the chunk, 0 at the end of the stream, -1 on error or timeout
+ssize_t gsp_stream_read_chunk(struct gsp_stream *st, const char **chunk,
+                              int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
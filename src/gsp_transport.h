@@ -0,0 +1,98 @@
+#ifndef __GSP_TRANSPORT_H
+#define __GSP_TRANSPORT_H
+
+#ifdef __WIN32
+#include <winsock2.h>
+typedef int socklen_t;
+#else
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A datagram transport gossip talks through. gsp_udp is the kernel UDP
+ * implementation, gsp_mem an in-process one. loop() delivers the pending
+ * datagrams to read_cb, flags being GSP_TRANSPORT_LOOP_ONCE or
+ * GSP_TRANSPORT_LOOP_FOREVER.
+ *
+ * write_segments() is optional: it sends buf as datagrams of seg_size bytes,
+ * the last one possibly shorter, in one go where the transport can.
+ */
+
+#define GSP_TRANSPORT_LOOP_ONCE 0
+#define GSP_TRANSPORT_LOOP_FOREVER 1
+
+struct gsp_transport;
+
+typedef int (*gsp_transport_read_cb)(struct gsp_transport *tp,
+                                     const void *buf, ssize_t len,
+                                     struct sockaddr *addr,
+                                     socklen_t addr_len);
+
+struct gsp_transport_operations {
+	ssize_t (*write)(struct gsp_transport *tp, const void *buf, size_t len,
+	                 const struct sockaddr *addr, socklen_t addr_len);
+	int (*loop)(struct gsp_transport *tp, int flags);
+	int (*close)(struct gsp_transport *tp);
+	ssize_t (*write_segments)(struct gsp_transport *tp, const void *buf,
+	                          size_t len, size_t seg_size,
+	                          const struct sockaddr *addr,
+	                          socklen_t addr_len);
+};
+
+struct gsp_transport {
+	const struct gsp_transport_operations *ops;
+	gsp_transport_read_cb read_cb;
+	void *user_data;
+};
+
+static inline void
+gsp_transport_read_start(struct gsp_transport *tp, gsp_transport_read_cb cb)
+{
+	tp->read_cb = cb;
+}
+
+static inline ssize_t
+gsp_transport_write(struct gsp_transport *tp, const void *buf, size_t len,
+                    const struct sockaddr *addr, socklen_t addr_len)
+{
+	return tp->ops->write(tp, buf, len, addr, addr_len);
+}
+
+static inline ssize_t
+gsp_transport_write_segments(struct gsp_transport *tp, const void *buf,
+                             size_t len, size_t seg_size,
+                             const struct sockaddr *addr, socklen_t addr_len)
+{
+	if (tp->ops->write_segments && len > seg_size)
+		return tp->ops->write_segments(tp, buf, len, seg_size,
+		                               addr, addr_len);
+
+	for (size_t off = 0; off < len; off += seg_size) {
+		size_t n = len - off < seg_size ? len - off : seg_size;
+		if (tp->ops->write(tp, (const char *)buf + off, n,
+		                   addr, addr_len) < 0)
+			return -1;
+	}
+
+	return len;
+}
+
+static inline int gsp_transport_loop(struct gsp_transport *tp, int flags)
+{
+	return tp->ops->loop(tp, flags);
+}
+
+static inline int gsp_transport_close(struct gsp_transport *tp)
+{
+	return tp->ops->close(tp);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,20 +1,83 @@
 #include "gsp_udp.h"
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #ifdef __WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #define setsockopt(A, B, C, D, E) setsockopt(A, B, C, (char *)D, E)
 #else
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #endif
+#include "gsp_addr.h"
+#include "gsp_uring.h"
+#include "list.h"
 
 int lib_init;
 
+/*
+ * gsp_transport
+ */
+
+static int udp_transport_read_cb(struct gsp_udp *udp, const void *buf,
+                                 ssize_t len, struct sockaddr *addr,
+                                 socklen_t addr_len)
+{
+	if (!udp->tp.read_cb)
+		return -1;
+
+	return udp->tp.read_cb(&udp->tp, buf, len, addr, addr_len);
+}
+
+static ssize_t udp_transport_write(struct gsp_transport *tp,
+                                   const void *buf, size_t len,
+                                   const struct sockaddr *addr,
+                                   socklen_t addr_len)
+{
+	struct gsp_udp *udp = container_of(tp, struct gsp_udp, tp);
+	return gsp_udp_write(udp, buf, len, addr, addr_len);
+}
+
+static ssize_t udp_transport_write_segments(struct gsp_transport *tp,
+                                            const void *buf, size_t len,
+                                            size_t seg_size,
+                                            const struct sockaddr *addr,
+                                            socklen_t addr_len)
+{
+	struct gsp_udp *udp = container_of(tp, struct gsp_udp, tp);
+	return gsp_udp_write_segments(udp, buf, len, seg_size, addr, addr_len);
+}
+
+static int udp_transport_loop(struct gsp_transport *tp, int flags)
+{
+	struct gsp_udp *udp = container_of(tp, struct gsp_udp, tp);
+
+	gsp_udp_read_start(udp, udp_transport_read_cb);
+	return gsp_udp_loop(udp, flags);
+}
+
+static int udp_transport_close(struct gsp_transport *tp)
+{
+	return gsp_udp_close(container_of(tp, struct gsp_udp, tp));
+}
+
+static const struct gsp_transport_operations udp_transport_ops = {
+	.write = udp_transport_write,
+	.write_segments = udp_transport_write_segments,
+	.loop = udp_transport_loop,
+	.close = udp_transport_close,
+};
+
+/*
+ * gsp_udp
+ */
+
 int gsp_udp_init(struct gsp_udp *udp, struct gsp_udp_info *info)
 {
 	if (!lib_init) {
@@ -27,16 +90,27 @@ int gsp_udp_init(struct gsp_udp *udp, struct gsp_udp_info *info)
 	}
 
 	memset(udp, 0, sizeof(*udp));
+	udp->tp.ops = &udp_transport_ops;
 
-	udp->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct gsp_addr addr;
+	if (gsp_addr_resolve(&addr, info->ipaddr, info->port, true)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	udp->family = addr.ss.ss_family;
+	udp->fd = socket(udp->family, SOCK_DGRAM, 0);
 	if (udp->fd == -1)
 		return -1;
 
-	struct sockaddr_in addr = {0};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(info->port);
-	addr.sin_addr.s_addr = inet_addr(info->ipaddr);
-	if (bind(udp->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+	// an IPv6 socket takes IPv4 peers too, as v4-mapped addresses
+	if (udp->family == AF_INET6) {
+		int v6only = 0;
+		setsockopt(udp->fd, IPPROTO_IPV6, IPV6_V6ONLY,
+		           &v6only, sizeof(v6only));
+	}
+
+	if (bind(udp->fd, gsp_addr_sa(&addr), addr.len)) {
 		int err = errno;
 		close(udp->fd);
 		errno = err;
@@ -76,11 +150,29 @@ int gsp_udp_init(struct gsp_udp *udp, struct gsp_udp_info *info)
 	else
 		udp->recv_buf_len = info->recv_buf_len;
 
+#ifdef UDP_SEGMENT
+	udp->gso = 1;
+#endif
+#ifdef UDP_GRO
+	// a coalesced train needs the largest buffer a datagram may have
+	int gro = 1;
+	if (setsockopt(udp->fd, SOL_UDP, UDP_GRO, &gro, sizeof(gro)) == 0) {
+		udp->gro = 1;
+		if (udp->recv_buf_len < GSP_UDP_GRO_BUF_LEN)
+			udp->recv_buf_len = GSP_UDP_GRO_BUF_LEN;
+	}
+#endif
+
+	// fall back on the plain socket calls silently
+	if (info->flags & GSP_UDP_F_URING)
+		gsp_uring_init(udp);
+
 	return 0;
 }
 
 int gsp_udp_close(struct gsp_udp *udp)
 {
+	gsp_uring_close(udp);
 	close(udp->fd);
 	if (udp->recv_buf)
 		free(udp->recv_buf);
@@ -92,7 +184,7 @@ void gsp_udp_read_start(struct gsp_udp *udp, gsp_udp_read_cb read_cb)
 {
 	udp->ops.read_cb = read_cb;
 
-	if (!udp->recv_buf)
+	if (!udp->recv_buf && !udp->uring)
 		udp->recv_buf = malloc(udp->recv_buf_len);
 }
 
@@ -101,26 +193,196 @@ void gsp_udp_read_stop(struct gsp_udp *udp)
 	udp->ops.read_cb = NULL;
 }
 
+// an IPv4 peer of an IPv6 socket is written to as a v4-mapped address
+static const struct sockaddr *map_addr(struct gsp_udp *udp,
+                                       const struct sockaddr *addr,
+                                       socklen_t *addr_len,
+                                       struct sockaddr_in6 *mapped)
+{
+	if (udp->family != AF_INET6 || addr->sa_family != AF_INET)
+		return addr;
+
+	const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+	memset(mapped, 0, sizeof(*mapped));
+	mapped->sin6_family = AF_INET6;
+	mapped->sin6_port = in->sin_port;
+	mapped->sin6_addr.s6_addr[10] = 0xff;
+	mapped->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(mapped->sin6_addr.s6_addr + 12, &in->sin_addr, 4);
+
+	*addr_len = sizeof(*mapped);
+	return (const struct sockaddr *)mapped;
+}
+
 ssize_t gsp_udp_write(struct gsp_udp *udp, const void *buf, size_t len,
                      const struct sockaddr *addr, socklen_t addr_len)
 {
+	struct sockaddr_in6 mapped;
+	addr = map_addr(udp, addr, &addr_len, &mapped);
+
+	if (udp->uring)
+		return gsp_uring_write(udp, buf, len, 0, addr, addr_len);
+
 	return sendto(udp->fd, buf, len, 0, addr, addr_len);
 }
 
+static ssize_t write_each_segment(struct gsp_udp *udp, const void *buf,
+                                  size_t len, size_t seg_size,
+                                  const struct sockaddr *addr,
+                                  socklen_t addr_len)
+{
+	for (size_t off = 0; off < len; off += seg_size) {
+		size_t n = len - off < seg_size ? len - off : seg_size;
+		if (gsp_udp_write(udp, (const char *)buf + off, n,
+		                  addr, addr_len) < 0)
+			return -1;
+	}
+
+	return len;
+}
+
+ssize_t gsp_udp_write_segments(struct gsp_udp *udp, const void *buf,
+                               size_t len, size_t seg_size,
+                               const struct sockaddr *addr,
+                               socklen_t addr_len)
+{
+	if (!udp->gso || len <= seg_size)
+		return write_each_segment(udp, buf, len, seg_size,
+		                          addr, addr_len);
+
+#ifdef UDP_SEGMENT
+	struct sockaddr_in6 mapped;
+	const struct sockaddr *to = map_addr(udp, addr, &addr_len, &mapped);
+
+	if (udp->uring)
+		return gsp_uring_write(udp, buf, len, seg_size, to, addr_len);
+
+	char control[GSP_UDP_CONTROL_LEN];
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_name = (void *)to,
+		.msg_namelen = addr_len,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = gsp_udp_put_segment(control, seg_size),
+	};
+
+	ssize_t nr = sendmsg(udp->fd, &msg, 0);
+	if (nr >= 0 || !gsp_udp_gso_refused(errno))
+		return nr;
+
+	// e.g. a device without checksum offload, never ask again
+	udp->gso = 0;
+#endif
+	return write_each_segment(udp, buf, len, seg_size, addr, addr_len);
+}
+
+#ifdef UDP_SEGMENT
+int gsp_udp_gso_refused(int err)
+{
+	return err == EIO || err == EINVAL || err == ENOPROTOOPT ||
+		err == EOPNOTSUPP;
+}
+
+size_t gsp_udp_put_segment(void *control, size_t seg_size)
+{
+	struct msghdr msg = {
+		.msg_control = control,
+		.msg_controllen = CMSG_SPACE(sizeof(uint16_t)),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	uint16_t size = seg_size;
+
+	memset(control, 0, msg.msg_controllen);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+	memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+	return msg.msg_controllen;
+}
+#endif
+
+#ifdef UDP_GRO
+size_t gsp_udp_get_segment(const struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg;
+	     cmsg = CMSG_NXTHDR((struct msghdr *)msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			int size;
+			memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+			return size > 0 ? size : 0;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+void gsp_udp_deliver(struct gsp_udp *udp, const char *buf, size_t len,
+                     size_t seg_size, struct sockaddr *addr,
+                     socklen_t addr_len)
+{
+	if (!seg_size || seg_size > len)
+		seg_size = len;
+
+	size_t off = 0;
+	do {
+		size_t n = len - off < seg_size ? len - off : seg_size;
+
+		if (!udp->ops.read_cb)
+			break;
+		udp->ops.read_cb(udp, buf + off, n, addr, addr_len);
+		off += n;
+	} while (off < len);
+}
+
 int gsp_udp_loop(struct gsp_udp *udp, int flags)
 {
+	if (udp->uring)
+		return gsp_uring_loop(udp, flags);
+
 	do {
 		if (udp->ops.read_cb) {
-			struct sockaddr raddr = {0};
+			struct sockaddr_storage raddr = {0};
+#ifdef UDP_GRO
+			char control[GSP_UDP_CONTROL_LEN];
+			struct iovec iov = {
+				.iov_base = udp->recv_buf,
+				.iov_len = udp->recv_buf_len,
+			};
+			struct msghdr msg = {
+				.msg_name = &raddr,
+				.msg_namelen = sizeof(raddr),
+				.msg_iov = &iov,
+				.msg_iovlen = 1,
+				.msg_control = control,
+				.msg_controllen = sizeof(control),
+			};
+
+			ssize_t nr = recvmsg(udp->fd, &msg, 0);
+			if (nr != -1 && !(msg.msg_flags & MSG_TRUNC)) {
+				gsp_udp_deliver(udp, udp->recv_buf, nr,
+				                gsp_udp_get_segment(&msg),
+				                (struct sockaddr *)&raddr,
+				                msg.msg_namelen);
+			}
+#else
 			socklen_t raddr_len = sizeof(raddr);
 
 			ssize_t nr = recvfrom(udp->fd, udp->recv_buf,
 			                      udp->recv_buf_len, 0,
-			                      &raddr, &raddr_len);
+			                      (struct sockaddr *)&raddr,
+			                      &raddr_len);
 			if (nr != -1) {
-				udp->ops.read_cb(udp, udp->recv_buf,
-				                 nr, &raddr, raddr_len);
+				udp->ops.read_cb(udp, udp->recv_buf, nr,
+				                 (struct sockaddr *)&raddr,
+				                 raddr_len);
 			}
+#endif
 		}
 	} while (flags == GSP_UDP_LOOP_FOREVER);
 
@@ -1,13 +1,7 @@
 #ifndef __GSP_UDP_H
 #define __GSP_UDP_H
 
-#ifdef __WIN32
-#include <winsock2.h>
-typedef int socklen_t;
-#else
-#include <sys/socket.h>
-#include <sys/types.h>
-#endif
+#include "gsp_transport.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,10 +10,15 @@ extern "C" {
 #define GSP_UDP_LOOP_ONCE 0
 #define GSP_UDP_LOOP_FOREVER 1
 
+// receive and send through io_uring where the kernel allows, see gsp_uring.h
+#define GSP_UDP_F_URING 1
+
 #define GSP_UDP_RECV_BUF_LEN_MIN 1024
 #define GSP_UDP_RECV_BUF_LEN_MAX 65000 // 65507
+#define GSP_UDP_GRO_BUF_LEN 65536 // a datagram train coalesced by GRO
 
 struct gsp_udp;
+struct gsp_uring;
 
 typedef void (*gsp_udp_close_cb)(struct gsp_udp *udp);
 typedef int (*gsp_udp_read_cb)(struct gsp_udp *udp, const void *buf, ssize_t len,
@@ -31,19 +30,28 @@ struct gsp_udp_operations {
 };
 
 struct gsp_udp_info {
-	const char *ipaddr;
+	const char *ipaddr; // an IPv6 one, e.g. "::", makes a dual-stack socket
 	int port;
 	size_t recv_buf_len;
+	int flags;
 };
 
 struct gsp_udp {
+	struct gsp_transport tp;
+
 	int fd;
+	int family;
 
 	char *recv_buf;
 	size_t recv_buf_len;
 
 	struct gsp_udp_operations ops;
 
+	struct gsp_uring *uring; // NULL when on recvfrom/sendto
+
+	int gso; // UDP_SEGMENT, until the kernel refuses it once
+	int gro; // UDP_GRO, datagrams come coalesced
+
 	void *user_data;
 };
 
@@ -53,6 +61,10 @@ void gsp_udp_read_start(struct gsp_udp *udp, gsp_udp_read_cb read_cb);
 void gsp_udp_read_stop(struct gsp_udp *udp);
 ssize_t gsp_udp_write(struct gsp_udp *udp, const void *buf, size_t len,
                      const struct sockaddr *addr, socklen_t addr_len);
+ssize_t gsp_udp_write_segments(struct gsp_udp *udp, const void *buf,
+                               size_t len, size_t seg_size,
+                               const struct sockaddr *addr,
+                               socklen_t addr_len);
 int gsp_udp_loop(struct gsp_udp *udp, int flags);
 
 #ifdef __cplusplus
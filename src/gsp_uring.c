@@ -0,0 +1,511 @@
+#include "gsp_uring.h"
+#include <errno.h>
+
+#ifndef HAVE_IO_URING
+
+int gsp_uring_init(struct gsp_udp *udp)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void gsp_uring_close(struct gsp_udp *udp)
+{
+}
+
+ssize_t gsp_uring_write(struct gsp_udp *udp, const void *buf, size_t len,
+                        size_t seg_size, const struct sockaddr *addr,
+                        socklen_t addr_len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int gsp_uring_loop(struct gsp_udp *udp, int flags)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#else
+
+#include <linux/io_uring.h>
+#include <netinet/udp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define URING_BGID 0
+#define URING_RECV_DATA ((uint64_t)-1) // user_data of the recvmsg
+
+struct uring_send {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage addr;
+	char control[GSP_UDP_CONTROL_LEN];
+	size_t seg_size; // 0 unless sent with UDP_SEGMENT
+	char *buf;
+	int next_free;
+};
+
+struct gsp_uring {
+	int fd;
+
+	// submission queue
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned sq_local_tail; // sqes filled in, published on submit
+	struct io_uring_sqe *sqes;
+
+	// completion queue
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring;
+	size_t ring_len;
+	size_t sqes_len;
+
+	// provided receive buffers
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	char *bufs;
+	size_t buf_len;
+
+	struct msghdr recv_msg;
+	int recv_armed;
+
+	struct uring_send sends[GSP_URING_NR_SENDS];
+	int free_send;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t arg_len)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	               flags, arg, arg_len);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/*
+ * rings
+ */
+
+static int uring_submit(struct gsp_uring *ur, unsigned min_complete,
+                        int64_t timeout_ms)
+{
+	unsigned to_submit = ur->sq_local_tail - *ur->sq_tail;
+	__atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+
+	if (!min_complete) {
+		if (!to_submit)
+			return 0;
+		return sys_io_uring_enter(ur->fd, to_submit, 0, 0, NULL, 0);
+	}
+
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = timeout_ms % 1000 * 1000000,
+	};
+	struct io_uring_getevents_arg arg = {
+		.sigmask = 0,
+		.sigmask_sz = _NSIG / 8,
+		.ts = (uint64_t)(uintptr_t)&ts,
+	};
+
+	int ret = sys_io_uring_enter(ur->fd, to_submit, min_complete,
+	                             IORING_ENTER_GETEVENTS |
+	                             IORING_ENTER_EXT_ARG,
+	                             &arg, sizeof(arg));
+	if (ret < 0 && (errno == ETIME || errno == EINTR))
+		return 0;
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct gsp_uring *ur)
+{
+	unsigned head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ur->sq_local_tail - head >= ur->sq_entries) {
+		if (uring_submit(ur, 0, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+		if (ur->sq_local_tail - head >= ur->sq_entries)
+			return NULL;
+	}
+
+	unsigned index = ur->sq_local_tail & *ur->sq_mask;
+	struct io_uring_sqe *sqe = &ur->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[index] = index;
+	ur->sq_local_tail++;
+	return sqe;
+}
+
+static void uring_recycle_buf(struct gsp_uring *ur, unsigned short bid)
+{
+	unsigned short tail = ur->br->tail;
+	struct io_uring_buf *buf =
+		&ur->br->bufs[tail & (GSP_URING_NR_BUFS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(ur->bufs + bid * ur->buf_len);
+	buf->len = ur->buf_len;
+	buf->bid = bid;
+	__atomic_store_n(&ur->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_arm_recv(struct gsp_uring *ur, int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ur);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)&ur->recv_msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_RECV_DATA;
+
+	ur->recv_armed = 1;
+	return 0;
+}
+
+/*
+ * setup
+ */
+
+static int uring_map(struct gsp_uring *ur, struct io_uring_params *p)
+{
+	size_t sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	size_t cq_len = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	// one mapping for both rings, IORING_FEAT_SINGLE_MMAP is checked
+	ur->ring_len = sq_len > cq_len ? sq_len : cq_len;
+	ur->ring = mmap(NULL, ur->ring_len, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ur->ring == MAP_FAILED) {
+		ur->ring = NULL;
+		return -1;
+	}
+
+	ur->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		return -1;
+	}
+
+	char *ring = ur->ring;
+	ur->sq_head = (unsigned *)(ring + p->sq_off.head);
+	ur->sq_tail = (unsigned *)(ring + p->sq_off.tail);
+	ur->sq_mask = (unsigned *)(ring + p->sq_off.ring_mask);
+	ur->sq_array = (unsigned *)(ring + p->sq_off.array);
+	ur->sq_entries = p->sq_entries;
+	ur->sq_local_tail = *ur->sq_tail;
+
+	ur->cq_head = (unsigned *)(ring + p->cq_off.head);
+	ur->cq_tail = (unsigned *)(ring + p->cq_off.tail);
+	ur->cq_mask = (unsigned *)(ring + p->cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(ring + p->cq_off.cqes);
+
+	return 0;
+}
+
+static int uring_setup_bufs(struct gsp_uring *ur, struct gsp_udp *udp)
+{
+#ifdef UDP_GRO
+	// room for the segment size of a coalesced receive
+	if (udp->gro)
+		ur->recv_msg.msg_controllen = CMSG_SPACE(sizeof(int));
+#endif
+
+	// recvmsg_out header, source address, control data, then the payload
+	ur->buf_len = sizeof(struct io_uring_recvmsg_out) +
+		sizeof(struct sockaddr_storage) + ur->recv_msg.msg_controllen +
+		udp->recv_buf_len;
+	ur->bufs = malloc(ur->buf_len * GSP_URING_NR_BUFS);
+	if (!ur->bufs)
+		return -1;
+
+	ur->br_len = GSP_URING_NR_BUFS * sizeof(struct io_uring_buf);
+	ur->br = mmap(NULL, ur->br_len, PROT_READ | PROT_WRITE,
+	              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ur->br == MAP_FAILED) {
+		ur->br = NULL;
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uint64_t)(uintptr_t)ur->br,
+		.ring_entries = GSP_URING_NR_BUFS,
+		.bgid = URING_BGID,
+	};
+	if (sys_io_uring_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return -1;
+
+	ur->br->tail = 0;
+	for (int i = 0; i < GSP_URING_NR_BUFS; i++)
+		uring_recycle_buf(ur, i);
+
+	ur->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	return 0;
+}
+
+static void uring_free(struct gsp_uring *ur)
+{
+	if (ur->fd >= 0)
+		close(ur->fd);
+	if (ur->ring)
+		munmap(ur->ring, ur->ring_len);
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqes_len);
+	if (ur->br)
+		munmap(ur->br, ur->br_len);
+	free(ur->bufs);
+	for (int i = 0; i < GSP_URING_NR_SENDS; i++)
+		free(ur->sends[i].buf);
+	free(ur);
+}
+
+int gsp_uring_init(struct gsp_udp *udp)
+{
+	struct gsp_uring *ur = calloc(1, sizeof(*ur));
+	if (!ur)
+		return -1;
+
+	struct io_uring_params p = {0};
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = GSP_URING_ENTRIES * 4;
+
+	ur->fd = sys_io_uring_setup(GSP_URING_ENTRIES, &p);
+	if (ur->fd < 0)
+		goto err;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOTSUP;
+		goto err;
+	}
+
+	if (uring_map(ur, &p) || uring_setup_bufs(ur, udp))
+		goto err;
+
+	ur->free_send = 0;
+	for (int i = 0; i < GSP_URING_NR_SENDS; i++) {
+		ur->sends[i].next_free = i + 1 < GSP_URING_NR_SENDS ? i + 1 : -1;
+		ur->sends[i].buf = malloc(udp->recv_buf_len);
+		if (!ur->sends[i].buf)
+			goto err;
+	}
+
+	// a kernel without multishot recvmsg fails it on the first wait
+	if (uring_arm_recv(ur, udp->fd) || uring_submit(ur, 0, 0) < 0)
+		goto err;
+
+	udp->uring = ur;
+	return 0;
+
+err:
+	{
+		int err = errno;
+		uring_free(ur);
+		errno = err;
+	}
+	return -1;
+}
+
+void gsp_uring_close(struct gsp_udp *udp)
+{
+	if (!udp->uring)
+		return;
+
+	uring_free(udp->uring);
+	udp->uring = NULL;
+}
+
+/*
+ * io
+ */
+
+// a send without a slot goes out right away, one datagram at a time
+static ssize_t uring_sendto(int fd, const char *buf, size_t len,
+                            size_t seg_size, const struct sockaddr *addr,
+                            socklen_t addr_len)
+{
+	if (!seg_size)
+		seg_size = len;
+
+	size_t off = 0;
+	do {
+		size_t n = len - off < seg_size ? len - off : seg_size;
+		if (sendto(fd, buf + off, n, 0, addr, addr_len) < 0)
+			return -1;
+		off += n;
+	} while (off < len);
+
+	return len;
+}
+
+ssize_t gsp_uring_write(struct gsp_udp *udp, const void *buf, size_t len,
+                        size_t seg_size, const struct sockaddr *addr,
+                        socklen_t addr_len)
+{
+	struct gsp_uring *ur = udp->uring;
+
+	if (ur->free_send < 0 || len > udp->recv_buf_len ||
+	    addr_len > sizeof(struct sockaddr_storage))
+		return uring_sendto(udp->fd, buf, len, seg_size,
+		                    addr, addr_len);
+
+	struct io_uring_sqe *sqe = uring_get_sqe(ur);
+	if (!sqe)
+		return uring_sendto(udp->fd, buf, len, seg_size,
+		                    addr, addr_len);
+
+	int index = ur->free_send;
+	struct uring_send *send = &ur->sends[index];
+	ur->free_send = send->next_free;
+
+	memcpy(send->buf, buf, len);
+	memcpy(&send->addr, addr, addr_len);
+	send->iov.iov_base = send->buf;
+	send->iov.iov_len = len;
+	memset(&send->msg, 0, sizeof(send->msg));
+	send->msg.msg_name = &send->addr;
+	send->msg.msg_namelen = addr_len;
+	send->msg.msg_iov = &send->iov;
+	send->msg.msg_iovlen = 1;
+
+	send->seg_size = 0;
+#ifdef UDP_SEGMENT
+	if (seg_size && len > seg_size) {
+		send->seg_size = seg_size;
+		send->msg.msg_control = send->control;
+		send->msg.msg_controllen =
+			gsp_udp_put_segment(send->control, seg_size);
+	}
+#endif
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = udp->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+	sqe->len = 1;
+	sqe->user_data = index;
+
+	return len;
+}
+
+static void uring_handle_recv(struct gsp_udp *udp, struct io_uring_cqe *cqe)
+{
+	struct gsp_uring *ur = udp->uring;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ur->recv_armed = 0;
+
+	if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
+
+	unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	char *buf = ur->bufs + bid * ur->buf_len;
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+	char *name = buf + sizeof(*out);
+	char *payload = name + ur->recv_msg.msg_namelen +
+		ur->recv_msg.msg_controllen;
+
+	if (!(out->flags & MSG_TRUNC) && udp->ops.read_cb) {
+		socklen_t name_len = out->namelen;
+		if (name_len > ur->recv_msg.msg_namelen)
+			name_len = ur->recv_msg.msg_namelen;
+
+		size_t seg_size = 0;
+#ifdef UDP_GRO
+		struct msghdr msg = {
+			.msg_control = name + ur->recv_msg.msg_namelen,
+			.msg_controllen = out->controllen,
+		};
+		if (!(out->flags & MSG_CTRUNC))
+			seg_size = gsp_udp_get_segment(&msg);
+#endif
+
+		gsp_udp_deliver(udp, payload, out->payloadlen, seg_size,
+		                (struct sockaddr *)name, name_len);
+	}
+
+	uring_recycle_buf(ur, bid);
+}
+
+static void uring_reap(struct gsp_udp *udp)
+{
+	struct gsp_uring *ur = udp->uring;
+	unsigned head = *ur->cq_head;
+	unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+
+		if (cqe->user_data == URING_RECV_DATA) {
+			uring_handle_recv(udp, cqe);
+		} else if (cqe->user_data < GSP_URING_NR_SENDS) {
+			int index = cqe->user_data;
+			struct uring_send *send = &ur->sends[index];
+
+#ifdef UDP_SEGMENT
+			// refused offload, send the train over without it
+			if (cqe->res < 0 && send->seg_size &&
+			    gsp_udp_gso_refused(-cqe->res)) {
+				udp->gso = 0;
+				uring_sendto(udp->fd, send->buf,
+				             send->iov.iov_len, send->seg_size,
+				             (struct sockaddr *)&send->addr,
+				             send->msg.msg_namelen);
+			}
+#endif
+
+			send->next_free = ur->free_send;
+			ur->free_send = index;
+		}
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int gsp_uring_loop(struct gsp_udp *udp, int flags)
+{
+	struct gsp_uring *ur = udp->uring;
+
+	do {
+		// the sends queued since last time go out with the wait
+		if (uring_submit(ur, 1, 100) < 0)
+			return -1;
+
+		uring_reap(udp);
+
+		// ended on a full buffer ring or an error, start it over
+		if (!ur->recv_armed && uring_arm_recv(ur, udp->fd))
+			return -1;
+
+		if (uring_submit(ur, 0, 0) < 0)
+			return -1;
+	} while (flags == GSP_UDP_LOOP_FOREVER);
+
+	return 0;
+}
+
+#endif
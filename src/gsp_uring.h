@@ -0,0 +1,51 @@
+#ifndef __GSP_URING_H
+#define __GSP_URING_H
+
+#include "gsp_udp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * io_uring backend of gsp_udp, see GSP_UDP_F_URING. Datagrams are received
+ * by one multishot recvmsg into a ring of provided buffers, and writes are
+ * queued as sendmsg requests that go to the kernel in a batch with the next
+ * wait of gsp_udp_loop(). Only built where the kernel headers have buffer
+ * rings (HAVE_IO_URING); gsp_uring_init() fails otherwise, or when the
+ * running kernel lacks what is needed, and gsp_udp keeps recvfrom/sendto.
+ */
+
+#define GSP_URING_ENTRIES 256
+#define GSP_URING_NR_BUFS 32  // receive buffers, power of two
+#define GSP_URING_NR_SENDS 32 // sends in flight, then sendto() directly
+
+int gsp_uring_init(struct gsp_udp *udp);
+void gsp_uring_close(struct gsp_udp *udp);
+ssize_t gsp_uring_write(struct gsp_udp *udp, const void *buf, size_t len,
+                        size_t seg_size, const struct sockaddr *addr,
+                        socklen_t addr_len);
+int gsp_uring_loop(struct gsp_udp *udp, int flags);
+
+/*
+ * Shared by both backends of gsp_udp.c: the UDP_SEGMENT control message of a
+ * send cut into seg_size datagrams, the GRO segment size of a receive, 0 when
+ * it was not coalesced, and the delivery of such a receive datagram by
+ * datagram.
+ */
+
+#define GSP_UDP_CONTROL_LEN 64
+
+struct msghdr;
+
+int gsp_udp_gso_refused(int err);
+size_t gsp_udp_put_segment(void *control, size_t seg_size);
+size_t gsp_udp_get_segment(const struct msghdr *msg);
+void gsp_udp_deliver(struct gsp_udp *udp, const char *buf, size_t len,
+                     size_t seg_size, struct sockaddr *addr,
+                     socklen_t addr_len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
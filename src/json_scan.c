@@ -0,0 +1,365 @@
+#include "json_scan.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct scanner {
+	const char *buf;
+	size_t len;
+	size_t pos;
+	struct json_tok *toks;
+	int nr;
+	int count;
+};
+
+static void skip_ws(struct scanner *s)
+{
+	while (s->pos < s->len) {
+		char c = s->buf[s->pos];
+		if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+			break;
+		s->pos++;
+	}
+}
+
+static int alloc_tok(struct scanner *s, int type, size_t start)
+{
+	if (s->count >= s->nr)
+		return JSON_SCAN_NOMEM;
+
+	struct json_tok *tok = &s->toks[s->count];
+	tok->type = type;
+	tok->start = start;
+	tok->end = start;
+	tok->size = 0;
+	tok->next = s->count + 1;
+	tok->escaped = 0;
+
+	return s->count++;
+}
+
+static int scan_string(struct scanner *s)
+{
+	int idx = alloc_tok(s, JSON_TOK_STRING, ++s->pos);
+	if (idx < 0) return idx;
+
+	for (; s->pos < s->len; s->pos++) {
+		unsigned char c = s->buf[s->pos];
+
+		if (c == '"') {
+			s->toks[idx].end = s->pos++;
+			return idx;
+		} else if (c == '\\') {
+			s->toks[idx].escaped = 1;
+			s->pos++;
+		} else if (c < 0x20) {
+			return JSON_SCAN_ERROR;
+		}
+	}
+
+	return JSON_SCAN_ERROR;
+}
+
+static bool scan_literal(struct scanner *s, const char *lit)
+{
+	size_t len = strlen(lit);
+	if (s->len - s->pos < len || memcmp(s->buf + s->pos, lit, len))
+		return false;
+
+	s->pos += len;
+	return true;
+}
+
+// a run of digits, false when there is none
+static bool scan_digits(struct scanner *s)
+{
+	size_t start = s->pos;
+	while (s->pos < s->len && s->buf[s->pos] >= '0' && s->buf[s->pos] <= '9')
+		s->pos++;
+	return s->pos > start;
+}
+
+static bool scan_next(struct scanner *s, const char *set)
+{
+	if (s->pos >= s->len || !s->buf[s->pos] ||
+	    !strchr(set, s->buf[s->pos]))
+		return false;
+
+	s->pos++;
+	return true;
+}
+
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][-+]?[0-9]+)?
+static bool scan_number(struct scanner *s)
+{
+	scan_next(s, "-");
+	if (!scan_next(s, "0") && !scan_digits(s))
+		return false;
+	if (scan_next(s, ".") && !scan_digits(s))
+		return false;
+	if (scan_next(s, "eE")) {
+		scan_next(s, "-+");
+		if (!scan_digits(s))
+			return false;
+	}
+
+	return true;
+}
+
+static int scan_primitive(struct scanner *s)
+{
+	int idx = alloc_tok(s, JSON_TOK_PRIMITIVE, s->pos);
+	if (idx < 0) return idx;
+
+	bool ok;
+	switch (s->buf[s->pos]) {
+	case 't': ok = scan_literal(s, "true"); break;
+	case 'f': ok = scan_literal(s, "false"); break;
+	case 'n': ok = scan_literal(s, "null"); break;
+	default: ok = scan_number(s); break;
+	}
+
+	// followed by what may follow a value, not by more of it
+	if (!ok || (s->pos < s->len && (!s->buf[s->pos] ||
+	    !strchr(",]}: \t\n\r", s->buf[s->pos]))))
+		return JSON_SCAN_ERROR;
+
+	s->toks[idx].end = s->pos;
+	return idx;
+}
+
+static int scan_value(struct scanner *s, int depth)
+{
+	skip_ws(s);
+	if (s->pos >= s->len)
+		return JSON_SCAN_ERROR;
+
+	char open = s->buf[s->pos];
+	if (open == '"')
+		return scan_string(s);
+	if (open != '{' && open != '[')
+		return scan_primitive(s);
+
+	if (depth >= JSON_SCAN_DEPTH_MAX)
+		return JSON_SCAN_ERROR;
+
+	char close = open == '{' ? '}' : ']';
+	int idx = alloc_tok(s, open == '{' ? JSON_TOK_OBJECT : JSON_TOK_ARRAY,
+	                    s->pos++);
+	if (idx < 0) return idx;
+
+	skip_ws(s);
+	if (s->pos < s->len && s->buf[s->pos] == close) {
+		s->pos++;
+		s->toks[idx].end = s->pos;
+		s->toks[idx].next = s->count;
+		return idx;
+	}
+
+	while (1) {
+		int rc;
+
+		if (open == '{') {
+			skip_ws(s);
+			if (s->pos >= s->len || s->buf[s->pos] != '"')
+				return JSON_SCAN_ERROR;
+			if ((rc = scan_string(s)) < 0)
+				return rc;
+			skip_ws(s);
+			if (s->pos >= s->len || s->buf[s->pos] != ':')
+				return JSON_SCAN_ERROR;
+			s->pos++;
+		}
+
+		if ((rc = scan_value(s, depth + 1)) < 0)
+			return rc;
+		s->toks[idx].size++;
+
+		skip_ws(s);
+		if (s->pos >= s->len)
+			return JSON_SCAN_ERROR;
+
+		char c = s->buf[s->pos++];
+		if (c == close)
+			break;
+		if (c != ',')
+			return JSON_SCAN_ERROR;
+	}
+
+	s->toks[idx].end = s->pos;
+	s->toks[idx].next = s->count;
+	return idx;
+}
+
+int json_scan(const char *buf, size_t len, struct json_tok *toks, int nr)
+{
+	struct scanner s = {
+		.buf = buf,
+		.len = len,
+		.pos = 0,
+		.toks = toks,
+		.nr = nr,
+		.count = 0,
+	};
+
+	int rc = scan_value(&s, 0);
+	if (rc < 0)
+		return rc;
+
+	// trailing whitespace (and padding) is allowed
+	skip_ws(&s);
+	if (s.pos != s.len)
+		return JSON_SCAN_ERROR;
+
+	return s.count;
+}
+
+int json_tok_get(const char *buf, const struct json_tok *toks,
+                 int obj, const char *key)
+{
+	if (toks[obj].type != JSON_TOK_OBJECT)
+		return -1;
+
+	int pos = obj + 1;
+	for (int i = 0; i < toks[obj].size; i++) {
+		if (json_tok_streq(buf, &toks[pos], key))
+			return pos + 1;
+		pos = toks[pos + 1].next;
+	}
+
+	return -1;
+}
+
+bool json_tok_streq(const char *buf, const struct json_tok *tok,
+                    const char *str)
+{
+	size_t len = strlen(str);
+
+	return tok->type == JSON_TOK_STRING && !tok->escaped &&
+		json_tok_len(tok) == len &&
+		memcmp(buf + tok->start, str, len) == 0;
+}
+
+int64_t json_tok_int64(const char *buf, const struct json_tok *tok)
+{
+	if (tok->type != JSON_TOK_PRIMITIVE)
+		return 0;
+
+	const char *pos = buf + tok->start;
+	const char *end = buf + tok->end;
+	int neg = 0;
+	uint64_t value = 0;
+
+	if (pos < end && *pos == '-') {
+		neg = 1;
+		pos++;
+	}
+
+	for (; pos < end && *pos >= '0' && *pos <= '9'; pos++)
+		value = value * 10 + (*pos - '0');
+
+	return neg ? -(int64_t)value : (int64_t)value;
+}
+
+double json_tok_double(const char *buf, const struct json_tok *tok)
+{
+	char tmp[64];
+	size_t len = json_tok_len(tok);
+
+	if (tok->type != JSON_TOK_PRIMITIVE || len >= sizeof(tmp))
+		return 0;
+
+	memcpy(tmp, buf + tok->start, len);
+	tmp[len] = '\0';
+	return strtod(tmp, NULL);
+}
+
+static bool json_tok_is_number(const char *buf, const struct json_tok *tok)
+{
+	char c = buf[tok->start];
+	return tok->type == JSON_TOK_PRIMITIVE &&
+		(c == '-' || (c >= '0' && c <= '9'));
+}
+
+bool json_tok_is_int(const char *buf, const struct json_tok *tok)
+{
+	if (!json_tok_is_number(buf, tok))
+		return false;
+
+	for (int i = tok->start; i < tok->end; i++) {
+		if (buf[i] == '.' || buf[i] == 'e' || buf[i] == 'E')
+			return false;
+	}
+
+	return true;
+}
+
+bool json_tok_is_double(const char *buf, const struct json_tok *tok)
+{
+	return json_tok_is_number(buf, tok) && !json_tok_is_int(buf, tok);
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+char *json_tok_strdup(const char *buf, const struct json_tok *tok)
+{
+	size_t len = json_tok_len(tok);
+	char *retval = malloc(len + 1);
+	if (!retval) return NULL;
+
+	if (!tok->escaped) {
+		memcpy(retval, buf + tok->start, len);
+		retval[len] = '\0';
+		return retval;
+	}
+
+	const char *pos = buf + tok->start;
+	const char *end = buf + tok->end;
+	char *out = retval;
+
+	while (pos < end) {
+		if (*pos != '\\') {
+			*out++ = *pos++;
+			continue;
+		}
+
+		if (++pos == end) break;
+		char c = *pos++;
+
+		if (c == 'b') *out++ = '\b';
+		else if (c == 'f') *out++ = '\f';
+		else if (c == 'n') *out++ = '\n';
+		else if (c == 'r') *out++ = '\r';
+		else if (c == 't') *out++ = '\t';
+		else if (c != 'u') *out++ = c;
+		else {
+			unsigned int cp = 0;
+			for (int i = 0; i < 4 && pos < end; i++) {
+				int v = hex_value(*pos++);
+				cp = (cp << 4) | (v < 0 ? 0 : v);
+			}
+
+			// surrogate pairs are not joined, each half becomes '?'
+			if (cp >= 0xd800 && cp <= 0xdfff) {
+				*out++ = '?';
+			} else if (cp < 0x80) {
+				*out++ = cp;
+			} else if (cp < 0x800) {
+				*out++ = 0xc0 | (cp >> 6);
+				*out++ = 0x80 | (cp & 0x3f);
+			} else {
+				*out++ = 0xe0 | (cp >> 12);
+				*out++ = 0x80 | ((cp >> 6) & 0x3f);
+				*out++ = 0x80 | (cp & 0x3f);
+			}
+		}
+	}
+
+	*out = '\0';
+	return retval;
+}
@@ -0,0 +1,71 @@
+#ifndef __LIB_JSON_SCAN_H
+#define __LIB_JSON_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * json_scan() tokenizes a json text in place: tokens are borrowed views
+ * (offsets) into the caller's buffer and nothing is allocated, so fields of a
+ * packet can be inspected before deciding whether anything must be copied.
+ */
+
+#define JSON_SCAN_ERROR -1
+#define JSON_SCAN_NOMEM -2
+#define JSON_SCAN_DEPTH_MAX 32
+
+enum json_tok_type {
+	JSON_TOK_OBJECT = 1,
+	JSON_TOK_ARRAY,
+	JSON_TOK_STRING,
+	JSON_TOK_PRIMITIVE,
+};
+
+struct json_tok {
+	int type;
+	int start; // strings exclude the quotes, containers include brackets
+	int end;
+	int size; // number of keys of an object or items of an array
+	int next; // index of the token following this one and its children
+	int escaped; // string contains backslash escapes
+};
+
+/*
+ * Returns the number of tokens, JSON_SCAN_ERROR on malformed input or
+ * JSON_SCAN_NOMEM when more than nr tokens are needed.
+ */
+int json_scan(const char *buf, size_t len, struct json_tok *toks, int nr);
+
+int json_tok_get(const char *buf, const struct json_tok *toks,
+                 int obj, const char *key);
+bool json_tok_streq(const char *buf, const struct json_tok *tok,
+                    const char *str);
+int64_t json_tok_int64(const char *buf, const struct json_tok *tok);
+double json_tok_double(const char *buf, const struct json_tok *tok);
+bool json_tok_is_int(const char *buf, const struct json_tok *tok);
+bool json_tok_is_double(const char *buf, const struct json_tok *tok);
+char *json_tok_strdup(const char *buf, const struct json_tok *tok);
+
+static inline int64_t
+json_tok_get_int64(const char *buf, const struct json_tok *toks,
+                   int obj, const char *key)
+{
+	int idx = json_tok_get(buf, toks, obj, key);
+	return idx < 0 ? 0 : json_tok_int64(buf, &toks[idx]);
+}
+
+#define json_tok_len(tok) ((size_t)((tok)->end - (tok)->start))
+
+#define json_tok_array_for_each(pos, toks, arr) \
+	for (int __n = 0, pos = (arr) + 1; __n < (toks)[arr].size; \
+	     __n++, pos = (toks)[pos].next)
+
+#ifdef __cplusplus
+}
+#endif
+#endif
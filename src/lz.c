@@ -0,0 +1,160 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+static inline uint32_t lz_read32(const char *ptr)
+{
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static inline uint32_t lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static void lz_put_len(unsigned char *dst, size_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		dst[(*op)++] = 255;
+	dst[(*op)++] = len;
+}
+
+static int lz_get_len(const unsigned char **ip, const unsigned char *end,
+                      size_t *len)
+{
+	unsigned char c;
+
+	do {
+		if (*ip == end)
+			return -1;
+		c = *(*ip)++;
+		*len += c;
+	} while (c == 255);
+
+	return 0;
+}
+
+/*
+ * sequence: token (literal length << 4 | match length - LZ_MIN_MATCH),
+ * extra literal length, literals, 16-bit offset, extra match length.
+ * The last sequence only carries literals.
+ */
+static int lz_emit(unsigned char *dst, size_t cap, size_t *op,
+                   const char *lit, size_t nr_lit, size_t offset, size_t len)
+{
+	size_t ml = len ? len - LZ_MIN_MATCH : 0;
+
+	if (*op + 1 + nr_lit / 255 + 1 + nr_lit + 2 + ml / 255 + 1 > cap)
+		return -1;
+
+	unsigned char *token = dst + (*op)++;
+	*token = (nr_lit < 15 ? nr_lit : 15) << 4 | (ml < 15 ? ml : 15);
+
+	if (nr_lit >= 15)
+		lz_put_len(dst, op, nr_lit - 15);
+	memcpy(dst + *op, lit, nr_lit);
+	*op += nr_lit;
+
+	if (!len)
+		return 0;
+
+	dst[(*op)++] = offset & 0xff;
+	dst[(*op)++] = offset >> 8;
+	if (ml >= 15)
+		lz_put_len(dst, op, ml - 15);
+
+	return 0;
+}
+
+int lz_compress(const char *buf, size_t dict_len, size_t len,
+                char *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = {0};
+	size_t end = dict_len + len;
+	size_t op = 0;
+
+	for (size_t i = 0; i + LZ_MIN_MATCH <= dict_len; i++)
+		table[lz_hash(lz_read32(buf + i))] = i + 1;
+
+	size_t ip = dict_len;
+	size_t anchor = ip;
+
+	while (ip + LZ_MIN_MATCH <= end) {
+		uint32_t seq = lz_read32(buf + ip);
+		uint32_t hash = lz_hash(seq);
+		size_t ref = table[hash];
+		table[hash] = ip + 1;
+
+		if (!ref || ip - (ref - 1) > LZ_MAX_OFFSET ||
+		    lz_read32(buf + ref - 1) != seq) {
+			ip++;
+			continue;
+		}
+
+		ref--;
+		size_t match = LZ_MIN_MATCH;
+		while (ip + match < end && buf[ref + match] == buf[ip + match])
+			match++;
+
+		if (lz_emit((unsigned char *)dst, cap, &op, buf + anchor,
+		            ip - anchor, ip - ref, match))
+			return -1;
+
+		ip += match;
+		anchor = ip;
+	}
+
+	if (lz_emit((unsigned char *)dst, cap, &op, buf + anchor,
+	            end - anchor, 0, 0))
+		return -1;
+
+	return op;
+}
+
+int lz_decompress(const char *src, size_t len,
+                  char *buf, size_t dict_len, size_t cap)
+{
+	const unsigned char *ip = (const unsigned char *)src;
+	const unsigned char *end = ip + len;
+	size_t op = dict_len;
+
+	// stop once buf is full, whatever pads the block after that
+	while (ip < end && op < cap) {
+		unsigned char token = *ip++;
+
+		size_t nr_lit = token >> 4;
+		if (nr_lit == 15 && lz_get_len(&ip, end, &nr_lit))
+			return -1;
+		if (nr_lit > (size_t)(end - ip) || nr_lit > cap - op)
+			return -1;
+
+		memcpy(buf + op, ip, nr_lit);
+		ip += nr_lit;
+		op += nr_lit;
+
+		if (ip == end || op == cap)
+			break;
+		if (end - ip < 2)
+			return -1;
+
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!offset || offset > op)
+			return -1;
+
+		size_t match = token & 15;
+		if (match == 15 && lz_get_len(&ip, end, &match))
+			return -1;
+		match += LZ_MIN_MATCH;
+		if (match > cap - op)
+			return -1;
+
+		// byte by byte, matches may overlap their own output
+		for (size_t i = 0; i < match; i++, op++)
+			buf[op] = buf[op - offset];
+	}
+
+	return op - dict_len;
+}
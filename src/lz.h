@@ -0,0 +1,33 @@
+#ifndef __LIB_LZ_H
+#define __LIB_LZ_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LZ77 block codec in the spirit of LZ4 with a preset dictionary.
+ *
+ * The dictionary lives right in front of the data in the same buffer, so
+ * matches may reach back into it: lz_compress() reads buf[dict_len, dict_len +
+ * len) and lz_decompress() writes after the dictionary the caller already put
+ * at the start of buf. Both return the output length or -1 when it does not
+ * fit in cap (or, for lz_decompress(), the input is corrupted). Input left
+ * once lz_decompress() has filled cap is ignored, so a block may be padded.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+int lz_compress(const char *buf, size_t dict_len, size_t len,
+                char *dst, size_t cap);
+int lz_decompress(const char *src, size_t len,
+                  char *buf, size_t dict_len, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
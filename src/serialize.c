@@ -1,66 +1,396 @@
 #include "serialize.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+static int ser_item_type(int type)
+{
+	switch (type) {
+	case SER_T_ARRAY_OBJECT: return SER_T_OBJECT;
+	case SER_T_ARRAY_INT: return SER_T_INT;
+	case SER_T_ARRAY_INT64: return SER_T_INT64;
+	case SER_T_ARRAY_DOUBLE: return SER_T_DOUBLE;
+	case SER_T_ARRAY_FLOAT: return SER_T_FLOAT;
+	case SER_T_ARRAY_STRING: return SER_T_STRING;
+	default: return SER_T_NULL;
+	}
+}
+
+static size_t ser_item_size(const struct ser_meta *meta)
+{
+	switch (meta->type) {
+	case SER_T_ARRAY_OBJECT: return meta->size;
+	case SER_T_ARRAY_INT: return sizeof(int);
+	case SER_T_ARRAY_INT64: return sizeof(int64_t);
+	case SER_T_ARRAY_DOUBLE: return sizeof(double);
+	case SER_T_ARRAY_FLOAT: return sizeof(float);
+	case SER_T_ARRAY_STRING: return sizeof(char *);
+	default: return 0;
+	}
+}
+
+static bool ser_is_array(int type)
+{
+	return type >= SER_T_ARRAY_OBJECT && type <= SER_T_ARRAY_STRING;
+}
+
+/*
+ * serialize
+ */
+
+static json_object *
+ser_value(const void *field, int type, const struct ser_meta *child)
+{
+	switch (type) {
+	case SER_T_INT:
+		return json_object_new_int(*(int *)field);
+	case SER_T_INT64:
+		return json_object_new_int64(*(int64_t *)field);
+	case SER_T_FLOAT:
+		return json_object_new_double(*(float *)field);
+	case SER_T_DOUBLE:
+		return json_object_new_double(*(double *)field);
+	case SER_T_STRING:
+		return json_object_new_string(*(char **)field);
+	case SER_T_OBJECT:
+		return serialize(field, child);
+	default:
+		return NULL;
+	}
+}
+
 json_object *serialize(const void *ptr, const struct ser_meta *meta)
 {
 	json_object *root = json_object_new_object();
 
 	for (int i = 0; meta[i].name; i++) {
-		if (meta[i].type == SER_T_INT)
-			JSON_ADD_INT(root, meta[i].name,
-			             SER_GET(ptr, int, meta[i].offset));
-		else if (meta[i].type == SER_T_INT64)
-			JSON_ADD_INT64(root, meta[i].name,
-			               SER_GET(ptr, int64_t, meta[i].offset));
-		else if (meta[i].type == SER_T_FLOAT)
-			JSON_ADD_DOUBLE(root, meta[i].name,
-			                SER_GET(ptr, float, meta[i].offset));
-		else if (meta[i].type == SER_T_DOUBLE)
-			JSON_ADD_DOUBLE(root, meta[i].name,
-			                SER_GET(ptr, double, meta[i].offset));
-		else if (meta[i].type == SER_T_STRING)
-			JSON_ADD_STRING(root, meta[i].name,
-			                SER_GET(ptr, char *, meta[i].offset));
+		const void *field = (char *)ptr + meta[i].offset;
+
+		if (!ser_is_array(meta[i].type)) {
+			json_object *value =
+				ser_value(field, meta[i].type, meta[i].child);
+			if (value)
+				JSON_ADD_OBJECT(root, meta[i].name, value);
+			continue;
+		}
+
+		const struct ser_array *array = field;
+		int type = ser_item_type(meta[i].type);
+		size_t size = ser_item_size(&meta[i]);
+
+		json_object *items = json_object_new_array();
+		for (size_t j = 0; j < array->nr; j++) {
+			json_object_array_add(items, ser_value(
+				(char *)array->items + j * size,
+				type, meta[i].child));
+		}
+		JSON_ADD_OBJECT(root, meta[i].name, items);
 	}
 
 	return root;
 }
 
-int deserialize(void *ptr, const struct ser_meta *meta, const json_object *root)
+/*
+ * deserialize
+ */
+
+static int ser_check_object(const struct ser_meta *meta, json_object *root);
+
+static int ser_check(json_object *obj, int type, const struct ser_meta *child)
 {
-	for (int i = 0; meta[i].name; i++) {
-		json_object *obj = JSON_GET_OBJECT(root, meta[i].name);
-		int type = meta[i].type;
+	if (!obj)
+		return -1;
+
+	if (ser_is_array(type)) {
+		if (!json_object_is_type(obj, json_type_array))
+			return -1;
+
+		int item_type = ser_item_type(type);
+		size_t nr = json_object_array_length(obj);
+		for (size_t i = 0; i < nr; i++) {
+			if (ser_check(json_object_array_get_idx(obj, i),
+			              item_type, child))
+				return -1;
+		}
+		return 0;
+	}
+
+	if (type == SER_T_INT64)
+		type = json_type_int;
+	else if (type == SER_T_FLOAT)
+		type = json_type_double;
+
+	if (!json_object_is_type(obj, type))
+		return -1;
 
-		if (type == SER_T_INT64)
-			type = json_type_int;
-		else if (type == SER_T_FLOAT)
-			type = json_type_double;
-		else if (type >= SER_T_ARRAY_OBJECT &&
-		         type <= SER_T_ARRAY_STRING)
-			type = json_type_array;
+	if (type == SER_T_OBJECT)
+		return ser_check_object(child, obj);
 
-		if (!obj || !json_object_is_type(obj, type))
+	return 0;
+}
+
+static int ser_check_object(const struct ser_meta *meta, json_object *root)
+{
+	for (int i = 0; meta[i].name; i++) {
+		// an array of objects of no size, its meta not built by the macro
+		if (ser_is_array(meta[i].type) && !ser_item_size(&meta[i]))
+			return -1;
+		if (ser_check(JSON_GET_OBJECT(root, meta[i].name),
+		              meta[i].type, meta[i].child))
 			return -1;
 	}
 
+	return 0;
+}
+
+static void ser_load_object(void *ptr, const struct ser_meta *meta,
+                            json_object *root);
+
+static void ser_load(void *field, json_object *obj,
+                     int type, const struct ser_meta *child)
+{
+	if (type == SER_T_INT)
+		*(int *)field = json_object_get_int(obj);
+	else if (type == SER_T_INT64)
+		*(int64_t *)field = json_object_get_int64(obj);
+	else if (type == SER_T_FLOAT)
+		*(float *)field = json_object_get_double(obj);
+	else if (type == SER_T_DOUBLE)
+		*(double *)field = json_object_get_double(obj);
+	else if (type == SER_T_STRING)
+		*(char **)field = strdup(json_object_get_string(obj));
+	else if (type == SER_T_OBJECT)
+		ser_load_object(field, child, obj);
+}
+
+static void ser_load_object(void *ptr, const struct ser_meta *meta,
+                            json_object *root)
+{
 	for (int i = 0; meta[i].name; i++) {
-		if (meta[i].type == SER_T_INT)
-			SER_SET(ptr, int, meta[i].offset,
-			         JSON_GET_INT(root, meta[i].name));
-		else if (meta[i].type == SER_T_INT64)
-			SER_SET(ptr, long long, meta[i].offset,
-			         JSON_GET_INT64(root, meta[i].name));
-		else if (meta[i].type == SER_T_FLOAT)
-			SER_SET(ptr, float, meta[i].offset,
-			         JSON_GET_DOUBLE(root, meta[i].name));
-		else if (meta[i].type == SER_T_DOUBLE)
-			SER_SET(ptr, double, meta[i].offset,
-			         JSON_GET_DOUBLE(root, meta[i].name));
-		else if (meta[i].type == SER_T_STRING)
-			SER_SET(ptr, char *, meta[i].offset,
-			         strdup(JSON_GET_STRING(root, meta[i].name)));
+		void *field = (char *)ptr + meta[i].offset;
+		json_object *obj = JSON_GET_OBJECT(root, meta[i].name);
+
+		if (!ser_is_array(meta[i].type)) {
+			ser_load(field, obj, meta[i].type, meta[i].child);
+			continue;
+		}
+
+		struct ser_array *array = field;
+		int type = ser_item_type(meta[i].type);
+		size_t size = ser_item_size(&meta[i]);
+
+		array->nr = json_object_array_length(obj);
+		array->items = array->nr ? calloc(array->nr, size) : NULL;
+		for (size_t j = 0; j < array->nr; j++) {
+			ser_load((char *)array->items + j * size,
+			         json_object_array_get_idx(obj, j),
+			         type, meta[i].child);
+		}
 	}
+}
+
+int deserialize(void *ptr, const struct ser_meta *meta, const json_object *root)
+{
+	if (ser_check_object(meta, (json_object *)root))
+		return -1;
 
+	ser_load_object(ptr, meta, (json_object *)root);
 	return 0;
 }
+
+void ser_free(void *ptr, const struct ser_meta *meta)
+{
+	for (int i = 0; meta[i].name; i++) {
+		void *field = (char *)ptr + meta[i].offset;
+
+		if (meta[i].type == SER_T_STRING) {
+			free(*(char **)field);
+			*(char **)field = NULL;
+		} else if (meta[i].type == SER_T_OBJECT) {
+			ser_free(field, meta[i].child);
+		} else if (ser_is_array(meta[i].type)) {
+			struct ser_array *array = field;
+			size_t size = ser_item_size(&meta[i]);
+
+			for (size_t j = 0; j < array->nr; j++) {
+				void *item = (char *)array->items + j * size;
+				if (meta[i].type == SER_T_ARRAY_STRING)
+					free(*(char **)item);
+				else if (meta[i].type == SER_T_ARRAY_OBJECT)
+					ser_free(item, meta[i].child);
+			}
+
+			free(array->items);
+			array->items = NULL;
+			array->nr = 0;
+		}
+	}
+}
+
+/*
+ * ser_buf
+ */
+
+void ser_buf_write(struct ser_buf *sb, const void *data, size_t len)
+{
+	if (sb->len + len < sb->size) {
+		memcpy(sb->buf + sb->len, data, len);
+		sb->buf[sb->len + len] = '\0';
+	} else if (sb->len + 1 < sb->size) {
+		memcpy(sb->buf + sb->len, data, sb->size - 1 - sb->len);
+		sb->buf[sb->size - 1] = '\0';
+	}
+
+	sb->len += len;
+}
+
+void ser_buf_putc(struct ser_buf *sb, char c)
+{
+	if (sb->len + 1 < sb->size) {
+		sb->buf[sb->len] = c;
+		sb->buf[sb->len + 1] = '\0';
+	}
+
+	sb->len++;
+}
+
+void ser_buf_puts(struct ser_buf *sb, const char *str)
+{
+	ser_buf_write(sb, str, strlen(str));
+}
+
+void ser_buf_put_string(struct ser_buf *sb, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *start = str;
+
+	ser_buf_putc(sb, '"');
+
+	for (; *str; str++) {
+		unsigned char c = *str;
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		ser_buf_write(sb, start, str - start);
+		start = str + 1;
+
+		char esc[6] = { '\\', c, 0 };
+		if (c == '"' || c == '\\') {
+			ser_buf_write(sb, esc, 2);
+		} else if (c == '\n' || c == '\r' || c == '\t') {
+			esc[1] = c == '\n' ? 'n' : c == '\r' ? 'r' : 't';
+			ser_buf_write(sb, esc, 2);
+		} else {
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			ser_buf_write(sb, esc, 6);
+		}
+	}
+
+	ser_buf_write(sb, start, str - start);
+	ser_buf_putc(sb, '"');
+}
+
+void ser_buf_put_key(struct ser_buf *sb, const char *key)
+{
+	ser_buf_put_string(sb, key);
+	ser_buf_putc(sb, ':');
+}
+
+void ser_buf_put_int64(struct ser_buf *sb, int64_t value)
+{
+	char tmp[24];
+	char *pos = tmp + sizeof(tmp);
+	uint64_t n = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+	do {
+		*--pos = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	if (value < 0)
+		*--pos = '-';
+
+	ser_buf_write(sb, pos, tmp + sizeof(tmp) - pos);
+}
+
+void ser_buf_put_double(struct ser_buf *sb, double value)
+{
+	char tmp[32];
+
+	if (!isfinite(value))
+		value = 0;
+
+	int len = snprintf(tmp, sizeof(tmp), "%.17g", value);
+
+	// keep it a json double rather than an int
+	if (!strpbrk(tmp, ".e")) {
+		tmp[len++] = '.';
+		tmp[len++] = '0';
+	}
+
+	ser_buf_write(sb, tmp, len);
+}
+
+static void ser_buf_put_value(struct ser_buf *sb, const void *field,
+                              int type, const struct ser_meta *child)
+{
+	if (type == SER_T_INT)
+		ser_buf_put_int64(sb, *(int *)field);
+	else if (type == SER_T_INT64)
+		ser_buf_put_int64(sb, *(int64_t *)field);
+	else if (type == SER_T_FLOAT)
+		ser_buf_put_double(sb, *(float *)field);
+	else if (type == SER_T_DOUBLE)
+		ser_buf_put_double(sb, *(double *)field);
+	else if (type == SER_T_STRING)
+		ser_buf_put_string(sb, *(char **)field);
+	else if (type == SER_T_OBJECT)
+		ser_buf_put_object(sb, field, child);
+}
+
+void ser_buf_put_object(struct ser_buf *sb, const void *ptr,
+                        const struct ser_meta *meta)
+{
+	ser_buf_putc(sb, '{');
+
+	for (int i = 0; meta[i].name; i++) {
+		const void *field = (char *)ptr + meta[i].offset;
+
+		if (i) ser_buf_putc(sb, ',');
+		ser_buf_put_key(sb, meta[i].name);
+
+		if (!ser_is_array(meta[i].type)) {
+			ser_buf_put_value(sb, field,
+			                  meta[i].type, meta[i].child);
+			continue;
+		}
+
+		const struct ser_array *array = field;
+		int type = ser_item_type(meta[i].type);
+		size_t size = ser_item_size(&meta[i]);
+
+		ser_buf_putc(sb, '[');
+		for (size_t j = 0; j < array->nr; j++) {
+			if (j) ser_buf_putc(sb, ',');
+			ser_buf_put_value(sb, (char *)array->items + j * size,
+			                  type, meta[i].child);
+		}
+		ser_buf_putc(sb, ']');
+	}
+
+	ser_buf_putc(sb, '}');
+}
+
+size_t ser_dump(const void *ptr, const struct ser_meta *meta,
+                char *buf, size_t size)
+{
+	struct ser_buf sb;
+	ser_buf_init(&sb, buf, size);
+	ser_buf_put_object(&sb, ptr, meta);
+	return sb.len;
+}
@@ -2,6 +2,8 @@
 #define __LIB_SERIALIZE_H
 
 #include "json_helper.h"
+#include "json_scan.h"
+#include <string.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,16 +28,33 @@ enum ser_meta_type {
 	SER_T_ARRAY_STRING,
 };
 
+/*
+ * SER_T_OBJECT describes a struct embedded in the parent, CHILD being its
+ * ser_meta. SER_T_ARRAY_* describe a struct ser_array field whose items are
+ * int, int64_t, double, float, char * or, for SER_T_ARRAY_OBJECT, structs
+ * described by CHILD and declared with INIT_SER_META_ARRAY_OBJECT().
+ */
+struct ser_array {
+	size_t nr;
+	void *items;
+};
+
 struct ser_meta {
 	const char *name;
 	const int type;
 	const struct ser_meta *child;
 	const int offset;
+	const size_t size;
 };
 
+// SER_T_ARRAY_OBJECT fails to compile here, it takes the size of its items
 #define INIT_SER_META(STRUCT_TYPE, NAME, TYPE, CHILD) \
-	{ #NAME, TYPE, CHILD, offsetof(STRUCT_TYPE, NAME) }
-#define INIT_SER_META_NONE() { NULL, 0, NULL, 0 }
+	{ #NAME, TYPE, CHILD, offsetof(STRUCT_TYPE, NAME), \
+	  0 * sizeof(char[(TYPE) == SER_T_ARRAY_OBJECT ? -1 : 1]) }
+#define INIT_SER_META_ARRAY_OBJECT(STRUCT_TYPE, NAME, CHILD, CHILD_TYPE) \
+	{ #NAME, SER_T_ARRAY_OBJECT, CHILD, offsetof(STRUCT_TYPE, NAME), \
+	  sizeof(CHILD_TYPE) }
+#define INIT_SER_META_NONE() { NULL, 0, NULL, 0, 0 }
 
 #define SER_SET(ptr, type, offset, value) \
 do { \
@@ -44,8 +63,157 @@ do { \
 
 #define SER_GET(ptr, type, offset) (*(type*)((char *)ptr + offset))
 
+/*
+ * ser_buf writes JSON text straight into a caller-provided buffer. Like
+ * snprintf(), len keeps counting past size so an overflow can be detected
+ * (len >= size) and the buffer retried with len + 1 bytes.
+ */
+struct ser_buf {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static inline void ser_buf_init(struct ser_buf *sb, char *buf, size_t size)
+{
+	sb->buf = buf;
+	sb->size = size;
+	sb->len = 0;
+	if (size) buf[0] = '\0';
+}
+
+void ser_buf_write(struct ser_buf *sb, const void *data, size_t len);
+void ser_buf_putc(struct ser_buf *sb, char c);
+void ser_buf_puts(struct ser_buf *sb, const char *str);
+void ser_buf_put_string(struct ser_buf *sb, const char *str);
+void ser_buf_put_key(struct ser_buf *sb, const char *key);
+void ser_buf_put_int64(struct ser_buf *sb, int64_t value);
+void ser_buf_put_double(struct ser_buf *sb, double value);
+void ser_buf_put_object(struct ser_buf *sb, const void *ptr,
+                        const struct ser_meta *meta);
+
+/*
+ * Specialized serializers
+ *
+ * The fields of a struct are listed once as an X-macro:
+ *
+ *     #define FOO_SER_FIELDS(X) \
+ *             X(struct foo, id, SER_T_INT, NULL) \
+ *             X(struct foo, name, SER_T_STRING, NULL)
+ *
+ * FOO_SER_FIELDS(SER_META_X) expands to the entries of a ser_meta table for
+ * the generic serialize()/deserialize(), while
+ * DEFINE_SER_FUNCS(foo, struct foo, FOO_SER_FIELDS) emits foo_serialize(),
+ * foo_deserialize(), foo_dump() and foo_scan() (decoding from json_scan()
+ * tokens), which encode and decode every field in
+ * straight-line code: no per-field dispatch on type and a single lookup of
+ * each key. Only scalar and string fields can be generated this way, nested
+ * objects and arrays go through the generic functions.
+ */
+
+#define SER_META_X(STRUCT_TYPE, NAME, TYPE, CHILD) \
+	INIT_SER_META(STRUCT_TYPE, NAME, TYPE, CHILD),
+
+#define SER_ADD_SER_T_INT(root, key, value) JSON_ADD_INT(root, key, value)
+#define SER_ADD_SER_T_INT64(root, key, value) JSON_ADD_INT64(root, key, value)
+#define SER_ADD_SER_T_FLOAT(root, key, value) JSON_ADD_DOUBLE(root, key, value)
+#define SER_ADD_SER_T_DOUBLE(root, key, value) JSON_ADD_DOUBLE(root, key, value)
+#define SER_ADD_SER_T_STRING(root, key, value) JSON_ADD_STRING(root, key, value)
+
+#define SER_CHECK_SER_T_INT(obj) json_object_is_type(obj, json_type_int)
+#define SER_CHECK_SER_T_INT64(obj) json_object_is_type(obj, json_type_int)
+#define SER_CHECK_SER_T_FLOAT(obj) json_object_is_type(obj, json_type_double)
+#define SER_CHECK_SER_T_DOUBLE(obj) json_object_is_type(obj, json_type_double)
+#define SER_CHECK_SER_T_STRING(obj) json_object_is_type(obj, json_type_string)
+
+#define SER_LOAD_SER_T_INT(field, obj) field = json_object_get_int(obj)
+#define SER_LOAD_SER_T_INT64(field, obj) field = json_object_get_int64(obj)
+#define SER_LOAD_SER_T_FLOAT(field, obj) field = json_object_get_double(obj)
+#define SER_LOAD_SER_T_DOUBLE(field, obj) field = json_object_get_double(obj)
+#define SER_LOAD_SER_T_STRING(field, obj) \
+	field = strdup(json_object_get_string(obj))
+
+#define SER_DUMP_SER_T_INT(sb, value) ser_buf_put_int64(sb, value)
+#define SER_DUMP_SER_T_INT64(sb, value) ser_buf_put_int64(sb, value)
+#define SER_DUMP_SER_T_FLOAT(sb, value) ser_buf_put_double(sb, value)
+#define SER_DUMP_SER_T_DOUBLE(sb, value) ser_buf_put_double(sb, value)
+#define SER_DUMP_SER_T_STRING(sb, value) ser_buf_put_string(sb, value)
+
+#define SER_TOKCHECK_SER_T_INT(buf, tok) json_tok_is_int(buf, tok)
+#define SER_TOKCHECK_SER_T_INT64(buf, tok) json_tok_is_int(buf, tok)
+#define SER_TOKCHECK_SER_T_FLOAT(buf, tok) json_tok_is_double(buf, tok)
+#define SER_TOKCHECK_SER_T_DOUBLE(buf, tok) json_tok_is_double(buf, tok)
+#define SER_TOKCHECK_SER_T_STRING(buf, tok) ((tok)->type == JSON_TOK_STRING)
+
+#define SER_TOKLOAD_SER_T_INT(field, buf, tok) field = json_tok_int64(buf, tok)
+#define SER_TOKLOAD_SER_T_INT64(field, buf, tok) field = json_tok_int64(buf, tok)
+#define SER_TOKLOAD_SER_T_FLOAT(field, buf, tok) \
+	field = json_tok_double(buf, tok)
+#define SER_TOKLOAD_SER_T_DOUBLE(field, buf, tok) \
+	field = json_tok_double(buf, tok)
+#define SER_TOKLOAD_SER_T_STRING(field, buf, tok) \
+	field = json_tok_strdup(buf, tok)
+
+#define __SER_ENCODE_X(STRUCT_TYPE, NAME, TYPE, CHILD) \
+	SER_ADD_##TYPE(root, #NAME, ptr->NAME);
+#define __SER_LOOKUP_X(STRUCT_TYPE, NAME, TYPE, CHILD) \
+	json_object *__ser_##NAME = json_object_object_get(root, #NAME); \
+	if (!__ser_##NAME || !SER_CHECK_##TYPE(__ser_##NAME)) \
+		return -1;
+#define __SER_DECODE_X(STRUCT_TYPE, NAME, TYPE, CHILD) \
+	SER_LOAD_##TYPE(ptr->NAME, __ser_##NAME);
+
+#define __SER_DUMP_X(STRUCT_TYPE, NAME, TYPE, CHILD) \
+	if (!__ser_first) ser_buf_putc(sb, ','); \
+	__ser_first = 0; \
+	ser_buf_put_key(sb, #NAME); \
+	SER_DUMP_##TYPE(sb, ptr->NAME);
+
+#define __SER_TOKLOOKUP_X(STRUCT_TYPE, NAME, TYPE, CHILD) \
+	int __ser_##NAME = json_tok_get(buf, toks, obj, #NAME); \
+	if (__ser_##NAME < 0 || \
+	    !SER_TOKCHECK_##TYPE(buf, &toks[__ser_##NAME])) \
+		return -1;
+#define __SER_TOKDECODE_X(STRUCT_TYPE, NAME, TYPE, CHILD) \
+	SER_TOKLOAD_##TYPE(ptr->NAME, buf, &toks[__ser_##NAME]);
+
+#define DEFINE_SER_FUNCS(PREFIX, STRUCT_TYPE, FIELDS) \
+static inline json_object *PREFIX##_serialize(const STRUCT_TYPE *ptr) \
+{ \
+	json_object *root = json_object_new_object(); \
+	FIELDS(__SER_ENCODE_X) \
+	return root; \
+} \
+\
+static inline int \
+PREFIX##_deserialize(STRUCT_TYPE *ptr, const json_object *root) \
+{ \
+	FIELDS(__SER_LOOKUP_X) \
+	FIELDS(__SER_DECODE_X) \
+	return 0; \
+} \
+\
+static inline void PREFIX##_dump(const STRUCT_TYPE *ptr, struct ser_buf *sb) \
+{ \
+	int __ser_first = 1; \
+	ser_buf_putc(sb, '{'); \
+	FIELDS(__SER_DUMP_X) \
+	ser_buf_putc(sb, '}'); \
+} \
+\
+static inline int PREFIX##_scan(STRUCT_TYPE *ptr, const char *buf, \
+                                const struct json_tok *toks, int obj) \
+{ \
+	FIELDS(__SER_TOKLOOKUP_X) \
+	FIELDS(__SER_TOKDECODE_X) \
+	return 0; \
+}
+
 json_object *serialize(const void *ptr, const struct ser_meta *meta);
 int deserialize(void *ptr, const struct ser_meta *meta, const json_object *root);
+void ser_free(void *ptr, const struct ser_meta *meta);
+size_t ser_dump(const void *ptr, const struct ser_meta *meta,
+                char *buf, size_t size);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,413 @@
+/*
+ * Discrete-event cluster simulator.
+ *
+ * Runs N gossip instances in one process over a gsp_mem network, on a
+ * virtual clock that advances half a GOSSIP_STALL per round, so a cluster
+ * of any size steps through the same rounds a real one would without
+ * waiting for them. Instances sync at every round, unless -a leaves them
+ * their adaptive interval; a round is then a second. Every instance keeps
+ * the whole membership, so memory grows as O(N^2): a few thousand nodes is
+ * comfortable, 100k is not, unless -z spreads them over zones or -v keeps
+ * partial views.
+ *
+ * Reports rounds until every instance knows every node, rounds until a
+ * version bump on one node reaches all of them, pushed with
+ * gossip_publish_self() under -p, then idle rounds with nothing to exchange,
+ * then rounds until -b messages of gossip_broadcast() reach every node;
+ * packets and bytes sent per node per round, and CPU time per round.
+ */
+
+#include "gossip.h"
+#include "gsp_mem.h"
+#include "gossip_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t sim_time;
+static int sim_step = GOSSIP_STALL >> 1;
+
+static int64_t sim_clock(void)
+{
+	return sim_time;
+}
+
+struct sim_node {
+	struct gossip gsp;
+	struct gsp_mem mem;
+	char ipaddr[32];
+};
+
+static struct gsp_mem_net net;
+static struct sim_node *nodes;
+static int nr_nodes;
+static int nr_zones; // node i is in zone i % nr_zones, none if 0
+static int passive_view; // partial views if set
+static int64_t nr_delivered; // broadcast messages, all nodes together
+
+static void sim_ipaddr(int i, char *buf, size_t size)
+{
+	snprintf(buf, size, "10.%d.%d.%d",
+	         (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+}
+
+static void sim_deliver(struct gossip *gsp, const char *origin,
+                        const char *msg, void *user_data)
+{
+	nr_delivered++;
+}
+
+static int sim_init(int nr_seeds, int sync_count, int adaptive)
+{
+	char pubkey[64];
+	char seeds[4096] = "";
+	size_t len = 0;
+
+	for (int i = 0; i < nr_seeds && i < nr_nodes; i++) {
+		char ipaddr[32];
+		sim_ipaddr(i, ipaddr, sizeof(ipaddr));
+		len += snprintf(seeds + len, sizeof(seeds) - len, "%s%s:%d",
+		                i ? "," : "", ipaddr, GOSSIP_DEFAULT_PORT);
+		if (len >= sizeof(seeds)) {
+			fprintf(stderr, "too many seeds\n");
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < nr_nodes; i++) {
+		struct sim_node *node = &nodes[i];
+		sim_ipaddr(i, node->ipaddr, sizeof(node->ipaddr));
+
+		if (gsp_mem_init(&node->mem, &net, node->ipaddr,
+		                 GOSSIP_DEFAULT_PORT))
+			return -1;
+
+		snprintf(pubkey, sizeof(pubkey), "sim-node-%d", i);
+		struct gossip_node *gnode = make_gossip_node(pubkey);
+		if (!gnode) return -1;
+		JSON_ADD_INT(gossip_node_get_data(gnode), "id", i);
+		gnode->version++;
+		gossip_node_set_full(gnode, node->ipaddr, GOSSIP_DEFAULT_PORT);
+		if (nr_zones) {
+			char zone[32];
+			snprintf(zone, sizeof(zone), "zone-%d", i % nr_zones);
+			gossip_node_set_zone(gnode, zone);
+		}
+
+		if (gossip_init_transport(&node->gsp, gnode, &node->mem.tp))
+			return -1;
+		node->gsp.sync_count = sync_count;
+		gossip_set_bcast_cb(&node->gsp, sim_deliver, NULL);
+		if (passive_view)
+			gossip_set_partial_view(&node->gsp, 0, passive_view);
+		if (!adaptive) {
+			node->gsp.interval_min = sim_step;
+			node->gsp.interval_max = sim_step;
+		}
+		gossip_add_seeds(&node->gsp, seeds);
+	}
+
+	return 0;
+}
+
+static void sim_close(void)
+{
+	for (int i = 0; i < nr_nodes; i++)
+		gossip_close(&nodes[i].gsp);
+}
+
+// one round: every instance syncs once, then the network drains
+static void sim_round(void)
+{
+	sim_time += sim_step;
+
+	for (int i = 0; i < nr_nodes; i++)
+		gossip_loop_once(&nodes[i].gsp);
+
+	while (net.nr_queued) {
+		for (int i = 0; i < nr_nodes; i++) {
+			if (nodes[i].mem.nr_queued)
+				gsp_transport_loop(&nodes[i].mem.tp,
+				                   GSP_TRANSPORT_LOOP_ONCE);
+		}
+	}
+}
+
+static int zone_size(int zone)
+{
+	return nr_nodes / nr_zones + (zone < nr_nodes % nr_zones);
+}
+
+// all of its zone and zone_reps nodes of each other one
+static int sim_membership_size(int i)
+{
+	if (!nr_zones)
+		return nr_nodes;
+
+	int size = zone_size(i % nr_zones);
+	for (int z = 0; z < nr_zones; z++) {
+		int reps = zone_size(z);
+		if (reps > nodes[i].gsp.zone_reps)
+			reps = nodes[i].gsp.zone_reps;
+		if (z != i % nr_zones)
+			size += reps;
+	}
+	return size;
+}
+
+// as many as the views hold, with self
+static int sim_view_size(int i)
+{
+	int size = sim_membership_size(i);
+	struct gossip *gsp = &nodes[i].gsp;
+
+	if (passive_view && size > 1 + gsp->active_view + gsp->passive_view)
+		size = 1 + gsp->active_view + gsp->passive_view;
+	return size;
+}
+
+static int sim_membership_converged(void)
+{
+	for (int i = 0; i < nr_nodes; i++) {
+		if (nodes[i].gsp.nr_gnodes != sim_view_size(i))
+			return 0;
+	}
+	return 1;
+}
+
+// of the nodes of the same zone, when there are zones, and of those holding
+// the node in their views, when views are partial
+static int sim_version_converged(int n, const char *pubid, int64_t version)
+{
+	int nr_holders = 0;
+
+	for (int i = 0; i < nr_nodes; i++) {
+		if (nr_zones && i % nr_zones != n % nr_zones)
+			continue;
+
+		struct gossip_node *gnode =
+			gossip_find_node(&nodes[i].gsp, pubid);
+		if (!gnode && passive_view)
+			continue;
+		if (!gnode || gnode->version < version)
+			return 0;
+		nr_holders++;
+	}
+	return nr_holders > 1;
+}
+
+struct sim_stats {
+	int rounds;
+	int64_t packets;
+	int64_t bytes;
+	clock_t cpu;
+};
+
+static void sim_stats_begin(struct sim_stats *st)
+{
+	st->rounds = 0;
+	st->packets = 0;
+	st->bytes = 0;
+	for (int i = 0; i < nr_nodes; i++) {
+		st->packets -= nodes[i].mem.tx_packets;
+		st->bytes -= nodes[i].mem.tx_bytes;
+	}
+	st->cpu = clock();
+}
+
+static void sim_stats_end(struct sim_stats *st)
+{
+	st->cpu = clock() - st->cpu;
+	for (int i = 0; i < nr_nodes; i++) {
+		st->packets += nodes[i].mem.tx_packets;
+		st->bytes += nodes[i].mem.tx_bytes;
+	}
+}
+
+static void sim_stats_print(const char *name, struct sim_stats *st,
+                            int converged)
+{
+	int rounds = st->rounds ? st->rounds : 1;
+
+	printf("%s: %s after %d rounds\n", name,
+	       converged ? "converged" : "NOT converged", st->rounds);
+	printf("  packets/node/round: %.2f\n",
+	       (double)st->packets / nr_nodes / rounds);
+	printf("  bytes/node/round:   %.1f\n",
+	       (double)st->bytes / nr_nodes / rounds);
+	printf("  cpu ms/round:       %.3f\n",
+	       st->cpu * 1000.0 / CLOCKS_PER_SEC / rounds);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-n nodes] [-s seeds] [-l loss] [-c sync_count]"
+	        " [-r max_rounds] [-i idle_rounds]\n"
+	        "           [-S rand_seed] [-t trace.json] [-z zones]"
+	        " [-v passive_view] [-b broadcasts]\n"
+	        "           [-p] [-a]\n",
+	        prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_seeds = 1;
+	double loss = 0;
+	int sync_count = GOSSIP_DEFAULT_SYNC_COUNT;
+	int max_rounds = 1000;
+	int idle_rounds = 60;
+	unsigned int seed = 1;
+	const char *trace_path = NULL;
+	int publish = 0;
+	int adaptive = 0;
+	int nr_bcasts = 0;
+	int opt;
+
+	nr_nodes = 100;
+
+	while ((opt = getopt(argc, argv, "n:s:l:c:r:i:S:t:z:v:b:pah")) != -1) {
+		switch (opt) {
+		case 'n': nr_nodes = atoi(optarg); break;
+		case 's': nr_seeds = atoi(optarg); break;
+		case 'l': loss = atof(optarg); break;
+		case 'c': sync_count = atoi(optarg); break;
+		case 'r': max_rounds = atoi(optarg); break;
+		case 'i': idle_rounds = atoi(optarg); break;
+		case 'S': seed = strtoul(optarg, NULL, 10); break;
+		case 't': trace_path = optarg; break;
+		case 'z': nr_zones = atoi(optarg); break;
+		case 'v': passive_view = atoi(optarg); break;
+		case 'b': nr_bcasts = atoi(optarg); break;
+		case 'p': publish = 1; break;
+		case 'a': adaptive = 1; sim_step = 1; break;
+		default: usage(argv[0]); return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	if (nr_nodes <= 0 || nr_nodes > (1 << 24) || nr_seeds <= 0 ||
+	    sync_count <= 0 || loss < 0 || loss >= 1 || nr_zones < 0 ||
+	    nr_zones > GOSSIP_MAX_ZONES || passive_view < 0 ||
+	    nr_bcasts < 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	sim_time = time(NULL);
+	gossip_set_clock(sim_clock);
+
+	if (gsp_mem_net_init(&net))
+		return -1;
+	net.loss_rate = loss;
+	net.seed = seed;
+
+	nodes = calloc(nr_nodes, sizeof(*nodes));
+	if (!nodes || sim_init(nr_seeds, sync_count, adaptive)) {
+		fprintf(stderr, "failed to set up %d nodes\n", nr_nodes);
+		return -1;
+	}
+
+	printf("nodes: %d, seeds: %d, loss: %.3f, sync_count: %d, "
+	       "round: %ds, zones: %d, passive view: %d\n", nr_nodes, nr_seeds,
+	       loss, sync_count, sim_step, nr_zones, passive_view);
+
+	struct sim_stats st;
+	int converged = 0;
+
+	sim_stats_begin(&st);
+	while (!converged && st.rounds < max_rounds) {
+		sim_round();
+		st.rounds++;
+		converged = sim_membership_converged();
+	}
+	sim_stats_end(&st);
+	sim_stats_print("membership", &st, converged);
+
+	if (converged) {
+		struct gossip_node *self = nodes[nr_nodes - 1].gsp.self;
+		self->version++;
+		self->update_time = gossip_now();
+		if (publish)
+			gossip_publish_self(&nodes[nr_nodes - 1].gsp);
+
+		converged = 0;
+		sim_stats_begin(&st);
+		while (!converged && st.rounds < max_rounds) {
+			sim_round();
+			st.rounds++;
+			converged = sim_version_converged(nr_nodes - 1,
+			                                  self->pubid,
+			                                  self->version);
+		}
+		sim_stats_end(&st);
+		sim_stats_print("update", &st, converged);
+	}
+
+	// the cost of a cluster with nothing to exchange
+	if (converged) {
+		sim_stats_begin(&st);
+		while (st.rounds < idle_rounds) {
+			sim_round();
+			st.rounds++;
+		}
+		sim_stats_end(&st);
+		sim_stats_print("idle", &st, converged);
+	}
+
+	// one message a round from a random node, then until all arrive
+	if (converged && nr_bcasts) {
+		int64_t tx[GOSSIP_NR_PHASES] = { 0 };
+		for (int i = 0; i < nr_nodes; i++) {
+			for (int p = 0; p < GOSSIP_NR_PHASES; p++)
+				tx[p] -= nodes[i].gsp.stats.tx_packets[p];
+		}
+
+		int64_t nr_expected = (int64_t)nr_bcasts * (nr_nodes - 1);
+		nr_delivered = 0;
+		sim_stats_begin(&st);
+		while (nr_delivered < nr_expected && st.rounds < max_rounds) {
+			if (st.rounds < nr_bcasts) {
+				char msg[32];
+				snprintf(msg, sizeof(msg), "sim-event-%d",
+				         st.rounds);
+				gossip_broadcast(&nodes[rand() % nr_nodes].gsp,
+				                 msg);
+			}
+			sim_round();
+			st.rounds++;
+		}
+		sim_stats_end(&st);
+		converged = nr_delivered == nr_expected;
+		sim_stats_print("broadcast", &st, converged);
+
+		for (int i = 0; i < nr_nodes; i++) {
+			for (int p = 0; p < GOSSIP_NR_PHASES; p++)
+				tx[p] += nodes[i].gsp.stats.tx_packets[p];
+		}
+		printf("  delivered:          %lld/%lld\n",
+		       (long long)nr_delivered, (long long)nr_expected);
+		printf("  per message:        %.1f bcast, %.1f ihave, "
+		       "%.1f graft, %.1f prune\n",
+		       (double)tx[GOSSIP_PHASE_BCAST] / nr_bcasts,
+		       (double)tx[GOSSIP_PHASE_IHAVE] / nr_bcasts,
+		       (double)tx[GOSSIP_PHASE_GRAFT] / nr_bcasts,
+		       (double)tx[GOSSIP_PHASE_PRUNE] / nr_bcasts);
+	}
+
+	int64_t nr_known = 0;
+	for (int i = 0; i < nr_nodes; i++)
+		nr_known += nodes[i].gsp.nr_gnodes;
+	printf("nodes known per node: %.1f\n", (double)nr_known / nr_nodes);
+	printf("dropped packets: %lld\n", (long long)net.nr_dropped);
+
+	if (trace_path && gossip_trace_dump(trace_path))
+		fprintf(stderr, "no trace written, see WITH_TRACE\n");
+
+	sim_close();
+	free(nodes);
+	gsp_mem_net_close(&net);
+
+	return converged ? 0 : 1;
+}
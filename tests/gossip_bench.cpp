@@ -0,0 +1,341 @@
+#include <benchmark/benchmark.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include "gossip.h"
+#include "serialize.h"
+
+/*
+ * Allocation counting: every malloc family call of the process, libgossip
+ * and json-c included, goes through these wrappers.
+ */
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static int64_t nr_allocs;
+
+void *malloc(size_t size)
+{
+	nr_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	nr_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	nr_allocs++;
+	return __libc_realloc(ptr, size);
+}
+}
+
+/*
+ * A transport that keeps the last datagram written instead of sending it,
+ * so packets can be captured and fed back to read_cb.
+ */
+
+struct capture {
+	struct gsp_transport tp;
+	std::string last;
+};
+
+static ssize_t capture_write(struct gsp_transport *tp, const void *buf,
+                             size_t len, const struct sockaddr *addr,
+                             socklen_t addr_len)
+{
+	((struct capture *)tp)->last.assign((const char *)buf, len);
+	return len;
+}
+
+static int capture_loop(struct gsp_transport *tp, int flags)
+{
+	return 0;
+}
+
+static int capture_close(struct gsp_transport *tp)
+{
+	return 0;
+}
+
+static const struct gsp_transport_operations capture_ops = {
+	capture_write, capture_loop, capture_close,
+};
+
+/*
+ * A cluster of two instances, x and y, both knowing the same nr members;
+ * x has every member at version 2, y at version 1, so a sync of y draws
+ * full entries out of x.
+ */
+
+struct cluster {
+	struct capture xcap, ycap;
+	struct gossip x, y;
+	std::string sync, ack1, ack2;
+	std::string pubid;
+};
+
+static struct sockaddr_in peer_addr;
+
+static std::string make_members(int nr, int version)
+{
+	std::string buf = "{\"phase\":2,\"gnodes\":[";
+	char pubkey[64], ipaddr[32];
+
+	for (int i = 0; i < nr; i++) {
+		snprintf(pubkey, sizeof(pubkey), "bench-node-%d", i);
+		snprintf(ipaddr, sizeof(ipaddr), "10.%d.%d.%d",
+		         (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+
+		struct gossip_node *gnode = make_gossip_node(pubkey);
+		gossip_node_set_full(gnode, ipaddr, GOSSIP_DEFAULT_PORT);
+		JSON_ADD_INT(gossip_node_get_data(gnode), "id", i);
+		gnode->version = version;
+
+		json_object *root = gossip_node_to_json(gnode);
+		if (i) buf += ',';
+		buf += json_object_to_json_string_ext(root,
+			JSON_C_TO_STRING_PLAIN);
+		json_object_put(root);
+		free_gossip_node(gnode);
+	}
+
+	return buf + "]}";
+}
+
+static void feed(struct gossip *gsp, const std::string &pkt)
+{
+	gsp->tp->read_cb(gsp->tp, pkt.data(), pkt.size(),
+	                 (struct sockaddr *)&peer_addr, sizeof(peer_addr));
+}
+
+static void init_instance(struct gossip *gsp, struct capture *cap,
+                          const char *pubkey, const std::string &members)
+{
+	cap->tp.ops = &capture_ops;
+
+	struct gossip_node *gnode = make_gossip_node(pubkey);
+	gossip_node_set_full(gnode, "127.0.0.1", GOSSIP_DEFAULT_PORT);
+	gnode->version++;
+
+	gossip_init_transport(gsp, gnode, &cap->tp);
+	gsp->segment_len = 0; // replies in one datagram, captured whole
+	feed(gsp, members);
+}
+
+static struct cluster *get_cluster(int nr)
+{
+	static std::map<int, struct cluster *> clusters;
+
+	struct cluster *&cl = clusters[nr];
+	if (cl) return cl;
+
+	peer_addr.sin_family = AF_INET;
+	peer_addr.sin_port = htons(GOSSIP_DEFAULT_PORT);
+	peer_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	cl = new cluster();
+	init_instance(&cl->x, &cl->xcap, "bench-x", make_members(nr, 2));
+	init_instance(&cl->y, &cl->ycap, "bench-y", make_members(nr, 1));
+
+	cl->y.last_sync_time = 0;
+	gossip_loop_once(&cl->y);
+	cl->sync = cl->ycap.last;
+
+	feed(&cl->x, cl->sync);
+	cl->ack1 = cl->xcap.last;
+
+	feed(&cl->y, cl->ack1);
+	cl->ack2 = cl->ycap.last;
+
+	char pubkey[64];
+	snprintf(pubkey, sizeof(pubkey), "bench-node-%d", nr / 2);
+	struct gossip_node *gnode = make_gossip_node(pubkey);
+	cl->pubid = gnode->pubid;
+	free_gossip_node(gnode);
+
+	return cl;
+}
+
+static void report(benchmark::State &state, int64_t allocs)
+{
+	state.counters["allocs"] = benchmark::Counter(
+		allocs, benchmark::Counter::kAvgIterations);
+}
+
+#define MEMBERSHIP_SIZES RangeMultiplier(10)->Range(10, 100000)
+
+/*
+ * packets
+ */
+
+static void BM_make_packet_sync(benchmark::State &state)
+{
+	struct cluster *cl = get_cluster(state.range(0));
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state) {
+		cl->y.last_sync_time = 0;
+		gossip_loop_once(&cl->y);
+	}
+
+	report(state, nr_allocs - allocs);
+	state.counters["bytes"] = cl->ycap.last.size();
+}
+BENCHMARK(BM_make_packet_sync)->MEMBERSHIP_SIZES;
+
+static void BM_handle_packet_sync(benchmark::State &state)
+{
+	struct cluster *cl = get_cluster(state.range(0));
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		feed(&cl->x, cl->sync);
+
+	report(state, nr_allocs - allocs);
+	state.counters["bytes"] = cl->sync.size();
+}
+BENCHMARK(BM_handle_packet_sync)->MEMBERSHIP_SIZES;
+
+static void BM_handle_packet_ack1(benchmark::State &state)
+{
+	struct cluster *cl = get_cluster(state.range(0));
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		feed(&cl->y, cl->ack1);
+
+	report(state, nr_allocs - allocs);
+	state.counters["bytes"] = cl->ack1.size();
+}
+BENCHMARK(BM_handle_packet_ack1)->MEMBERSHIP_SIZES;
+
+static void BM_handle_packet_ack2(benchmark::State &state)
+{
+	struct cluster *cl = get_cluster(state.range(0));
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		feed(&cl->x, cl->ack2);
+
+	report(state, nr_allocs - allocs);
+	state.counters["bytes"] = cl->ack2.size();
+}
+BENCHMARK(BM_handle_packet_ack2)->MEMBERSHIP_SIZES;
+
+/*
+ * membership
+ */
+
+static void BM_find_gossip_node(benchmark::State &state)
+{
+	struct cluster *cl = get_cluster(state.range(0));
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(
+			gossip_find_node(&cl->x, cl->pubid.c_str()));
+
+	report(state, nr_allocs - allocs);
+}
+BENCHMARK(BM_find_gossip_node)->MEMBERSHIP_SIZES;
+
+/*
+ * node encoding
+ */
+
+static struct gossip_node *make_bench_node(void)
+{
+	struct gossip_node *gnode = make_gossip_node("bench-node");
+	gossip_node_set_full(gnode, "10.0.0.1", GOSSIP_DEFAULT_PORT);
+	JSON_ADD_STRING(gossip_node_get_data(gnode), "name", "bench-node");
+	JSON_ADD_INT(gossip_node_get_data(gnode), "weight", 100);
+	gnode->version++;
+	return gnode;
+}
+
+static void BM_gossip_node_to_json(benchmark::State &state)
+{
+	struct gossip_node *gnode = make_bench_node();
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		json_object_put(gossip_node_to_json(gnode));
+
+	report(state, nr_allocs - allocs);
+	free_gossip_node(gnode);
+}
+BENCHMARK(BM_gossip_node_to_json);
+
+static void BM_gossip_node_from_json(benchmark::State &state)
+{
+	struct gossip_node *gnode = make_bench_node();
+	json_object *root = gossip_node_to_json(gnode);
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		free_gossip_node(gossip_node_from_json(root));
+
+	report(state, nr_allocs - allocs);
+	json_object_put(root);
+	free_gossip_node(gnode);
+}
+BENCHMARK(BM_gossip_node_from_json);
+
+static void BM_serialize(benchmark::State &state)
+{
+	struct gossip_node *gnode = make_bench_node();
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		json_object_put(serialize(gnode, gossip_node_meta));
+
+	report(state, nr_allocs - allocs);
+	free_gossip_node(gnode);
+}
+BENCHMARK(BM_serialize);
+
+static void BM_deserialize(benchmark::State &state)
+{
+	struct gossip_node *gnode = make_bench_node();
+	json_object *root = serialize(gnode, gossip_node_meta);
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state) {
+		struct gossip_node tmp;
+		memset(&tmp, 0, sizeof(tmp));
+		deserialize(&tmp, gossip_node_meta, root);
+		ser_free(&tmp, gossip_node_meta);
+	}
+
+	report(state, nr_allocs - allocs);
+	json_object_put(root);
+	free_gossip_node(gnode);
+}
+BENCHMARK(BM_deserialize);
+
+static void BM_ser_dump(benchmark::State &state)
+{
+	struct gossip_node *gnode = make_bench_node();
+	char buf[1024];
+	int64_t allocs = nr_allocs;
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(
+			ser_dump(gnode, gossip_node_meta, buf, sizeof(buf)));
+
+	report(state, nr_allocs - allocs);
+	free_gossip_node(gnode);
+}
+BENCHMARK(BM_ser_dump);
+
+BENCHMARK_MAIN();
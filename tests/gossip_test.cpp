@@ -2,7 +2,15 @@
 #include <assert.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
 #include "gossip.h"
+#include "gossip_engine.h"
+#include "gossip_seen.h"
+#include "gossip_trace.h"
+#include "gsp_mem.h"
 
 static int exit_flag;
 
@@ -11,7 +19,7 @@ static void *gossip_thread1(void *)
 	struct gossip gsp = {0};
 	struct gossip_node *gnode = make_gossip_node("seed-node-key");
 	gossip_node_set_full(gnode, "127.0.0.1", 25688);
-	JSON_ADD_STRING(gnode->data, "name", "seed-node");
+	JSON_ADD_STRING(gossip_node_get_data(gnode), "name", "seed-node");
 	gnode->version++;
 	gnode->update_time = time(NULL);
 
@@ -28,7 +36,7 @@ static void *gossip_thread2(void *)
 {
 	struct gossip gsp = {0};
 	struct gossip_node *gnode = make_gossip_node("client-key");
-	JSON_ADD_STRING(gnode->data, "name", "client");
+	JSON_ADD_STRING(gossip_node_get_data(gnode), "name", "client");
 	gnode->version++;
 	gnode->update_time = time(NULL);
 
@@ -39,6 +47,14 @@ static void *gossip_thread2(void *)
 	assert(strcmp(gsp.seeds[1], "127.0.0.1:25699") == 0);
 
 	while (!exit_flag) gossip_loop_once(&gsp);
+
+	struct gossip_node *pos, *seed = NULL;
+	list_for_each_entry(pos, &gsp.gnodes, node) {
+		if (pos != gsp.self) seed = pos;
+	}
+	assert(seed && seed->version == 1);
+	assert(strcmp(JSON_GET_STRING(gossip_node_get_data(seed), "name"),
+	              "seed-node") == 0);
 	gossip_close(&gsp);
 
 	assert(gsp.nr_gnodes == 2);
@@ -59,3 +75,1321 @@ TEST(gossip, basic)
 	pthread_join(gsp1, NULL);
 	pthread_join(gsp2, NULL);
 }
+
+TEST(gossip, loopback)
+{
+	struct gsp_mem_net net;
+	ASSERT_EQ(gsp_mem_net_init(&net), 0);
+
+	struct gsp_mem seed_tp, client_tp, dup_tp;
+	ASSERT_EQ(gsp_mem_init(&seed_tp, &net, "127.0.0.1", 25688), 0);
+	ASSERT_EQ(gsp_mem_init(&client_tp, &net, "127.0.0.1", 25689), 0);
+	ASSERT_EQ(gsp_mem_init(&dup_tp, &net, "127.0.0.1", 25689), -1);
+
+	struct gossip seed = {0}, client = {0};
+	struct gossip_node *seed_node = make_gossip_node("seed-node-key");
+	gossip_node_set_full(seed_node, "127.0.0.1", 25688);
+	ASSERT_EQ(gossip_init_transport(&seed, seed_node, &seed_tp.tp), 0);
+
+	struct gossip_node *client_node = make_gossip_node("client-key");
+	JSON_ADD_STRING(gossip_node_get_data(client_node), "name", "client");
+	client_node->version++;
+	ASSERT_EQ(gossip_init_transport(&client, client_node, &client_tp.tp), 0);
+	gossip_add_seeds(&client, "127.0.0.1:25688");
+
+	// sync, ack1 and ack2 of a single round
+	for (int i = 0; i < 3; i++) {
+		gossip_loop_once(&client);
+		gossip_loop_once(&seed);
+	}
+
+	ASSERT_EQ(seed.nr_gnodes, 2);
+	ASSERT_EQ(client.nr_gnodes, 2);
+	ASSERT_EQ(client.nr_active_gnodes, 1);
+
+	struct gossip_stats stats;
+	gossip_get_stats(&seed, &stats);
+	ASSERT_EQ(stats.rx_packets[GOSSIP_PHASE_SYNC], 1);
+	ASSERT_EQ(stats.tx_packets[GOSSIP_PHASE_ACK1], 1);
+	ASSERT_EQ(stats.rx_errors, 0);
+	ASSERT_EQ(stats.nr_gnodes, 2);
+	ASSERT_EQ(stats.handle_usec.count, stats.rx_packets[GOSSIP_PHASE_SYNC] +
+	          stats.rx_packets[GOSSIP_PHASE_ACK1] +
+	          stats.rx_packets[GOSSIP_PHASE_ACK2]);
+
+	char buf[8192];
+	size_t len = gossip_stats_dump(&stats, buf, sizeof(buf));
+	ASSERT_LT(len, sizeof(buf));
+	ASSERT_NE(strstr(buf, "gossip_rx_packets_total{phase=\"sync\"} 1\n"),
+	          nullptr);
+	ASSERT_NE(strstr(buf, "gossip_nodes 2\n"), nullptr);
+
+	gossip_close(&client);
+	gossip_close(&seed);
+	gsp_mem_net_close(&net);
+}
+
+TEST(gossip, trace)
+{
+#ifndef GOSSIP_TRACE
+	GTEST_SKIP() << "built without -DWITH_TRACE=ON";
+#else
+	// more rounds than the ring holds, the first of them overwritten
+	for (int i = 0; i <= GOSSIP_TRACE_RING_LEN; i++)
+		gossip_trace_record(GOSSIP_TRACE_ROUND, 0, gossip_trace_now(),
+		                    1000000 + i, 0);
+	gossip_trace_record(GOSSIP_TRACE_HANDLE, GOSSIP_PHASE_SYNC,
+	                    gossip_trace_now(), 1, 100);
+	gossip_trace_record(GOSSIP_TRACE_SEND, GOSSIP_PHASE_ACK1,
+	                    gossip_trace_now(), 2, 200);
+
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/gossip_trace_%d.json", (int)getpid());
+	ASSERT_EQ(gossip_trace_dump(path), 0);
+
+	std::string text;
+	FILE *fp = fopen(path, "r");
+	ASSERT_TRUE(fp != NULL);
+	char buf[4096];
+	size_t nr;
+	while ((nr = fread(buf, 1, sizeof(buf), fp)) > 0)
+		text.append(buf, nr);
+	fclose(fp);
+	unlink(path);
+
+	JSON_PARSE(root, text.data(), (int)text.size());
+	ASSERT_TRUE(root != NULL);
+	json_object *events = JSON_GET_OBJECT(root, "traceEvents");
+	ASSERT_TRUE(json_object_is_type(events, json_type_array));
+
+	int nr_rounds = 0;
+	bool first_round = false, last_round = false;
+	for (size_t i = 0; i < json_object_array_length(events); i++) {
+		json_object *ev = json_object_array_get_idx(events, i);
+		std::string name = JSON_GET_STRING(ev, "name");
+		int items = JSON_GET_INT(JSON_GET_OBJECT(ev, "args"), "items");
+
+		ASSERT_STREQ(JSON_GET_STRING(ev, "ph"), "X");
+		if (name == "round" && items >= 1000000) {
+			nr_rounds++;
+			first_round |= items == 1000000;
+			last_round |= items == 1000000 + GOSSIP_TRACE_RING_LEN;
+		}
+	}
+	ASSERT_NE(text.find("\"name\":\"handle sync\""), std::string::npos);
+	ASSERT_NE(text.find("\"name\":\"send ack1\""), std::string::npos);
+	ASSERT_EQ(nr_rounds, GOSSIP_TRACE_RING_LEN - 2);
+	ASSERT_FALSE(first_round);
+	ASSERT_TRUE(last_round);
+
+	json_object_put(root);
+#endif
+}
+
+TEST(gossip, ipv6)
+{
+	struct gsp_addr addr;
+	ASSERT_EQ(gsp_addr_parse(&addr, "[::1]:25688", true), 0);
+	ASSERT_EQ(addr.ss.ss_family, AF_INET6);
+	ASSERT_EQ(gsp_addr_parse(&addr, "127.0.0.1:25688", true), 0);
+	ASSERT_EQ(addr.ss.ss_family, AF_INET);
+	ASSERT_EQ(gsp_addr_parse(&addr, "::1", true), -1);
+
+	struct gsp_mem_net net;
+	ASSERT_EQ(gsp_mem_net_init(&net), 0);
+
+	struct gsp_mem seed_tp, client_tp;
+	ASSERT_EQ(gsp_mem_init(&seed_tp, &net, "::1", 25688), 0);
+	ASSERT_EQ(gsp_mem_init(&client_tp, &net, "::1", 25689), 0);
+
+	struct gossip seed = {0}, client = {0};
+	struct gossip_node *seed_node = make_gossip_node("seed-node-key");
+	gossip_node_set_full(seed_node, "::1", 25688);
+	seed_node->version++;
+	ASSERT_EQ(gossip_init_transport(&seed, seed_node, &seed_tp.tp), 0);
+
+	struct gossip_node *client_node = make_gossip_node("client-key");
+	client_node->version++;
+	ASSERT_EQ(gossip_init_transport(&client, client_node, &client_tp.tp), 0);
+	gossip_add_seeds(&client, "[::1]:25688");
+
+	for (int i = 0; i < 3; i++) {
+		gossip_loop_once(&client);
+		gossip_loop_once(&seed);
+	}
+
+	ASSERT_EQ(seed.nr_gnodes, 2);
+	ASSERT_EQ(client.nr_gnodes, 2);
+	ASSERT_EQ(client.nr_active_gnodes, 1);
+
+	gossip_close(&client);
+	gossip_close(&seed);
+	gsp_mem_net_close(&net);
+}
+
+TEST(gossip, uring)
+{
+	// falls back on recvfrom/sendto where io_uring is not available
+	struct gsp_udp_info info = {
+		.ipaddr = "127.0.0.1",
+		.port = 25690,
+		.recv_buf_len = GSP_UDP_RECV_BUF_LEN_MAX,
+		.flags = GSP_UDP_F_URING,
+	};
+	struct gsp_udp seed_udp, client_udp;
+	ASSERT_EQ(gsp_udp_init(&seed_udp, &info), 0);
+	info.port = 25691;
+	ASSERT_EQ(gsp_udp_init(&client_udp, &info), 0);
+	RecordProperty("backend", seed_udp.uring ? "io_uring" : "fallback");
+
+	struct gossip seed = {0}, client = {0};
+	struct gossip_node *seed_node = make_gossip_node("seed-node-key");
+	gossip_node_set_full(seed_node, "127.0.0.1", 25690);
+	seed_node->version++;
+	ASSERT_EQ(gossip_init_transport(&seed, seed_node, &seed_udp.tp), 0);
+
+	struct gossip_node *client_node = make_gossip_node("client-key");
+	client_node->version++;
+	ASSERT_EQ(gossip_init_transport(&client, client_node, &client_udp.tp), 0);
+	gossip_add_seeds(&client, "127.0.0.1:25690");
+
+	for (int i = 0; i < 10 && seed.nr_gnodes < 2; i++) {
+		client.last_sync_time = 0;
+		gossip_loop_once(&client);
+		gossip_loop_once(&seed);
+		gossip_loop_once(&client);
+	}
+
+	ASSERT_EQ(seed.nr_gnodes, 2);
+	ASSERT_EQ(client.nr_gnodes, 2);
+	ASSERT_EQ(client.nr_active_gnodes, 1);
+
+	gossip_close(&client);
+	gossip_close(&seed);
+}
+
+// member-<id> with its data padded by pad bytes
+static std::string member_entry(int id, int version, size_t pad)
+{
+	char pubkey[64];
+	snprintf(pubkey, sizeof(pubkey), "member-%d", id);
+	struct gossip_node *gnode = make_gossip_node(pubkey);
+	json_object *data = gossip_node_get_data(gnode);
+	JSON_ADD_INT(data, "id", id);
+	if (pad)
+		JSON_ADD_STRING(data, "pad", std::string(pad, 'x').c_str());
+	gnode->version = version;
+
+	json_object *root = gossip_node_to_json(gnode);
+	std::string entry = json_object_to_json_string_ext(root,
+		JSON_C_TO_STRING_PLAIN);
+	json_object_put(root);
+	free_gossip_node(gnode);
+	return entry;
+}
+
+static void feed_entries(struct gossip *gsp, const std::string &entries)
+{
+	std::string buf = "{\"phase\":2,\"gnodes\":[" + entries + "]}";
+
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	gsp->tp->read_cb(gsp->tp, buf.data(), buf.size(),
+	                 (struct sockaddr *)&addr, sizeof(addr));
+}
+
+static void feed_members(struct gossip *gsp, int nr, int version)
+{
+	std::string entries;
+
+	for (int i = 0; i < nr; i++) {
+		if (i) entries += ',';
+		entries += member_entry(i, version, 0);
+	}
+	feed_entries(gsp, entries);
+}
+
+TEST(gossip, segments)
+{
+	// segmentation offload where the kernel has it, plain datagrams if not
+	struct gsp_udp_info info = {
+		.ipaddr = "127.0.0.1",
+		.port = 25692,
+		.recv_buf_len = GSP_UDP_RECV_BUF_LEN_MAX,
+	};
+	struct gsp_udp seed_udp, client_udp;
+	ASSERT_EQ(gsp_udp_init(&seed_udp, &info), 0);
+	info.port = 25693;
+	ASSERT_EQ(gsp_udp_init(&client_udp, &info), 0);
+
+	struct gossip seed = {0}, client = {0};
+	struct gossip_node *seed_node = make_gossip_node("seed-node-key");
+	gossip_node_set_full(seed_node, "127.0.0.1", 25692);
+	seed_node->version++;
+	ASSERT_EQ(gossip_init_transport(&seed, seed_node, &seed_udp.tp), 0);
+	feed_members(&seed, 100, 2);
+
+	struct gossip_node *client_node = make_gossip_node("client-key");
+	client_node->version++;
+	ASSERT_EQ(gossip_init_transport(&client, client_node, &client_udp.tp), 0);
+	feed_members(&client, 100, 1);
+	client.sync_count = 100;
+	gossip_add_seeds(&client, "127.0.0.1:25692");
+
+	// one sync of every member, answered by far more than a segment
+	gossip_loop_once(&client);
+	gossip_loop_once(&seed);
+	ASSERT_GT(seed.stats.tx_packets[GOSSIP_PHASE_ACK1], 1);
+
+	int nr_updated = 0;
+	for (int i = 0; i < 200 && nr_updated < 100; i++) {
+		gossip_loop_once(&client);
+
+		nr_updated = 0;
+		struct gossip_node *pos;
+		list_for_each_entry(pos, &client.gnodes, node)
+			nr_updated += pos->version == 2;
+	}
+	ASSERT_EQ(nr_updated, 100);
+	ASSERT_EQ(client.stats.rx_errors, 0);
+
+	gossip_close(&client);
+	gossip_close(&seed);
+}
+
+static int bootstrap_done;
+
+static void *bootstrap_seed_thread(void *arg)
+{
+	struct gossip *seed = (struct gossip *)arg;
+	while (!__atomic_load_n(&bootstrap_done, __ATOMIC_ACQUIRE))
+		gossip_loop_once(seed);
+	return NULL;
+}
+
+TEST(gossip, bootstrap)
+{
+	struct gsp_mem_net net;
+	ASSERT_EQ(gsp_mem_net_init(&net), 0);
+
+	struct gsp_mem seed_tp, client_tp;
+	ASSERT_EQ(gsp_mem_init(&seed_tp, &net, "127.0.0.1", 25694), 0);
+	ASSERT_EQ(gsp_mem_init(&client_tp, &net, "127.0.0.1", 25695), 0);
+
+	struct gossip seed = {0}, client = {0};
+	struct gossip_node *seed_node = make_gossip_node("seed-node-key");
+	gossip_node_set_full(seed_node, "127.0.0.1", 25694);
+	seed_node->version++;
+	ASSERT_EQ(gossip_init_transport(&seed, seed_node, &seed_tp.tp), 0);
+	feed_members(&seed, 2000, 1);
+	ASSERT_EQ(gossip_serve_bootstrap(&seed, 25694), 0);
+
+	struct gossip_node *client_node = make_gossip_node("client-key");
+	client_node->version++;
+	ASSERT_EQ(gossip_init_transport(&client, client_node, &client_tp.tp), 0);
+
+	pthread_t thread;
+	ASSERT_EQ(pthread_create(&thread, NULL, bootstrap_seed_thread, &seed), 0);
+	int nr = gossip_bootstrap(&client, "127.0.0.1:25694");
+	__atomic_store_n(&bootstrap_done, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	// every member and the seed itself, in a few chunks
+	ASSERT_EQ(nr, 2001);
+	ASSERT_EQ(client.nr_gnodes, 2002);
+	ASSERT_EQ(client.nr_active_gnodes, 1);
+	ASSERT_GT(client.stats.rx_packets[GOSSIP_PHASE_ACK2], 1);
+	ASSERT_EQ(seed.stats.snapshots, 1);
+	ASSERT_EQ(gossip_bootstrap(&client, "127.0.0.1:25699"), -1);
+
+	gossip_close(&client);
+	gossip_close(&seed);
+	gsp_mem_net_close(&net);
+}
+
+TEST(gossip, rate_limit)
+{
+	struct gsp_mem_net net;
+	ASSERT_EQ(gsp_mem_net_init(&net), 0);
+
+	struct gsp_mem seed_tp, client_tp;
+	ASSERT_EQ(gsp_mem_init(&seed_tp, &net, "127.0.0.1", 25688), 0);
+	ASSERT_EQ(gsp_mem_init(&client_tp, &net, "127.0.0.1", 25689), 0);
+
+	// ten members far ahead on the seed, the others one version ahead
+	struct gossip seed = {0}, client = {0};
+	struct gossip_node *seed_node = make_gossip_node("seed-node-key");
+	gossip_node_set_full(seed_node, "127.0.0.1", 25688);
+	seed_node->version++;
+	ASSERT_EQ(gossip_init_transport(&seed, seed_node, &seed_tp.tp), 0);
+	feed_members(&seed, 10, 5);
+	feed_members(&seed, 200, 2);
+	gossip_set_rate_limit(&seed, 0, 4000);
+
+	struct gossip_node *client_node = make_gossip_node("client-key");
+	client_node->version++;
+	ASSERT_EQ(gossip_init_transport(&client, client_node, &client_tp.tp), 0);
+	feed_members(&client, 200, 1);
+	client.sync_count = 200;
+	client.segment_len = 0; // one SYNC listing every member
+	gossip_add_seeds(&client, "127.0.0.1:25688");
+
+	gossip_loop_once(&client);
+	gossip_loop_once(&seed);
+	gossip_loop_once(&client);
+
+	// the reply is cut short, keeping the seed and the stalest entries
+	ASSERT_GT(seed.stats.throttled, 0);
+	ASSERT_LT(seed.stats.tx_bytes[GOSSIP_PHASE_ACK1], 8192 + 2048);
+	ASSERT_TRUE(gossip_find_node(&client, seed_node->pubid));
+
+	int nr_updated = 0;
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &client.gnodes, node) {
+		if (strncmp(pos->pubkey, "member-", 7))
+			continue;
+		int id = atoi(pos->pubkey + 7);
+		if (id < 10)
+			ASSERT_EQ(pos->version, 5);
+		else
+			nr_updated += pos->version == 2;
+	}
+	ASSERT_LT(nr_updated, 190);
+
+	gossip_close(&client);
+	gossip_close(&seed);
+	gsp_mem_net_close(&net);
+}
+
+TEST(gossip, throttled_segments)
+{
+	struct gsp_mem_net net;
+	ASSERT_EQ(gsp_mem_net_init(&net), 0);
+
+	struct gsp_mem seed_tp, client_tp;
+	ASSERT_EQ(gsp_mem_init(&seed_tp, &net, "127.0.0.1", 25746), 0);
+	ASSERT_EQ(gsp_mem_init(&client_tp, &net, "127.0.0.1", 25747), 0);
+
+	// a small, a big and a small entry, ranked in that order in the ACK1
+	struct gossip seed = {0}, client = {0};
+	struct gossip_node *seed_node = make_gossip_node("seed-node-key");
+	gossip_node_set_full(seed_node, "127.0.0.1", 25746);
+	seed_node->version++;
+	ASSERT_EQ(gossip_init_transport(&seed, seed_node, &seed_tp.tp), 0);
+	feed_entries(&seed, member_entry(0, 4, 0) + "," +
+	             member_entry(1, 3, 8000) + "," + member_entry(2, 2, 0));
+	seed.segment_len = GOSSIP_SEGMENT_LEN_MIN;
+	gossip_set_rate_limit(&seed, 0, 8192);
+
+	struct gossip_node *client_node = make_gossip_node("client-key");
+	client_node->version++;
+	ASSERT_EQ(gossip_init_transport(&client, client_node, &client_tp.tp), 0);
+	feed_members(&client, 3, 1);
+	gossip_add_seeds(&client, "127.0.0.1:25746");
+
+	gossip_loop_once(&client);
+	gossip_loop_once(&seed);
+	gossip_loop_once(&client);
+
+	// the big entry flushed a segment and was dropped, the next one went
+	ASSERT_GT(seed.stats.throttled, 0);
+	ASSERT_GT(seed.stats.tx_packets[GOSSIP_PHASE_ACK1], 1);
+	ASSERT_EQ(client.stats.rx_errors, 0);
+	ASSERT_TRUE(gossip_find_node(&client, seed_node->pubid));
+
+	struct gossip_node *pos;
+	list_for_each_entry(pos, &client.gnodes, node) {
+		if (!strcmp(pos->pubkey, "member-0")) {
+			ASSERT_EQ(pos->version, 4);
+		} else if (!strcmp(pos->pubkey, "member-1")) {
+			ASSERT_EQ(pos->version, 1);
+		} else if (!strcmp(pos->pubkey, "member-2")) {
+			ASSERT_EQ(pos->version, 2);
+		}
+	}
+
+	gossip_close(&client);
+	gossip_close(&seed);
+	gsp_mem_net_close(&net);
+}
+
+/*
+ * Nodes over one in-memory network: node i is prefix-i at port + i. Closing
+ * the cluster, as leaving the scope of a test does, closes the nodes started
+ * and the network, and puts the clock back.
+ */
+struct test_cluster {
+	const char *prefix;
+	int port;
+	bool open;
+	struct gsp_mem_net net;
+	std::vector<struct gsp_mem> tps;
+	std::vector<struct gossip> gsps;
+
+	~test_cluster();
+};
+
+static void cluster_close(struct test_cluster *c)
+{
+	if (!c->open)
+		return;
+
+	gossip_set_clock(NULL);
+	for (size_t i = 0; i < c->gsps.size(); i++) {
+		if (c->gsps[i].self)
+			gossip_close(&c->gsps[i]);
+	}
+	gsp_mem_net_close(&c->net);
+	c->open = false;
+}
+
+test_cluster::~test_cluster()
+{
+	cluster_close(this);
+}
+
+static void cluster_init(struct test_cluster *c, int nr, const char *prefix,
+                         int port)
+{
+	ASSERT_EQ(gsp_mem_net_init(&c->net), 0);
+	c->prefix = prefix;
+	c->port = port;
+	c->open = true;
+	c->tps.resize(nr);
+	c->gsps.resize(nr);
+}
+
+// the entry of node i, full and at version 1, to set up before it starts
+static struct gossip_node *cluster_node(struct test_cluster *c, int i)
+{
+	char pubkey[32];
+	snprintf(pubkey, sizeof(pubkey), "%s-%d", c->prefix, i);
+
+	struct gossip_node *gnode = make_gossip_node(pubkey);
+	gossip_node_set_full(gnode, "127.0.0.1", c->port + i);
+	gnode->version++;
+	return gnode;
+}
+
+static void cluster_join(struct test_cluster *c, int i,
+                         struct gossip_node *gnode, const char *seeds)
+{
+	ASSERT_EQ(gsp_mem_init(&c->tps[i], &c->net, "127.0.0.1", c->port + i),
+	          0);
+	ASSERT_EQ(gossip_init_transport(&c->gsps[i], gnode, &c->tps[i].tp), 0);
+	if (seeds)
+		gossip_add_seeds(&c->gsps[i], seeds);
+}
+
+// every node, seeded with the first
+static void cluster_start(struct test_cluster *c, int nr, const char *prefix,
+                          int port)
+{
+	char seed[32];
+	snprintf(seed, sizeof(seed), "127.0.0.1:%d", port);
+
+	ASSERT_NO_FATAL_FAILURE(cluster_init(c, nr, prefix, port));
+	for (int i = 0; i < nr; i++)
+		ASSERT_NO_FATAL_FAILURE(cluster_join(c, i, cluster_node(c, i),
+		                                     seed));
+}
+
+TEST(gossip, publish_self)
+{
+	const int nr = 5;
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_start(&c, nr, "push-node", 25700));
+	struct gossip *gsps = c.gsps.data();
+
+	// rounds until every node talks to every other
+	int done = 0;
+	for (int round = 0; round < 200 && !done; round++) {
+		done = 1;
+		for (int i = 0; i < nr; i++) {
+			gsps[i].last_sync_time = 0;
+			gossip_loop_once(&gsps[i]);
+			done &= gsps[i].nr_active_gnodes == nr - 1;
+		}
+	}
+	ASSERT_TRUE(done);
+
+	// no round is due while the push spreads
+	struct gossip_node *self = gsps[0].self;
+	self->version++;
+	gsps[0].push_fanout = nr - 1;
+	int64_t tx_push[nr];
+	for (int i = 1; i < nr; i++) {
+		// every peer but the sender, which is the origin too
+		gsps[i].push_fanout = nr - 2;
+		tx_push[i] = gsps[i].stats.tx_packets[GOSSIP_PHASE_PUSH];
+	}
+	ASSERT_EQ(gossip_publish_self(&gsps[0]), nr - 1);
+
+	for (int i = 1; i < nr; i++)
+		gossip_loop_once(&gsps[i]);
+	for (int i = 1; i < nr; i++) {
+		gossip_loop_once(&gsps[i]);
+		struct gossip_node *gnode =
+			gossip_find_node(&gsps[i], self->pubid);
+		ASSERT_TRUE(gnode);
+		ASSERT_EQ(gnode->version, self->version);
+		ASSERT_EQ(gsps[i].stats.tx_packets[GOSSIP_PHASE_PUSH] -
+		          tx_push[i], nr - 2);
+	}
+}
+
+static int64_t test_now;
+
+static int64_t test_clock(void)
+{
+	return test_now;
+}
+
+TEST(gossip, set_data)
+{
+	struct gsp_mem_net net;
+	ASSERT_EQ(gsp_mem_net_init(&net), 0);
+	struct gsp_mem tp;
+	ASSERT_EQ(gsp_mem_init(&tp, &net, "127.0.0.1", 25710), 0);
+
+	test_now = 1000;
+	gossip_set_clock(test_clock);
+
+	struct gossip gsp = {0};
+	struct gossip_node *gnode = make_gossip_node("data-node");
+	JSON_ADD_INT(gossip_node_get_data(gnode), "load", 0);
+	gnode->version++;
+	ASSERT_EQ(gossip_init_transport(&gsp, gnode, &tp.tp), 0);
+
+	// the first change goes at once, the rest of the burst waits
+	for (int i = 0; i < 100; i++) {
+		ASSERT_EQ(gossip_set_data(&gsp, "load",
+		                          json_object_new_int(i + 1)), 1);
+		ASSERT_EQ(gossip_set_data(&gsp, "name",
+		                          json_object_new_string("n")), i == 0);
+		gossip_loop_once(&gsp);
+	}
+	ASSERT_EQ(gnode->version, 2);
+	ASSERT_EQ(JSON_GET_INT(gossip_node_get_data(gnode), "load"), 1);
+
+	// and is one version once the interval is over
+	test_now += GOSSIP_DATA_INTERVAL;
+	gossip_loop_once(&gsp);
+	ASSERT_EQ(gnode->version, 3);
+	ASSERT_EQ(JSON_GET_INT(gossip_node_get_data(gnode), "load"), 100);
+	ASSERT_STREQ(JSON_GET_STRING(gossip_node_get_data(gnode), "name"), "n");
+	ASSERT_EQ(gossip_set_data(&gsp, "load", json_object_new_int(7)), 1);
+	test_now += GOSSIP_DATA_INTERVAL;
+	gossip_loop_once(&gsp);
+	ASSERT_EQ(gnode->version, 4);
+
+	// setting what is there already, or undoing a pending change, is void
+	ASSERT_EQ(gossip_set_data(&gsp, "load", json_object_new_int(7)), 0);
+	ASSERT_EQ(gossip_set_data(&gsp, "load", json_object_new_int(8)), 1);
+	ASSERT_EQ(gossip_set_data(&gsp, "load", json_object_new_int(7)), 0);
+	ASSERT_EQ(gossip_flush_data(&gsp), 0);
+
+	ASSERT_EQ(gossip_set_data(&gsp, "name", NULL), 1);
+	ASSERT_EQ(gossip_flush_data(&gsp), 1);
+	ASSERT_EQ(gnode->version, 5);
+	ASSERT_FALSE(json_object_object_get_ex(gossip_node_get_data(gnode),
+	                                       "name", NULL));
+
+	gossip_set_clock(NULL);
+	gossip_close(&gsp);
+	gsp_mem_net_close(&net);
+}
+
+TEST(gossip, adaptive_interval)
+{
+	struct gsp_mem_net net;
+	ASSERT_EQ(gsp_mem_net_init(&net), 0);
+	struct gsp_mem tp;
+	ASSERT_EQ(gsp_mem_init(&tp, &net, "127.0.0.1", 25711), 0);
+
+	test_now = 1000;
+	gossip_set_clock(test_clock);
+
+	struct gossip gsp = {0};
+	struct gossip_node *gnode = make_gossip_node("interval-node");
+	gnode->version++;
+	ASSERT_EQ(gossip_init_transport(&gsp, gnode, &tp.tp), 0);
+
+	// alone, every round is quiet and the next one further off
+	for (int i = 0; i < 200; i++) {
+		test_now++;
+		gossip_loop_once(&gsp);
+		ASSERT_GE(gsp.sync_wait, (gsp.sync_interval + 1) / 2);
+		ASSERT_LE(gsp.sync_wait, gsp.sync_interval);
+	}
+	ASSERT_EQ(gsp.sync_interval, GOSSIP_INTERVAL_MAX);
+	ASSERT_LT(gsp.stats.rounds, 200 / (GOSSIP_INTERVAL_MAX / 2) + 10);
+
+	// a change of ours brings the next round in, and is quick to spread
+	gnode->version++;
+	int64_t rounds = gsp.stats.rounds;
+	test_now = gsp.last_sync_time + GOSSIP_INTERVAL_MIN;
+	gossip_loop_once(&gsp);
+	ASSERT_EQ(gsp.stats.rounds, rounds + 1);
+	ASSERT_EQ(gsp.sync_interval, GOSSIP_INTERVAL_MIN);
+
+	gossip_set_clock(NULL);
+	gossip_close(&gsp);
+	gsp_mem_net_close(&net);
+}
+
+static int64_t test_skew;
+
+static int64_t test_skewed_clock(void)
+{
+	return test_now + test_skew;
+}
+
+TEST(gossip, skewed_clocks)
+{
+	const int nr = 2;
+	const int64_t skews[nr] = { 0, -10 * GOSSIP_ALIVE_TIMEOUT };
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_init(&c, nr, "skew-node", 25712));
+
+	test_now = 100000;
+	gossip_set_clock(test_skewed_clock);
+
+	for (int i = 0; i < nr; i++) {
+		test_skew = skews[i];
+		ASSERT_NO_FATAL_FAILURE(cluster_join(&c, i, cluster_node(&c, i),
+		                                     "127.0.0.1:25712"));
+	}
+	struct gsp_mem *tps = c.tps.data();
+	struct gossip *gsps = c.gsps.data();
+
+	// a node ten timeouts behind stays alive while it beats
+	for (int round = 0; round < 200; round++) {
+		test_now += GOSSIP_INTERVAL_MAX;
+		for (int i = 0; i < nr; i++) {
+			test_skew = skews[i];
+			gossip_loop_once(&gsps[i]);
+		}
+	}
+	for (int i = 0; i < nr; i++) {
+		ASSERT_EQ(gsps[i].nr_active_gnodes, 1);
+		ASSERT_EQ(gsps[i].stats.expired, 0);
+	}
+
+	// and expires once it is silent
+	test_skew = 0;
+	while (tps[0].nr_queued)
+		gsp_transport_loop(&tps[0].tp, GSP_TRANSPORT_LOOP_ONCE);
+	test_now += GOSSIP_ALIVE_TIMEOUT + 1;
+	gsps[0].last_sync_time = 0;
+	gossip_loop_once(&gsps[0]);
+	ASSERT_EQ(gsps[0].nr_active_gnodes, 0);
+	ASSERT_EQ(gsps[0].stats.expired, 1);
+}
+
+TEST(gossip, coord)
+{
+	// two regions, 2 ms within each, 100 ms across
+	const int nr = 8;
+	struct gossip_coord coords[nr];
+	for (int i = 0; i < nr; i++)
+		gossip_coord_init(&coords[i]);
+
+	srand(1);
+	for (int round = 0; round < 4000; round++) {
+		int i = rand() % nr, j = rand() % nr;
+		if (i == j) continue;
+		double rtt = (i < nr / 2) == (j < nr / 2) ? 2 : 100;
+		struct gossip_coord peer = coords[j];
+		gossip_coord_update(&coords[i], &peer, rtt);
+	}
+
+	for (int i = 0; i < nr; i++) {
+		ASSERT_LT(coords[i].error, 0.5);
+		for (int j = 0; j < nr; j++) {
+			if (i == j) continue;
+			double dist = gossip_coord_dist(&coords[i], &coords[j]);
+			if ((i < nr / 2) == (j < nr / 2))
+				ASSERT_LT(dist, 20);
+			else
+				ASSERT_NEAR(dist, 100, 30);
+		}
+	}
+
+	// over the wire, each round trip of a SYNC places the syncing node
+	const int nr_gsps = 4;
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_start(&c, nr_gsps, "coord-node",
+	                                      25714));
+	struct gossip *gsps = c.gsps.data();
+
+	for (int round = 0; round < 40; round++) {
+		for (int i = 0; i < nr_gsps; i++) {
+			gsps[i].last_sync_time = 0;
+			gossip_loop_once(&gsps[i]);
+		}
+	}
+
+	for (int i = 0; i < nr_gsps; i++) {
+		ASSERT_EQ(gsps[i].nr_gnodes, nr_gsps);
+		ASSERT_LT(gsps[i].self->coord.error, GOSSIP_COORD_ERROR_MAX);
+	}
+	struct gossip_node *peer = gossip_find_node(&gsps[0],
+	                                            gsps[1].self->pubid);
+	ASSERT_TRUE(peer);
+	ASSERT_LT(peer->coord.error, GOSSIP_COORD_ERROR_MAX);
+
+	/*
+	 * Converged, an ACK1 carries no full entry and its first item is any
+	 * node: the coordinates it brings are those of the node that answers.
+	 */
+	for (int round = 0; round < 3; round++) {
+		for (int i = 0; i < nr_gsps; i++)
+			gossip_loop_once(&gsps[i]);
+	}
+	for (int i = 0; i < nr_gsps; i++)
+		gsps[i].self->coord.vec[0] = 1000 * (i + 1);
+	gsps[0].last_sync_time = 0;
+	gossip_loop_once(&gsps[0]);
+	for (int i = 1; i < nr_gsps; i++)
+		gossip_loop_once(&gsps[i]);
+	gossip_loop_once(&gsps[0]);
+
+	int nr_placed = 0;
+	for (int i = 1; i < nr_gsps; i++) {
+		peer = gossip_find_node(&gsps[0], gsps[i].self->pubid);
+		ASSERT_TRUE(peer);
+		if (peer->coord.vec[0] < 500)
+			continue;
+		ASSERT_NEAR(peer->coord.vec[0], 1000 * (i + 1), 1);
+		nr_placed++;
+	}
+	ASSERT_EQ(nr_placed, 1);
+}
+
+TEST(gossip, zones)
+{
+	const int nr = 8;
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_init(&c, nr, "zone-node", 25716));
+	struct gossip *gsps = c.gsps.data();
+
+	// zone-0 and zone-1 take turns, a seed in each
+	for (int i = 0; i < nr; i++) {
+		char zone[32];
+		snprintf(zone, sizeof(zone), "zone-%d", i % 2);
+
+		struct gossip_node *gnode = cluster_node(&c, i);
+		gossip_node_set_zone(gnode, zone);
+		ASSERT_NO_FATAL_FAILURE(cluster_join(&c, i, gnode,
+			"127.0.0.1:25716,127.0.0.1:25717"));
+		gsps[i].zone_reps = 1;
+	}
+
+	for (int round = 0; round < 100; round++) {
+		for (int i = 0; i < nr; i++) {
+			gsps[i].last_sync_time = 0;
+			gossip_loop_once(&gsps[i]);
+		}
+	}
+
+	// all of its zone, one node of the other and how big that one is
+	for (int i = 0; i < nr; i++) {
+		ASSERT_EQ(gsps[i].nr_gnodes, nr / 2 + 1);
+
+		char other[32];
+		snprintf(other, sizeof(other), "zone-%d", !(i % 2));
+		const struct gossip_zone *zone =
+			gossip_find_zone(&gsps[i], other);
+		ASSERT_TRUE(zone);
+		ASSERT_EQ(zone->nr_reps, 1);
+		ASSERT_EQ(zone->nr_nodes, nr / 2);
+		ASSERT_EQ(zone->digest, gsps[!(i % 2)].zones[0].digest);
+	}
+}
+
+TEST(gossip, zone_reps_alive)
+{
+	const int nr = 60, nr_zones = 2, reps = 3;
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_init(&c, nr, "reps-node", 25748));
+	struct gossip *gsps = c.gsps.data();
+
+	test_now = 1000;
+	gossip_set_clock(test_clock);
+
+	for (int i = 0; i < nr; i++) {
+		char zone[32], seed[32];
+		snprintf(zone, sizeof(zone), "reps-zone-%d", i % nr_zones);
+		// the next node seeds it, for its nodes of the other zone to
+		// vary from its neighbours'
+		snprintf(seed, sizeof(seed), "127.0.0.1:%d", 25748 + (i + 1) % nr);
+
+		struct gossip_node *gnode = cluster_node(&c, i);
+		gossip_node_set_zone(gnode, zone);
+		ASSERT_NO_FATAL_FAILURE(cluster_join(&c, i, gnode, seed));
+		gsps[i].zone_reps = reps;
+	}
+
+	// well past the alive timeout, with every node alive all along
+	for (int round = 0; round < 2 * GOSSIP_ALIVE_TIMEOUT / 5; round++) {
+		test_now += 5;
+		for (int i = 0; i < nr; i++) {
+			gsps[i].last_sync_time = 0;
+			gossip_loop_once(&gsps[i]);
+		}
+	}
+
+	// no node of another zone was taken for silent and let go
+	for (int i = 0; i < nr; i++) {
+		ASSERT_EQ(gsps[i].stats.expired, 0);
+		ASSERT_EQ(gsps[i].nr_gnodes,
+		          nr / nr_zones + (nr_zones - 1) * reps);
+
+		struct gossip_node *pos;
+		list_for_each_entry(pos, &gsps[i].gnodes, node)
+			ASSERT_LE(test_now - pos->alive_seen, GOSSIP_ALIVE_TIMEOUT);
+	}
+
+	// one goes quiet: who keeps it keeps it until another takes its place
+	const int dead = nr - 1;
+	for (int round = 0; round < 2 * GOSSIP_ALIVE_TIMEOUT / 5; round++) {
+		test_now += 5;
+		for (int i = 0; i < dead; i++) {
+			gsps[i].last_sync_time = 0;
+			gossip_loop_once(&gsps[i]);
+
+			char other[32];
+			snprintf(other, sizeof(other), "reps-zone-%d",
+			         !(i % nr_zones));
+			ASSERT_GE(gossip_find_zone(&gsps[i], other)->nr_reps, reps);
+		}
+	}
+
+	// and the other zone lets it go once it has
+	for (int i = 0; i < dead; i += nr_zones) {
+		ASSERT_FALSE(gossip_find_node(&gsps[i], gsps[dead].self->pubid));
+		ASSERT_EQ(gsps[i].nr_gnodes,
+		          nr / nr_zones + (nr_zones - 1) * reps);
+	}
+}
+
+TEST(gossip, partial_view)
+{
+	const int nr = 12;
+	const int dead = nr - 1;
+	test_now = 1000;
+	gossip_set_clock(test_clock);
+
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_start(&c, nr, "view-node", 25724));
+	struct gossip *gsps = c.gsps.data();
+	for (int i = 0; i < nr; i++)
+		gossip_set_partial_view(&gsps[i], 2, 4);
+
+	for (int round = 0; round < 100; round++) {
+		test_now += GOSSIP_INTERVAL_MAX;
+		for (int i = 0; i < nr; i++)
+			gossip_loop_once(&gsps[i]);
+	}
+
+	// views fill up to their bounds and no further
+	for (int i = 0; i < nr; i++) {
+		ASSERT_EQ(gsps[i].nr_gnodes, 1 + 2 + 4);
+		ASSERT_EQ(gsps[i].nr_active_gnodes, 2);
+	}
+
+	// a silent node leaves the views, passive nodes taking its place
+	for (int round = 0; round < 2 * GOSSIP_ALIVE_TIMEOUT /
+	                           GOSSIP_INTERVAL_MAX; round++) {
+		test_now += GOSSIP_INTERVAL_MAX;
+		for (int i = 0; i < dead; i++)
+			gossip_loop_once(&gsps[i]);
+	}
+	for (int i = 0; i < dead; i++) {
+		ASSERT_LE(gsps[i].nr_gnodes, 1 + 2 + 4);
+		ASSERT_EQ(gsps[i].nr_active_gnodes, 2);
+
+		struct gossip_node *gnode =
+			gossip_find_node(&gsps[i], gsps[dead].self->pubid);
+		ASSERT_TRUE(!gnode || list_empty(&gnode->active_node));
+	}
+}
+
+static void count_bcast(struct gossip *gsp, const char *origin,
+                        const char *msg, void *user_data)
+{
+	ASSERT_STRNE(origin, gsp->self->pubid);
+	ASSERT_EQ(strncmp(msg, "event-", 6), 0);
+	(*(int *)user_data)++;
+}
+
+TEST(gossip, broadcast)
+{
+	const int nr = 6;
+	const int nr_msgs = 10;
+	test_now = 1000;
+	gossip_set_clock(test_clock);
+
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_start(&c, nr, "bcast-node", 25736));
+	struct gossip *gsps = c.gsps.data();
+	int delivered[nr] = { 0 };
+	for (int i = 0; i < nr; i++)
+		gossip_set_bcast_cb(&gsps[i], count_bcast, &delivered[i]);
+
+	for (int round = 0; round < 30; round++) {
+		test_now += GOSSIP_INTERVAL_MAX;
+		for (int i = 0; i < nr; i++)
+			gossip_loop_once(&gsps[i]);
+	}
+
+	// every message reaches every other node once, the tree settling
+	int64_t tx_bcast[nr_msgs];
+	for (int m = 0; m < nr_msgs; m++) {
+		char msg[32];
+		snprintf(msg, sizeof(msg), "event-%d", m);
+
+		tx_bcast[m] = 0;
+		for (int i = 0; i < nr; i++)
+			tx_bcast[m] -= gsps[i].stats.tx_packets[GOSSIP_PHASE_BCAST];
+
+		ASSERT_EQ(gossip_broadcast(&gsps[m % nr], msg), 0);
+		for (int round = 0; round < 5; round++) {
+			test_now += GOSSIP_BCAST_TIMEOUT;
+			for (int i = 0; i < nr; i++)
+				gossip_loop_once(&gsps[i]);
+		}
+
+		for (int i = 0; i < nr; i++)
+			tx_bcast[m] += gsps[i].stats.tx_packets[GOSSIP_PHASE_BCAST];
+	}
+
+	int64_t nr_pruned = 0;
+	for (int i = 0; i < nr; i++) {
+		int nr_own = nr_msgs / nr + (i < nr_msgs % nr);
+		ASSERT_EQ(delivered[i], nr_msgs - nr_own);
+		nr_pruned += gsps[i].stats.tx_packets[GOSSIP_PHASE_PRUNE];
+	}
+	ASSERT_GT(nr_pruned, 0);
+	ASSERT_GT(tx_bcast[0], nr - 1);
+	ASSERT_EQ(tx_bcast[nr_msgs - 1], nr - 1);
+}
+
+TEST(gossip, bcast_announcers)
+{
+	struct gossip_seen seen;
+	ASSERT_EQ(gossip_seen_init(&seen, 4), 0);
+	struct gossip_seen_msg *msg = gossip_seen_add(&seen, 42);
+	ASSERT_TRUE(msg);
+
+	struct sockaddr_in addrs[3] = {};
+	for (int i = 0; i < 3; i++) {
+		addrs[i].sin_family = AF_INET;
+		addrs[i].sin_port = htons(25800 + i);
+		addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		ASSERT_EQ(gossip_seen_add_ihave(msg,
+			(struct sockaddr *)&addrs[i], sizeof(addrs[i])), 0);
+	}
+	// an announcer again is kept once
+	ASSERT_EQ(gossip_seen_add_ihave(msg, (struct sockaddr *)&addrs[1],
+	                                sizeof(addrs[1])), 0);
+	ASSERT_EQ(msg->nr_ihave_addrs, 3);
+
+	// the GRAFTs go round every announcer
+	for (int i = 0; i < 6; i++) {
+		const struct gsp_addr *to = gossip_seen_next_graft(msg);
+		ASSERT_TRUE(to);
+		ASSERT_TRUE(gsp_addr_equal(gsp_addr_sa(to),
+			(struct sockaddr *)&addrs[i % 3]));
+	}
+
+	// and there are none left to ask once it came
+	ASSERT_EQ(gossip_seen_set_text(&seen, msg, strdup("event")), 0);
+	ASSERT_EQ(seen.nr_missing, 0);
+	ASSERT_FALSE(gossip_seen_next_graft(msg));
+
+	gossip_seen_close(&seen);
+}
+
+TEST(gossip, bcast_graft_cap)
+{
+	test_now = 1000;
+	gossip_set_clock(test_clock);
+
+	struct gossip gsp;
+	struct gossip_node *gnode = make_gossip_node("graft-cap-key");
+	ASSERT_EQ(gossip_init(&gsp, gnode, 25812), 0);
+
+	// announced by two nodes gone, on a channel quiet after
+	struct gossip_seen_msg *msg = gossip_seen_add(&gsp.bcast_seen, 42);
+	ASSERT_TRUE(msg);
+	struct sockaddr_in addrs[2] = {};
+	for (int i = 0; i < 2; i++) {
+		addrs[i].sin_family = AF_INET;
+		addrs[i].sin_port = htons(25813 + i);
+		addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		ASSERT_EQ(gossip_seen_add_ihave(msg,
+			(struct sockaddr *)&addrs[i], sizeof(addrs[i])), 0);
+	}
+	msg->graft_time = test_now + GOSSIP_BCAST_TIMEOUT;
+
+	for (int round = 0; round < 20; round++) {
+		test_now += GOSSIP_BCAST_TIMEOUT;
+		gossip_loop_once(&gsp);
+	}
+
+	ASSERT_EQ(gsp.stats.tx_packets[GOSSIP_PHASE_GRAFT],
+	          2 * GOSSIP_BCAST_GRAFTS);
+	ASSERT_EQ(gsp.bcast_seen.nr_missing, 0);
+	ASSERT_FALSE(gossip_seen_find(&gsp.bcast_seen, 42));
+
+	gossip_close(&gsp);
+	gossip_set_clock(NULL);
+}
+
+static uint64_t first_bcast_id(struct gossip *gsp)
+{
+	if (gossip_broadcast(gsp, "event"))
+		return 0;
+	for (int i = 0; i < gsp->bcast_seen.nr_msgs; i++) {
+		if (gsp->bcast_seen.msgs[i].id)
+			return gsp->bcast_seen.msgs[i].id;
+	}
+	return 0;
+}
+
+TEST(gossip, bcast_ids_restart)
+{
+	// the same node run twice, rand() left as it starts
+	struct gossip gsps[2];
+	uint64_t ids[2];
+	for (int i = 0; i < 2; i++) {
+		srand(1);
+		struct gossip_node *gnode = make_gossip_node("restart-key");
+		ASSERT_EQ(gossip_init(&gsps[i], gnode, 25810 + i), 0);
+		ids[i] = first_bcast_id(&gsps[i]);
+		ASSERT_NE(ids[i], 0u);
+	}
+	ASSERT_NE(ids[0], ids[1]);
+
+	for (int i = 0; i < 2; i++)
+		gossip_close(&gsps[i]);
+}
+
+static bool engine_synced(struct gossip *gsp)
+{
+	gossip_engine_lock(gsp);
+	bool synced = gsp->nr_gnodes == 2 && gsp->nr_active_gnodes == 1;
+	gossip_engine_unlock(gsp);
+	return synced;
+}
+
+TEST(gossip, engine)
+{
+	const int nr = 3;
+	struct gossip_engine engs[2];
+	ASSERT_EQ(gossip_engine_init(&engs[0], 25742, 2), 0);
+	ASSERT_EQ(gossip_engine_init(&engs[1], 25743, 2), 0);
+
+	// a node of each cluster on each engine, on the port of its engine
+	struct gossip gsps[2][nr];
+	memset(gsps, 0, sizeof(gsps));
+	for (int e = 0; e < 2; e++) {
+		for (int i = 0; i < nr; i++) {
+			char pubkey[32];
+			snprintf(pubkey, sizeof(pubkey), "engine-%d-cluster-%d",
+			         e, i);
+			struct gossip_node *gnode = make_gossip_node(pubkey);
+			gossip_node_set_full(gnode, "127.0.0.1", 25742 + e);
+			gnode->version++;
+			ASSERT_EQ(gossip_engine_add(&engs[e], &gsps[e][i], gnode,
+			                            100 + i), 0);
+
+			gossip_engine_lock(&gsps[e][i]);
+			if (e) gossip_add_seeds(&gsps[e][i], "127.0.0.1:25742");
+			gossip_engine_unlock(&gsps[e][i]);
+		}
+	}
+
+	struct gossip dup;
+	struct gossip_node *dup_node = make_gossip_node("engine-dup");
+	ASSERT_EQ(gossip_engine_add(&engs[0], &dup, dup_node, 100), -1);
+	free_gossip_node(dup_node);
+
+	// a datagram of no cluster here goes nowhere
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in to = {};
+	to.sin_family = AF_INET;
+	to.sin_port = htons(25742);
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	const char stray[] = "\x02\xe7\x03\x00\x00{\"phase\":0}";
+	sendto(fd, stray, sizeof(stray) - 1, 0, (struct sockaddr *)&to,
+	       sizeof(to));
+	close(fd);
+
+	bool synced = false;
+	for (int wait = 0; wait < 150 && !synced; wait++) {
+		usleep(100000);
+		synced = true;
+		for (int e = 0; e < 2; e++)
+			for (int i = 0; i < nr; i++)
+				synced = synced && engine_synced(&gsps[e][i]);
+	}
+	ASSERT_TRUE(synced);
+
+	// each cluster has its own pair of nodes, and no node of the others
+	for (int i = 0; i < nr; i++) {
+		for (int j = 0; j < nr; j++) {
+			char pubkey[32];
+			snprintf(pubkey, sizeof(pubkey), "engine-1-cluster-%d", j);
+			struct gossip_node *peer = make_gossip_node(pubkey);
+
+			gossip_engine_lock(&gsps[0][i]);
+			bool found = gossip_find_node(&gsps[0][i], peer->pubid);
+			gossip_engine_unlock(&gsps[0][i]);
+			ASSERT_EQ(found, i == j);
+			free_gossip_node(peer);
+		}
+	}
+
+	for (int e = 0; e < 2; e++)
+		for (int i = 0; i < nr; i++)
+			gossip_close(&gsps[e][i]);
+	ASSERT_EQ(engs[0].nr_clusters, 0);
+
+	gossip_engine_close(&engs[1]);
+	gossip_engine_close(&engs[0]);
+	ASSERT_GE(engs[0].rx_dropped, 1);
+}
+
+TEST(gossip, shm)
+{
+	test_now = 1000;
+	gossip_set_clock(test_clock);
+
+	struct test_cluster c;
+	ASSERT_NO_FATAL_FAILURE(cluster_init(&c, 2, "shm-node", 25744));
+	struct gossip &seed = c.gsps[0], &client = c.gsps[1];
+
+	struct gossip_node *seed_node = cluster_node(&c, 0);
+	ASSERT_NO_FATAL_FAILURE(cluster_join(&c, 0, seed_node, NULL));
+
+	struct gossip_node *client_node = cluster_node(&c, 1);
+	JSON_ADD_STRING(gossip_node_get_data(client_node), "role", "cache");
+	ASSERT_NO_FATAL_FAILURE(cluster_join(&c, 1, client_node,
+	                                     "127.0.0.1:25744"));
+
+	char name[64];
+	snprintf(name, sizeof(name), "/gossip-test-%d", (int)getpid());
+	seed.shm_interval = 0;
+	ASSERT_EQ(gossip_export_shm(&seed, name, 16), 0);
+
+	struct gossip_shm reader;
+	struct gossip_shm_record rec;
+	ASSERT_EQ(gossip_shm_attach(&reader, name), 0);
+	ASSERT_EQ(gossip_shm_lookup(&reader, seed_node->pubid, &rec), 0);
+	ASSERT_EQ(rec.flags & GOSSIP_SHM_F_SELF, GOSSIP_SHM_F_SELF);
+	ASSERT_EQ(gossip_shm_lookup(&reader, client_node->pubid, &rec), -1);
+	uint64_t generation = gossip_shm_generation(&reader);
+
+	for (int i = 0; i < 3; i++) {
+		gossip_loop_once(&client);
+		gossip_loop_once(&seed);
+	}
+
+	// the client as the seed has it, data and all
+	ASSERT_GT(gossip_shm_generation(&reader), generation);
+	ASSERT_EQ(gossip_shm_lookup(&reader, client_node->pubid, &rec), 0);
+	ASSERT_EQ(rec.version, 1);
+	ASSERT_STREQ(rec.ipaddr, "127.0.0.1");
+	ASSERT_EQ(rec.port, 25745);
+	ASSERT_EQ(rec.flags, GOSSIP_SHM_F_FULL | GOSSIP_SHM_F_ACTIVE |
+	          GOSSIP_SHM_F_ALIVE);
+	ASSERT_EQ(std::string(rec.data, rec.data_len), "{\"role\":\"cache\"}");
+
+	struct gossip_shm_record recs[4];
+	ASSERT_EQ(gossip_shm_list(&reader, recs, 4), 2);
+
+	// a node that went silent stays, neither alive nor active
+	struct gossip_node *gone = gossip_find_node(&seed, client_node->pubid);
+	gone->alive_seen = test_now - GOSSIP_ALIVE_TIMEOUT - 1;
+	test_now += GOSSIP_INTERVAL_MAX;
+	gossip_loop_once(&seed);
+	gossip_loop_once(&seed);
+	ASSERT_EQ(gossip_shm_lookup(&reader, client_node->pubid, &rec), 0);
+	ASSERT_EQ(rec.flags, GOSSIP_SHM_F_FULL);
+
+	cluster_close(&c);
+	ASSERT_EQ(reader.hdr->pid, 0);
+	gossip_shm_close(&reader);
+	ASSERT_EQ(gossip_shm_attach(&reader, name), -1);
+}
+
+TEST(gossip, shm_table)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/gossip-test-table-%d", (int)getpid());
+
+	struct gossip_shm shm, reader;
+	ASSERT_EQ(gossip_shm_create(&shm, name, 8), 0);
+	ASSERT_EQ(gossip_shm_attach(&reader, name), 0);
+
+	// passes of a sliding window of nodes, deleting as many as they add
+	struct gossip_shm_record rec;
+	for (int pass = 0; pass < 100; pass++) {
+		gossip_shm_begin(&shm);
+		for (int i = pass; i < pass + 10; i++) {
+			memset(&rec, 0, sizeof(rec));
+			snprintf(rec.pubid, sizeof(rec.pubid), "node-%d", i);
+			rec.version = i;
+			rec.data_len = 2;
+			gossip_shm_put(&shm, &rec, "{}");
+		}
+		gossip_shm_end(&shm);
+
+		ASSERT_EQ(shm.hdr->nr_records, 8u);
+		ASSERT_EQ(shm.hdr->nr_dropped, 2u);
+		ASSERT_EQ(gossip_shm_lookup(&reader, "node-0", &rec), pass ? -1 : 0);
+		ASSERT_EQ(gossip_shm_lookup(&reader, "node-1", &rec), pass < 2 ? 0 : -1);
+		char pubid[16];
+		snprintf(pubid, sizeof(pubid), "node-%d", pass + 7);
+		ASSERT_EQ(gossip_shm_lookup(&reader, pubid, &rec), 0);
+		ASSERT_EQ(rec.version, pass + 7);
+		ASSERT_EQ(std::string(rec.data, rec.data_len), "{}");
+	}
+
+	struct gossip_shm_record recs[16];
+	ASSERT_EQ(gossip_shm_list(&reader, recs, 16), 8);
+
+	gossip_shm_close(&shm);
+	gossip_shm_close(&reader);
+}
+
+TEST(gossip, shm_takeover)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/gossip-test-takeover-%d", (int)getpid());
+
+	struct gossip_shm shm, other;
+	ASSERT_EQ(gossip_shm_create(&shm, name, 8), 0);
+
+	// not while the writer it names runs
+	shm.hdr->pid = getppid();
+	ASSERT_EQ(gossip_shm_create(&other, name, 8), -1);
+	ASSERT_EQ(errno, EBUSY);
+	ASSERT_EQ(shm.hdr->pid, getppid());
+
+	// but once it is gone
+	pid_t child = fork();
+	if (!child)
+		_exit(0);
+	ASSERT_EQ(waitpid(child, NULL, 0), child);
+	shm.hdr->pid = child;
+	ASSERT_EQ(gossip_shm_create(&other, name, 8), 0);
+	ASSERT_EQ(other.hdr->pid, getpid());
+
+	shm.writer = 0; // the segment is the other's now
+	gossip_shm_close(&shm);
+	gossip_shm_close(&other);
+}
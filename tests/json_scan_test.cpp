@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include "json_scan.h"
+
+TEST(json_scan, basic)
+{
+	const char *buf = "{\"phase\":1, \"gnodes\":[{\"pubid\":\"ab\",\"version\":-3},"
+	                  "{\"pubid\":\"c\\\"d\",\"data\":{\"x\":[1,2]}}, {}], "
+	                  "\"ok\":true}  ";
+	struct json_tok toks[32];
+
+	int nr = json_scan(buf, strlen(buf), toks, 32);
+	ASSERT_GT(nr, 0);
+	ASSERT_EQ(toks[0].type, JSON_TOK_OBJECT);
+	ASSERT_EQ(toks[0].size, 3);
+	ASSERT_EQ(toks[0].next, nr);
+	ASSERT_EQ(json_tok_get_int64(buf, toks, 0, "phase"), 1);
+
+	int gnodes = json_tok_get(buf, toks, 0, "gnodes");
+	ASSERT_EQ(toks[gnodes].type, JSON_TOK_ARRAY);
+	ASSERT_EQ(toks[gnodes].size, 3);
+
+	int i = 0;
+	json_tok_array_for_each(item, toks, gnodes) {
+		ASSERT_EQ(toks[item].type, JSON_TOK_OBJECT);
+		int pubid = json_tok_get(buf, toks, item, "pubid");
+		if (i == 0) {
+			ASSERT_TRUE(json_tok_streq(buf, &toks[pubid], "ab"));
+			ASSERT_EQ(json_tok_get_int64(
+				buf, toks, item, "version"), -3);
+		} else if (i == 1) {
+			ASSERT_TRUE(toks[pubid].escaped);
+			ASSERT_EQ(json_tok_get(buf, toks, item, "version"), -1);
+		} else {
+			ASSERT_EQ(pubid, -1);
+		}
+		i++;
+	}
+	ASSERT_EQ(i, 3);
+
+	int ok = json_tok_get(buf, toks, 0, "ok");
+	ASSERT_EQ(toks[ok].type, JSON_TOK_PRIMITIVE);
+	ASSERT_EQ(json_scan(buf, strlen(buf), toks, 4), JSON_SCAN_NOMEM);
+}
+
+TEST(json_scan, malformed)
+{
+	struct json_tok toks[16];
+	const char *bad[] = {
+		"", "{", "{\"a\"}", "{\"a\":}", "[1,]", "{\"a\":1}x",
+		"{a:1}", "\"abc", "nanana", "tru", "[true1]", "[nul]", "-",
+		"01", "1.", ".5", "1e", "1e+", "--1", "[1-2]", "[Infinity]",
+		"[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[]]]]]]]]"
+		"]]]]]]]]]]]]]]]]]]]]]]]]]]",
+	};
+
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+		ASSERT_LT(json_scan(bad[i], strlen(bad[i]), toks, 16), 0) << bad[i];
+}
+
+TEST(json_scan, primitives)
+{
+	struct json_tok toks[16];
+	const char *good[] = {
+		"true", "false", "null", "0", "-0", "12", "-3.25", "1e9",
+		"2.5E-3", "6e+2", "[true,false,null]", "{\"a\":-1.0e1}",
+	};
+
+	for (size_t i = 0; i < sizeof(good) / sizeof(good[0]); i++)
+		ASSERT_GT(json_scan(good[i], strlen(good[i]), toks, 16), 0) << good[i];
+}
@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+
+static const char dict[] = "{ \"pubid\": \"\", \"version\": 0 }";
+
+TEST(lz, roundtrip)
+{
+	char in[sizeof(dict) + 4096];
+	char out[4096];
+	char back[sizeof(dict) + 4096];
+	size_t len = 0;
+
+	memcpy(in, dict, sizeof(dict));
+	while (len < 3000) {
+		len += snprintf(in + sizeof(dict) + len, 64,
+		                "{ \"pubid\": \"%08x\", \"version\": %d }, ",
+		                rand(), rand() % 100);
+	}
+
+	int nr = lz_compress(in, sizeof(dict), len, out, sizeof(out));
+	ASSERT_GT(nr, 0);
+	ASSERT_LT((size_t)nr, len / 2);
+
+	memcpy(back, dict, sizeof(dict));
+	ASSERT_EQ(lz_decompress(out, nr, back, sizeof(dict), sizeof(back)),
+	          (int)len);
+	ASSERT_EQ(memcmp(back + sizeof(dict), in + sizeof(dict), len), 0);
+
+	// padding after the block is ignored once the output is complete
+	memset(out + nr, ' ', 64);
+	ASSERT_EQ(lz_decompress(out, nr + 64, back, sizeof(dict),
+	                        sizeof(dict) + len), (int)len);
+
+	// output too small, truncated or corrupted input
+	ASSERT_EQ(lz_compress(in, sizeof(dict), len, out, 16), -1);
+	ASSERT_EQ(lz_decompress(out, nr, back, sizeof(dict), sizeof(dict) + 16), -1);
+	ASSERT_NE(lz_decompress(out, nr / 2, back, sizeof(dict), sizeof(back)),
+	          (int)len);
+	out[1] ^= 0x7f;
+	ASSERT_NE(lz_decompress(out, nr, back, sizeof(dict), sizeof(back)),
+	          (int)len);
+}
+
+TEST(lz, incompressible)
+{
+	char in[256];
+	char out[512];
+	char back[256];
+
+	for (size_t i = 0; i < sizeof(in); i++)
+		in[i] = rand();
+
+	int nr = lz_compress(in, 0, sizeof(in), out, sizeof(out));
+	ASSERT_GT(nr, 0);
+	ASSERT_EQ(lz_decompress(out, nr, back, 0, sizeof(back)),
+	          (int)sizeof(in));
+	ASSERT_EQ(memcmp(in, back, sizeof(in)), 0);
+}
@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "serialize.h"
+
+struct foo {
+	int id;
+	int64_t stamp;
+	double ratio;
+	char *name;
+};
+
+#define FOO_SER_FIELDS(X) \
+	X(struct foo, id, SER_T_INT, NULL) \
+	X(struct foo, stamp, SER_T_INT64, NULL) \
+	X(struct foo, ratio, SER_T_DOUBLE, NULL) \
+	X(struct foo, name, SER_T_STRING, NULL)
+
+static const struct ser_meta foo_meta[] = {
+	FOO_SER_FIELDS(SER_META_X)
+	INIT_SER_META_NONE(),
+};
+
+DEFINE_SER_FUNCS(foo, struct foo, FOO_SER_FIELDS)
+
+TEST(serialize, specialized)
+{
+	struct foo src = { 7, 1LL << 40, 0.5, (char *)"foo" };
+
+	json_object *generic = serialize(&src, foo_meta);
+	json_object *special = foo_serialize(&src);
+	ASSERT_STREQ(JSON_DUMP(generic), JSON_DUMP(special));
+
+	struct foo dst = {0};
+	ASSERT_EQ(foo_deserialize(&dst, special), 0);
+	ASSERT_EQ(dst.id, 7);
+	ASSERT_EQ(dst.stamp, 1LL << 40);
+	ASSERT_EQ(dst.ratio, 0.5);
+	ASSERT_STREQ(dst.name, "foo");
+	free(dst.name);
+
+	json_object_object_del(special, "stamp");
+	ASSERT_EQ(foo_deserialize(&dst, special), -1);
+	ASSERT_EQ(deserialize(&dst, foo_meta, special), -1);
+
+	json_object_put(generic);
+	json_object_put(special);
+}
+
+struct bar {
+	struct foo head;
+	struct ser_array foos;
+	struct ser_array ints;
+	struct ser_array names;
+};
+
+static const struct ser_meta bar_meta[] = {
+	INIT_SER_META(struct bar, head, SER_T_OBJECT, foo_meta),
+	INIT_SER_META_ARRAY_OBJECT(struct bar, foos, foo_meta, struct foo),
+	INIT_SER_META(struct bar, ints, SER_T_ARRAY_INT64, NULL),
+	INIT_SER_META(struct bar, names, SER_T_ARRAY_STRING, NULL),
+	INIT_SER_META_NONE(),
+};
+
+TEST(serialize, nested)
+{
+	struct foo foos[2] = {
+		{ 1, 10, 1.5, (char *)"a\"b" },
+		{ 2, 20, 2.0, (char *)"line\n" },
+	};
+	int64_t ints[3] = { -1, 0, 1LL << 50 };
+	const char *names[2] = { "x", "y" };
+	struct bar src = {
+		{ 0, 0, 0.25, (char *)"head" },
+		{ 2, foos }, { 3, ints }, { 2, names },
+	};
+
+	json_object *root = serialize(&src, bar_meta);
+	struct bar dst;
+	memset(&dst, 0, sizeof(dst));
+	ASSERT_EQ(deserialize(&dst, bar_meta, root), 0);
+	ASSERT_STREQ(dst.head.name, "head");
+	ASSERT_EQ(dst.foos.nr, 2U);
+	ASSERT_STREQ(((struct foo *)dst.foos.items)[0].name, "a\"b");
+	ASSERT_EQ(((struct foo *)dst.foos.items)[1].stamp, 20);
+	ASSERT_EQ(dst.ints.nr, 3U);
+	ASSERT_EQ(((int64_t *)dst.ints.items)[2], 1LL << 50);
+	ASSERT_STREQ(((char **)dst.names.items)[1], "y");
+
+	// streaming output parses back to the same tree
+	char buf[512];
+	size_t len = ser_dump(&src, bar_meta, buf, sizeof(buf));
+	ASSERT_LT(len, sizeof(buf));
+	ASSERT_EQ(len, strlen(buf));
+	JSON_PARSE(dumped, buf, len);
+	ASSERT_TRUE(dumped != NULL);
+	ASSERT_TRUE(json_object_equal(root, dumped));
+
+	// truncated output still reports the full length
+	char small[16];
+	ASSERT_EQ(ser_dump(&src, bar_meta, small, sizeof(small)), len);
+	ASSERT_EQ(strlen(small), sizeof(small) - 1);
+
+	json_object_put(dumped);
+	ser_free(&dst, bar_meta);
+	ASSERT_EQ(dst.foos.nr, 0U);
+
+	// an array of objects needs the size of its items
+	const struct ser_meta sizeless_meta[] = {
+		{ "foos", SER_T_ARRAY_OBJECT, foo_meta,
+		  offsetof(struct bar, foos), 0 },
+		INIT_SER_META_NONE(),
+	};
+	ASSERT_EQ(deserialize(&dst, sizeless_meta, root), -1);
+	ASSERT_EQ(dst.foos.nr, 0U);
+
+	json_object_put(root);
+}
+
+TEST(serialize, specialized_dump)
+{
+	struct foo src = { 7, -5, 0.5, (char *)"foo" };
+	char buf[128];
+	struct ser_buf sb;
+
+	ser_buf_init(&sb, buf, sizeof(buf));
+	foo_dump(&src, &sb);
+	ser_dump(&src, foo_meta, buf + 64, 64);
+	ASSERT_STREQ(buf, buf + 64);
+}